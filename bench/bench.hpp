@@ -0,0 +1,80 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+#include <vector>
+
+// A minimal benchmark harness; there's no framework to pull in for this.
+//
+// Each benchmark is run in batches sized to take about 10ms, until enough time has
+// passed, and the median and fastest batch are reported per operation.
+namespace bench
+{
+
+// Keeps the optimiser from throwing away a result
+template<class T>
+inline void
+do_not_optimize(const T& value)
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct result
+{
+	double median_ns;
+	double min_ns;
+	std::uint64_t iterations;
+};
+
+template<class F>
+result
+run(std::string_view name, F&& fn, std::chrono::milliseconds min_time = std::chrono::milliseconds{500})
+{
+	using clock = std::chrono::steady_clock;
+
+	auto time_batch = [&](std::uint64_t n)
+	{
+		auto const start = clock::now();
+		for(std::uint64_t i = 0; i < n; i++)
+			fn();
+		return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+	};
+
+	// Find a batch size that takes long enough to time accurately; this doubles as the warmup
+	std::uint64_t batch = 1;
+	while(batch < (std::uint64_t{1} << 30) && time_batch(batch) < 10e6)
+		batch *= 2;
+
+	std::vector<double> per_op;
+	auto const deadline = clock::now() + min_time;
+	while(per_op.size() < 5 || clock::now() < deadline)
+		per_op.push_back(time_batch(batch) / static_cast<double>(batch));
+
+	std::sort(per_op.begin(), per_op.end());
+	result r{per_op[per_op.size() / 2], per_op.front(), batch * per_op.size()};
+
+	std::printf("%-40.*s %12.1f ns/op (min %.1f, %llu iterations)\n",
+		static_cast<int>(name.size()), name.data(), r.median_ns, r.min_ns,
+		static_cast<unsigned long long>(r.iterations));
+	return r;
+}
+
+// The value at a percentile (0-100) of some sorted samples
+template<class T>
+T
+percentile(const std::vector<T>& sorted, double p)
+{
+	if(sorted.empty())
+		return T{};
+
+	auto const index = static_cast<std::size_t>(p / 100.0 * static_cast<double>(sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+} // namespace bench
+
+#endif // BENCH_H
@@ -0,0 +1,126 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "urlcheck.hpp"
+
+// Differential fuzzing of the URL scanning kernels.
+// Usage: bench_fuzz [iterations] [seed]
+//
+// Every kernel this CPU can run has to give the same answer as the scalar one for
+// random inputs, at random lengths and alignments. Inputs are mostly the bytes the
+// kernels look for, and bytes either side of them, so every lane sees them often.
+
+// What a kernel made of an input
+struct outcome
+{
+	urlcheck::url_error decode_error;
+	std::string decoded;
+	urlcheck::url_error check_error;
+	std::string checked;
+
+	bool
+	operator==(const outcome&) const = default;
+};
+
+static outcome
+run_kernel(std::string_view kernel, std::string_view input)
+{
+	urlcheck::use_kernel(kernel);
+
+	outcome o;
+	o.decode_error = urlcheck::decode_url(input, o.decoded);
+	o.checked = input;
+	o.check_error = urlcheck::check_url(o.checked);
+	return o;
+}
+
+static void
+dump(const char* what, std::string_view s)
+{
+	std::fprintf(stderr, "%-9s (%3zu bytes):", what, s.size());
+	for(unsigned char c : s)
+		std::fprintf(stderr, " %02x", c);
+	std::fputc('\n', stderr);
+}
+
+static void
+dump(const char* what, urlcheck::url_error got, urlcheck::url_error expected)
+{
+	auto const g = urlcheck::describe(got);
+	auto const e = urlcheck::describe(expected);
+	std::fprintf(stderr, "%s: %.*s, expected %.*s\n", what,
+		static_cast<int>(g.size()), g.data(), static_cast<int>(e.size()), e.data());
+}
+
+int
+main(int argc, char* argv[])
+{
+	std::uint64_t const iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+	std::uint64_t const seed = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : std::random_device{}();
+
+	auto const kernels = urlcheck::kernels();
+	std::printf("Checking %zu kernels against scalar, %llu inputs, seed %llu\n", kernels.size(),
+		static_cast<unsigned long long>(iterations), static_cast<unsigned long long>(seed));
+
+	using namespace std::literals;
+	static const std::string_view interesting =
+		"%+\x00\x01\x1f\x20\x7e\x7f\x80\xff" "0123456789abcdefABCDEF:/?#@[]._-"sv;
+	static const std::string_view prefixes[] = {"", "https://", "http://example.com/", "https%3A%2F%2F"};
+
+	std::mt19937_64 rng{seed};
+	std::string buffer;
+	for(std::uint64_t i = 0; i < iterations; i++)
+	{
+		// Long enough to go through the vector loops a few times and finish in the tail
+		auto const length = rng() % 160;
+		auto const offset = rng() % 32;
+
+		buffer.assign(prefixes[rng() % std::size(prefixes)]);
+		buffer.insert(0, offset, 'x');
+		for(std::size_t j = 0; j < length; j++)
+		{
+			auto const r = rng();
+			switch(r % 4)
+			{
+			case 0:
+				buffer.push_back(static_cast<char>(r >> 8));
+				break;
+			case 1:
+				buffer.push_back(interesting[(r >> 8) % interesting.size()]);
+				break;
+			default:
+				buffer.push_back(static_cast<char>('a' + (r >> 8) % 26));
+				break;
+			}
+		}
+
+		std::string_view const input = std::string_view{buffer}.substr(offset);
+		auto const expected = run_kernel("scalar", input);
+		for(auto kernel : kernels)
+		{
+			if(run_kernel(kernel, input) == expected)
+				continue;
+
+			std::fprintf(stderr, "The %.*s kernel differs from scalar on input %llu\n",
+				static_cast<int>(kernel.size()), kernel.data(), static_cast<unsigned long long>(i));
+			dump("input", input);
+
+			auto const got = run_kernel(kernel, input);
+			dump("decode_url", got.decode_error, expected.decode_error);
+			dump("decoded", got.decoded);
+			dump("expected", expected.decoded);
+			dump("check_url", got.check_error, expected.check_error);
+			dump("checked", got.checked);
+			dump("expected", expected.checked);
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::printf("No differences\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,321 @@
+#ifndef BOOST_BEAST_USE_STD_STRING_VIEW
+#	define BOOST_BEAST_USE_STD_STRING_VIEW
+#endif // BOOST_BEAST_USE_STD_STRING_VIEW
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+
+#include "daemon.hpp"
+#include "log.hpp"
+#include "mime.hpp"
+#include "server_state.hpp"
+#include "session.hpp"
+
+#include "server.hpp"
+
+// Measures what idle keep-alive connections cost the server.
+//
+// The server runs in a child process so its memory can be measured on its own. Each
+// connection sends one request over loopback and then sits idle; the growth in the
+// server's resident set is reported per connection, for plain HTTP and TLS. Kernel
+// socket buffers aren't included, as they don't show up in the resident set.
+//
+// Usage: bench_idle [options] <docroot> <mimetypes.txt>
+//   --connections N	Idle connections to open (default: 1000)
+//   --threads N		Server threads (default: 2)
+
+namespace beast = boost::beast;		// from <boost/beast.hpp>
+namespace http = beast::http;		// from <boost/beast/http.hpp>
+namespace net = boost::asio;		// from <boost/asio.hpp>
+namespace ssl = boost::asio::ssl;	// from <boost/asio/ssl.hpp>
+using tcp = boost::asio::ip::tcp;	// from <boost/asio/ip/tcp.hpp>
+
+struct options
+{
+	unsigned connections = 1000;
+	unsigned threads = 2;
+	std::string doc_root;
+	std::string mimetypes;
+};
+
+static bool
+parse_args(int argc, char* argv[], options& opts)
+{
+	std::vector<std::string_view> positional;
+	for(int i = 1; i < argc; i++)
+	{
+		std::string_view arg{argv[i]};
+		auto number = [&](unsigned& out)
+		{
+			if(i + 1 >= argc)
+				return false;
+			out = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+			return out > 0;
+		};
+
+		if(arg == "--connections")
+		{
+			if(!number(opts.connections))
+				return false;
+		}
+		else if(arg == "--threads")
+		{
+			if(!number(opts.threads))
+				return false;
+		}
+		else
+			positional.push_back(arg);
+	}
+
+	if(positional.size() != 2)
+		return false;
+
+	opts.doc_root = positional[0];
+	opts.mimetypes = positional[1];
+	return true;
+}
+
+// Resident set of a process, in bytes
+static std::uint64_t
+resident_bytes(pid_t pid)
+{
+	std::ifstream status{"/proc/" + std::to_string(pid) + "/status"};
+	std::string line;
+	while(std::getline(status, line))
+	{
+		if(line.rfind("VmRSS:", 0) == 0)
+			return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+	}
+
+	return 0;
+}
+
+// Runs the server until it's killed, after telling the parent which port it got
+[[noreturn]] static void
+serve(const options& opts, const server_state::Config& config, int port_fd)
+{
+	ssl::context server_ctx{ssl::context::tlsv12};
+	if(!bench::use_self_signed(server_ctx))
+	{
+		std::fprintf(stderr, "Could not make a certificate\n");
+		std::_Exit(EXIT_FAILURE);
+	}
+
+	server_state::StateHolder holder{std::make_shared<const server_state::ServerState>(
+		config, mime_type::MimeTypeMap{opts.mimetypes}, std::move(server_ctx))};
+
+	net::io_context ioc{static_cast<int>(opts.threads)};
+	server_state::Listen where;
+	where.address = "127.0.0.1";
+	auto l = std::make_shared<session::listener>(ioc, where, holder);
+	l->run();
+
+	tcp::endpoint bound;
+	socklen_t len = static_cast<socklen_t>(bound.capacity());
+	std::uint16_t port = 0;
+	if(getsockname(l->native_handle(), bound.data(), &len) == 0)
+	{
+		bound.resize(len);
+		port = bound.port();
+	}
+	(void)!write(port_fd, &port, sizeof(port));
+	close(port_fd);
+
+	std::vector<std::thread> threads;
+	for(unsigned i = 1; i < opts.threads; i++)
+		threads.emplace_back([&ioc] { ioc.run(); });
+	ioc.run();
+	std::_Exit(EXIT_SUCCESS);
+}
+
+// An open connection that's had one response and is now idle
+struct idle_client
+{
+	tcp::socket socket;
+	std::unique_ptr<ssl::stream<tcp::socket&>> tls;
+};
+
+template<class Stream>
+static bool
+one_request(Stream& stream)
+{
+	http::request<http::empty_body> req{http::verb::get, "/robots.txt", 11};
+	req.set(http::field::host, "localhost");
+
+	beast::flat_buffer buffer;
+	http::response<http::string_body> res;
+	http::write(stream, req);
+	http::read(stream, buffer, res);
+	return res.result() == http::status::ok && res.keep_alive();
+}
+
+static bool
+open_idle(net::io_context& ioc, ssl::context& client_ctx, std::uint16_t port, bool tls,
+	std::vector<idle_client>& clients)
+{
+	try
+	{
+		auto& c = clients.emplace_back(idle_client{tcp::socket{ioc}, nullptr});
+		c.socket.connect({net::ip::make_address("127.0.0.1"), port});
+
+		if(!tls)
+			return one_request(c.socket);
+
+		c.tls = std::make_unique<ssl::stream<tcp::socket&>>(c.socket, client_ctx);
+		c.tls->handshake(ssl::stream_base::client);
+		return one_request(*c.tls);
+	}
+	catch(const std::exception& e)
+	{
+		std::fprintf(stderr, "Connection %zu failed: %s\n", clients.size(), e.what());
+		return false;
+	}
+}
+
+int
+main(int argc, char* argv[])
+{
+	options opts;
+	if(!parse_args(argc, argv, opts))
+	{
+		std::fprintf(stderr, "Usage: %s [--connections N] [--threads N] <docroot> <mimetypes.txt>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	openlog("bench_idle", LOG_PERROR, LOG_USER);
+	(void)logging::set_log_level("warning");
+
+	// Both ends of every connection are in this process or its child
+	(void)daemonise::set_rlimit();
+	if(daemonise::fd_limit() < opts.connections + 64)
+	{
+		std::fprintf(stderr, "The file descriptor limit (%zu) is too low for %u connections\n",
+			daemonise::fd_limit(), opts.connections);
+		return EXIT_FAILURE;
+	}
+
+	char tmpl[] = "/tmp/shadyurl-bench-XXXXXX";
+	if(!mkdtemp(tmpl))
+	{
+		std::perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	std::filesystem::path tmpdir{tmpl};
+
+	server_state::Config config;
+	config.doc_root = std::filesystem::absolute(opts.doc_root).string();
+	config.db_path = (tmpdir / "urls.db").string();
+	config.hostname = "localhost";
+	config.threads = opts.threads;
+
+	// Nothing should time out while we're measuring
+	config.idle_timeout = 3600;
+	config.overload_percent = 0;
+
+	if(!bench::make_database(config.db_path))
+	{
+		std::fprintf(stderr, "Could not create %s\n", config.db_path.c_str());
+		std::filesystem::remove_all(tmpdir);
+		return EXIT_FAILURE;
+	}
+
+	// Fork before any threads are started
+	int port_pipe[2];
+	if(pipe(port_pipe) == -1)
+	{
+		std::perror("pipe");
+		std::filesystem::remove_all(tmpdir);
+		return EXIT_FAILURE;
+	}
+
+	pid_t const server = fork();
+	if(server == -1)
+	{
+		std::perror("fork");
+		std::filesystem::remove_all(tmpdir);
+		return EXIT_FAILURE;
+	}
+	if(server == 0)
+	{
+		close(port_pipe[0]);
+		serve(opts, config, port_pipe[1]);
+	}
+
+	close(port_pipe[1]);
+	std::uint16_t port = 0;
+	if(read(port_pipe[0], &port, sizeof(port)) != sizeof(port) || port == 0)
+	{
+		std::fprintf(stderr, "The server didn't start\n");
+		kill(server, SIGKILL);
+		waitpid(server, nullptr, 0);
+		std::filesystem::remove_all(tmpdir);
+		return EXIT_FAILURE;
+	}
+	close(port_pipe[0]);
+
+	net::io_context ioc;
+	ssl::context client_ctx{ssl::context::tlsv12_client};
+	client_ctx.set_verify_mode(ssl::verify_none);
+
+	std::printf("%u idle connections, %u server threads\n", opts.connections, opts.threads);
+	std::printf("%-6s %14s %14s %12s\n", "", "RSS before", "RSS after", "per conn");
+
+	bool ok = true;
+	for(bool tls : {false, true})
+	{
+		// The TLS streams point at the sockets, so these mustn't move
+		std::vector<idle_client> clients;
+		clients.reserve(std::max(opts.connections, 16u));
+
+		// Warm up, so one-off costs like the static file cache and TLS setup aren't counted
+		for(int i = 0; i < 16 && ok; i++)
+			ok = open_idle(ioc, client_ctx, port, tls, clients);
+		clients.clear();
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+		auto const before = resident_bytes(server);
+		for(unsigned i = 0; i < opts.connections && ok; i++)
+			ok = open_idle(ioc, client_ctx, port, tls, clients);
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		auto const after = resident_bytes(server);
+
+		if(!ok)
+			break;
+
+		std::printf("%-6s %11.1f MB %11.1f MB %10.0f B\n", tls ? "TLS" : "plain",
+			static_cast<double>(before) / 1e6, static_cast<double>(after) / 1e6,
+			(static_cast<double>(after) - static_cast<double>(before)) / opts.connections);
+
+		// Let the server see them all close before the next round
+		clients.clear();
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	}
+
+	kill(server, SIGKILL);
+	waitpid(server, nullptr, 0);
+	std::filesystem::remove_all(tmpdir);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
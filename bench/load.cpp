@@ -0,0 +1,392 @@
+#ifndef BOOST_BEAST_USE_STD_STRING_VIEW
+#	define BOOST_BEAST_USE_STD_STRING_VIEW
+#endif // BOOST_BEAST_USE_STD_STRING_VIEW
+
+#include <sys/socket.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+
+#include "log.hpp"
+#include "mime.hpp"
+#include "server_state.hpp"
+#include "session.hpp"
+#include "token_filter.hpp"
+
+#include "bench.hpp"
+#include "server.hpp"
+
+// An in-process load generator.
+//
+// This starts the real listener and sessions on loopback, with a temporary database
+// and a throwaway self-signed certificate, and drives them with blocking clients, one
+// thread per connection. Throughput and latency percentiles are printed at the end.
+//
+// Usage: bench_load [options] <docroot> <mimetypes.txt>
+//   --tls			Connect with TLS (default: plain HTTP)
+//   --connections N	Concurrent connections (default: 16)
+//   --requests N		Requests per connection (default: 2000)
+//   --threads N		Server threads (default: 2)
+//   --mix get|redirect|miss|post|file|bulk|resolve|all	What to request (default: all)
+//   --batch N		URLs or tokens in each bulk or resolve request (default: 1000)
+//
+// The bulk and resolve mixes aren't part of all; they report URLs shortened
+// or tokens resolved a second as well. The miss mix asks for what scanners do,
+// and tokens we don't have, which the token filter turns away.
+
+namespace beast = boost::beast;		// from <boost/beast.hpp>
+namespace http = beast::http;		// from <boost/beast/http.hpp>
+namespace net = boost::asio;		// from <boost/asio.hpp>
+namespace ssl = boost::asio::ssl;	// from <boost/asio/ssl.hpp>
+using tcp = boost::asio::ip::tcp;	// from <boost/asio/ip/tcp.hpp>
+
+struct options
+{
+	bool tls = false;
+	unsigned connections = 16;
+	unsigned requests = 2000;
+	unsigned threads = 2;
+	std::string mix = "all";
+	unsigned batch = 1000;
+	std::string doc_root;
+	std::string mimetypes;
+};
+
+static bool
+parse_args(int argc, char* argv[], options& opts)
+{
+	std::vector<std::string_view> positional;
+	for(int i = 1; i < argc; i++)
+	{
+		std::string_view arg{argv[i]};
+		auto number = [&](unsigned& out)
+		{
+			if(i + 1 >= argc)
+				return false;
+			out = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+			return out > 0;
+		};
+
+		if(arg == "--tls")
+			opts.tls = true;
+		else if(arg == "--connections")
+		{
+			if(!number(opts.connections))
+				return false;
+		}
+		else if(arg == "--requests")
+		{
+			if(!number(opts.requests))
+				return false;
+		}
+		else if(arg == "--threads")
+		{
+			if(!number(opts.threads))
+				return false;
+		}
+		else if(arg == "--batch")
+		{
+			if(!number(opts.batch))
+				return false;
+		}
+		else if(arg == "--mix" && i + 1 < argc)
+			opts.mix = argv[++i];
+		else
+			positional.push_back(arg);
+	}
+
+	if(positional.size() != 2)
+		return false;
+
+	opts.doc_root = positional[0];
+	opts.mimetypes = positional[1];
+	return opts.mix == "get" || opts.mix == "redirect" || opts.mix == "miss" || opts.mix == "post" || opts.mix == "file" ||
+		opts.mix == "bulk" || opts.mix == "resolve" || opts.mix == "all";
+}
+
+struct client_result
+{
+	std::vector<std::uint32_t> micros;
+	std::uint64_t errors = 0;
+};
+
+static http::request<http::string_body>
+make_request(const options& opts, unsigned conn, unsigned n)
+{
+	std::string_view kind = opts.mix;
+	if(kind == "all")
+	{
+		static const std::string_view kinds[] = {"get", "redirect", "redirect", "post", "file"};
+		kind = kinds[n % std::size(kinds)];
+	}
+
+	if(kind == "get")
+	{
+		http::request<http::string_body> req{http::verb::get, "/", 11};
+		req.set(http::field::host, "localhost");
+		return req;
+	}
+
+	if(kind == "miss")
+	{
+		// Half are junk, half look like tokens but aren't stored
+		std::string target = "/wp-login.php";
+		if(n % 2)
+			target = "/missing-" + std::to_string(conn) + "-" + std::to_string(n) + ".txt";
+
+		http::request<http::string_body> req{http::verb::get, target, 11};
+		req.set(http::field::host, "localhost");
+		return req;
+	}
+
+	if(kind == "file")
+	{
+		http::request<http::string_body> req{http::verb::get, "/robots.txt", 11};
+		req.set(http::field::host, "localhost");
+		return req;
+	}
+
+	if(kind == "redirect")
+	{
+		http::request<http::string_body> req{http::verb::get,
+			"/" + bench::seeded_token(static_cast<int>((conn * 7919 + n) % bench::seeded_tokens)), 11};
+		req.set(http::field::host, "localhost");
+		return req;
+	}
+
+	// URLs have to be unique
+	if(kind == "bulk")
+	{
+		http::request<http::string_body> req{http::verb::post, "/bulk", 11};
+		req.set(http::field::host, "localhost");
+		req.set(http::field::content_type, "text/plain");
+		for(unsigned i = 0; i < opts.batch; i++)
+		{
+			req.body() += "https://example.com/bulk/" + std::to_string(conn) + "/" + std::to_string(n) +
+				"/" + std::to_string(i) + "\n";
+		}
+		req.prepare_payload();
+		return req;
+	}
+
+	if(kind == "resolve")
+	{
+		http::request<http::string_body> req{http::verb::post, "/resolve", 11};
+		req.set(http::field::host, "localhost");
+		req.set(http::field::content_type, "text/plain");
+		for(unsigned i = 0; i < opts.batch; i++)
+			req.body() += bench::seeded_token(static_cast<int>((conn * 7919 + n + i) % bench::seeded_tokens)) + "\n";
+		req.prepare_payload();
+		return req;
+	}
+
+	http::request<http::string_body> req{http::verb::post, "/post.html", 11};
+	req.set(http::field::host, "localhost");
+	req.set(http::field::content_type, "application/x-www-form-urlencoded");
+	req.body() = "url=https%3A%2F%2Fexample.com%2Fbench%2F" + std::to_string(conn) + "%2F" + std::to_string(n);
+	req.prepare_payload();
+	return req;
+}
+
+template<class Stream>
+static void
+run_client(Stream& stream, const options& opts, unsigned conn, client_result& result)
+{
+	using clock = std::chrono::steady_clock;
+
+	beast::flat_buffer buffer;
+	result.micros.reserve(opts.requests);
+
+	for(unsigned n = 0; n < opts.requests; n++)
+	{
+		auto req = make_request(opts, conn, n);
+		http::response<http::string_body> res;
+
+		auto const start = clock::now();
+		http::write(stream, req);
+		http::read(stream, buffer, res);
+		auto const elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+
+		result.micros.push_back(static_cast<std::uint32_t>(elapsed.count()));
+		if(res.result_int() >= 400)
+			result.errors++;
+	}
+}
+
+static void
+client(const options& opts, unsigned short port, unsigned conn, ssl::context& client_ctx, client_result& result)
+{
+	try
+	{
+		net::io_context ioc;
+		tcp::endpoint endpoint{net::ip::make_address("127.0.0.1"), port};
+
+		if(opts.tls)
+		{
+			ssl::stream<tcp::socket> stream{ioc, client_ctx};
+			stream.next_layer().connect(endpoint);
+			stream.next_layer().set_option(tcp::no_delay(true));
+			stream.handshake(ssl::stream_base::client);
+			run_client(stream, opts, conn, result);
+		}
+		else
+		{
+			tcp::socket stream{ioc};
+			stream.connect(endpoint);
+			stream.set_option(tcp::no_delay(true));
+			run_client(stream, opts, conn, result);
+		}
+	}
+	catch(const std::exception& e)
+	{
+		std::fprintf(stderr, "Connection %u failed: %s\n", conn, e.what());
+		result.errors += opts.requests - result.micros.size();
+	}
+}
+
+int
+main(int argc, char* argv[])
+{
+	options opts;
+	if(!parse_args(argc, argv, opts))
+	{
+		std::fprintf(stderr, "Usage: %s [--tls] [--connections N] [--requests N] [--threads N] "
+			"[--mix get|redirect|miss|post|file|bulk|resolve|all] [--batch N] <docroot> <mimetypes.txt>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// Errors from the server go to stderr as well
+	openlog("bench_load", LOG_PERROR, LOG_USER);
+	(void)logging::set_log_level("warning");
+
+	char tmpl[] = "/tmp/shadyurl-bench-XXXXXX";
+	if(!mkdtemp(tmpl))
+	{
+		std::perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	std::filesystem::path tmpdir{tmpl};
+
+	server_state::Config config;
+	config.doc_root = std::filesystem::absolute(opts.doc_root).string();
+	config.db_path = (tmpdir / "urls.db").string();
+	config.hostname = "localhost";
+	config.threads = opts.threads;
+
+	if(!bench::make_database(config.db_path))
+	{
+		std::fprintf(stderr, "Could not create %s\n", config.db_path.c_str());
+		std::filesystem::remove_all(tmpdir);
+		return EXIT_FAILURE;
+	}
+
+	if(!token_filter::init(config.db_path, config.filter_tokens, config.filter_bits_per_token))
+	{
+		std::fprintf(stderr, "Could not load the token filter\n");
+		std::filesystem::remove_all(tmpdir);
+		return EXIT_FAILURE;
+	}
+
+	ssl::context server_ctx{ssl::context::tlsv12};
+	if(!bench::use_self_signed(server_ctx))
+	{
+		std::fprintf(stderr, "Could not make a certificate\n");
+		std::filesystem::remove_all(tmpdir);
+		return EXIT_FAILURE;
+	}
+
+	server_state::StateHolder holder{std::make_shared<const server_state::ServerState>(
+		config, mime_type::MimeTypeMap{opts.mimetypes}, std::move(server_ctx))};
+
+	// Any free port will do
+	net::io_context ioc{static_cast<int>(opts.threads)};
+	server_state::Listen where;
+	where.address = "127.0.0.1";
+	auto l = std::make_shared<session::listener>(ioc, where, holder);
+	l->run();
+
+	tcp::endpoint bound;
+	socklen_t len = static_cast<socklen_t>(bound.capacity());
+	if(getsockname(l->native_handle(), bound.data(), &len) == -1)
+	{
+		std::perror("getsockname");
+		std::filesystem::remove_all(tmpdir);
+		return EXIT_FAILURE;
+	}
+	bound.resize(len);
+
+	std::vector<std::thread> server_threads;
+	for(unsigned i = 0; i < opts.threads; i++)
+		server_threads.emplace_back([&ioc] { ioc.run(); });
+
+	ssl::context client_ctx{ssl::context::tlsv12_client};
+	client_ctx.set_verify_mode(ssl::verify_none);
+
+	std::vector<client_result> results(opts.connections);
+	std::vector<std::thread> clients;
+
+	auto const start = std::chrono::steady_clock::now();
+	for(unsigned i = 0; i < opts.connections; i++)
+	{
+		clients.emplace_back([&, i]
+		{
+			client(opts, bound.port(), i, client_ctx, results[i]);
+		});
+	}
+	for(auto& t : clients)
+		t.join();
+	auto const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	l->stop();
+	ioc.stop();
+	for(auto& t : server_threads)
+		t.join();
+
+	std::vector<std::uint32_t> all;
+	std::uint64_t errors = 0;
+	for(auto& r : results)
+	{
+		all.insert(all.end(), r.micros.begin(), r.micros.end());
+		errors += r.errors;
+	}
+	std::sort(all.begin(), all.end());
+
+	std::printf("%s, %u connections, %u server threads, mix %s\n",
+		opts.tls ? "TLS" : "plain", opts.connections, opts.threads, opts.mix.c_str());
+	std::printf("%zu requests in %.2f s: %.0f requests/s, %llu errors\n",
+		all.size(), seconds, static_cast<double>(all.size()) / seconds,
+		static_cast<unsigned long long>(errors));
+	if(opts.mix == "bulk")
+	{
+		auto const urls = static_cast<double>(all.size()) * opts.batch;
+		std::printf("%.0f URLs in batches of %u: %.0f URLs/s\n", urls, opts.batch, urls / seconds);
+	}
+	else if(opts.mix == "resolve")
+	{
+		auto const tokens = static_cast<double>(all.size()) * opts.batch;
+		std::printf("%.0f tokens in batches of %u: %.0f tokens/s\n", tokens, opts.batch, tokens / seconds);
+	}
+	std::printf("latency (us): p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+		bench::percentile(all, 50), bench::percentile(all, 90), bench::percentile(all, 99),
+		bench::percentile(all, 99.9), all.empty() ? 0u : all.back());
+
+	std::filesystem::remove_all(tmpdir);
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
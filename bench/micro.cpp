@@ -0,0 +1,282 @@
+#ifndef BOOST_BEAST_USE_STD_STRING_VIEW
+#	define BOOST_BEAST_USE_STD_STRING_VIEW
+#endif // BOOST_BEAST_USE_STD_STRING_VIEW
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio/ssl/context.hpp>
+#include <boost/beast/http.hpp>
+
+#include "generate.hpp"
+#include "mime.hpp"
+#include "multipart_wrapper.hpp"
+#include "parseqs.hpp"
+#include "request.hpp"
+#include "server_state.hpp"
+#include "urlcheck.hpp"
+
+#include "bench.hpp"
+
+// Microbenchmarks for the request hot paths.
+// Usage: bench_micro <suite> [mimetypes.txt]
+//
+// Suites: parseqs, generate, mime, routing, multipart, urlcheck, or all
+
+namespace http = boost::beast::http;
+namespace ssl = boost::asio::ssl;
+
+static const char form_body[] =
+	"url=https%3A%2F%2Fexample.com%2Fsome%2Flonger%2Fpath%3Fwith%3Dquery%26and%3Dmore"
+	"&submit=Make+it+shady";
+
+static void
+bench_parseqs()
+{
+	bench::run("parseqs::parse_qsl", []
+	{
+		auto params = parseqs::parse_qsl(form_body);
+		bench::do_not_optimize(params);
+	});
+
+	bench::run("parseqs::find_param + unquote", []
+	{
+		auto url = parseqs::find_param(form_body, "url");
+		auto value = parseqs::unquote(*url);
+		bench::do_not_optimize(value);
+	});
+
+	char buf[sizeof(form_body)];
+	bench::run("parseqs::unquote_into", [&]
+	{
+		auto len = parseqs::unquote_into(form_body, buf);
+		bench::do_not_optimize(len);
+	});
+}
+
+static void
+bench_generate()
+{
+	bench::run("generate::generate_random_filename", []
+	{
+		auto name = generate::generate_random_filename();
+		bench::do_not_optimize(name);
+	});
+
+	auto const token = generate::generate_random_filename();
+	bench::run("generate::looks_generated", [&]
+	{
+		auto shaped = generate::looks_generated(token);
+		bench::do_not_optimize(shaped);
+	});
+}
+
+// Every scanning kernel this CPU can run, on a short escaped URL and a long clean one
+static void
+bench_urlcheck()
+{
+	static const std::string_view escaped =
+		"https%3A%2F%2Fexample.com%2Fsome%2Flonger%2Fpath%3Fwith%3Dquery%26and%3Dmore";
+	std::string const clean = "https://example.com/" + std::string(2000, 'a') + "?q=" + std::string(500, 'b');
+
+	auto const kernels = urlcheck::kernels();
+	for(auto kernel : kernels)
+	{
+		urlcheck::use_kernel(kernel);
+		auto const tag = " [" + std::string{kernel} + "]";
+
+		for(std::string_view input : {escaped, std::string_view{clean}})
+		{
+			std::string out;
+			bench::run("urlcheck::decode_url" + tag + " (" + std::to_string(input.size()) + " bytes)", [&]
+			{
+				auto error = urlcheck::decode_url(input, out);
+				bench::do_not_optimize(error);
+			});
+		}
+
+		std::string url = clean;
+		bench::run("urlcheck::check_url" + tag + " (" + std::to_string(url.size()) + " bytes)", [&]
+		{
+			auto error = urlcheck::check_url(url);
+			bench::do_not_optimize(error);
+		});
+	}
+
+	urlcheck::use_kernel(kernels.front());
+}
+
+static void
+bench_mime(const mime_type::MimeTypeMap& mtm)
+{
+	static const std::string_view names[] = {
+		"/assets/style.css",
+		"/assets/app.min.js",
+		"/favicon.ico",
+		"/robots.txt",
+		"/assets/fonts/font.woff2",
+		"/no-extension",
+		"/assets/unknown.zzz",
+		"/assets/IMAGE.PNG",
+	};
+
+	std::size_t i = 0;
+	bench::run("MimeTypeMap::find_filename", [&]
+	{
+		auto type = mtm.find_filename(names[i++ % std::size(names)]);
+		bench::do_not_optimize(type);
+	});
+}
+
+// Requests that every handler turns away before touching the disk or the database,
+// so this is the cost of routing and building a small response
+static void
+bench_routing(const mime_type::MimeTypeMap& mtm)
+{
+	server_state::Config config;
+	config.doc_root = "/nonexistent";
+	server_state::ServerState state{config, mtm, ssl::context{ssl::context::tlsv12}};
+
+	struct target
+	{
+		http::verb method;
+		std::string_view path;
+	};
+
+	static const target targets[] = {
+		{http::verb::post, "/"},			// Template, wrong method
+		{http::verb::post, "/index.html"},		// Template, wrong method
+		{http::verb::post, "/some-shady-token.exe"},	// URL, wrong method
+		{http::verb::get, "/a/b/c"},			// Not found
+		{http::verb::get, "/../etc/passwd"},		// Bad target
+	};
+
+	std::vector<http::request<http::string_body>> requests;
+	for(auto& t : targets)
+	{
+		http::request<http::string_body> req{t.method, t.path, 11};
+		req.set(http::field::host, "localhost");
+		requests.push_back(std::move(req));
+	}
+
+	auto send = [](auto&& res)
+	{
+		bench::do_not_optimize(res.result_int());
+	};
+
+	std::size_t i = 0;
+	bench::run("request::handle_request (routing)", [&]
+	{
+		auto req = requests[i++ % requests.size()];
+		request::handle_request(state, std::move(req), send);
+	});
+}
+
+static std::string
+make_multipart(std::string_view boundary, std::size_t padding)
+{
+	std::string body;
+	body.append("--").append(boundary).append("\r\n");
+	body.append("Content-Disposition: form-data; name=\"padding\"\r\n\r\n");
+	body.append(padding, 'x');
+	body.append("\r\n--").append(boundary).append("\r\n");
+	body.append("Content-Disposition: form-data; name=\"url\"\r\n\r\n");
+	body.append("https://example.com/some/longer/path?with=query&and=more");
+	body.append("\r\n--").append(boundary).append("--\r\n");
+	return body;
+}
+
+static void
+bench_multipart()
+{
+	static const std::string_view boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+
+	for(std::size_t padding : {0, 4096, 65536})
+	{
+		auto const body = make_multipart(boundary, padding);
+		auto const suffix = " (" + std::to_string(body.size()) + " bytes)";
+
+		bench::run("MultiPartData::ingest" + suffix, [&]
+		{
+			multipart_wrapper::MultiPartData mpd{boundary};
+			mpd.ingest(body);
+			bench::do_not_optimize(mpd.find_field("url"));
+		});
+
+		// Chunked the way the session reads a streamed body
+		bench::run("FieldExtractor, 8k chunks" + suffix, [&]
+		{
+			multipart_wrapper::FieldExtractor fe{boundary, "url"};
+			std::string_view rest{body};
+			while(!rest.empty() && !fe.done())
+			{
+				auto const n = std::min<std::size_t>(rest.size(), 8192);
+				fe.ingest(rest.substr(0, n));
+				rest.remove_prefix(n);
+			}
+			bench::do_not_optimize(fe.value());
+		});
+	}
+}
+
+int
+main(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		std::fprintf(stderr, "Usage: %s <parseqs|generate|mime|routing|multipart|urlcheck|all> [mimetypes.txt]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::string_view suite{argv[1]};
+	const char* mimetypes = argc > 2 ? argv[2] : "mimetypes.txt";
+	bool all = suite == "all";
+	bool ran = false;
+
+	if(all || suite == "parseqs")
+	{
+		bench_parseqs();
+		ran = true;
+	}
+
+	if(all || suite == "generate")
+	{
+		bench_generate();
+		ran = true;
+	}
+
+	if(all || suite == "multipart")
+	{
+		bench_multipart();
+		ran = true;
+	}
+
+	if(all || suite == "urlcheck")
+	{
+		bench_urlcheck();
+		ran = true;
+	}
+
+	if(all || suite == "mime" || suite == "routing")
+	{
+		mime_type::MimeTypeMap mtm{mimetypes};
+		if(all || suite == "mime")
+			bench_mime(mtm);
+		if(all || suite == "routing")
+			bench_routing(mtm);
+		ran = true;
+	}
+
+	if(!ran)
+	{
+		std::fprintf(stderr, "Unknown suite %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+#ifndef BENCH_SERVER_H
+#define BENCH_SERVER_H
+
+#include <string>
+
+#include <boost/asio/ssl/context.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <sqlite3.h>
+
+#include "sqlite_helper.hpp"
+
+// What the benchmarks that run the real server need to set it up
+namespace bench
+{
+
+namespace ssl = boost::asio::ssl;	// from <boost/asio/ssl.hpp>
+
+// Tokens seeded in the database for redirects, shaped like ours so the token filter lets them by:
+// bench-0.txt, bench-1.txt and so on
+inline constexpr int seeded_tokens = 1000;
+
+inline std::string
+seeded_token(int i)
+{
+	return "bench-" + std::to_string(i) + ".txt";
+}
+
+// A fresh database with some tokens to redirect
+inline bool
+make_database(const std::string& path)
+{
+	auto db = sqlite_helper::make_sqlite3_handle(path.c_str());
+	if(!db)
+		return false;
+
+	std::string sql =
+		"CREATE TABLE urls (token VARCHAR UNIQUE NOT NULL, url VARCHAR UNIQUE NOT NULL);"
+		"BEGIN;";
+	for(int i = 0; i < seeded_tokens; i++)
+	{
+		sql.append("INSERT INTO urls (token, url) VALUES ('" + seeded_token(i) +
+			"', 'https://example.com/seeded/" + std::to_string(i) + "');");
+	}
+	sql.append("COMMIT;");
+
+	return sqlite3_exec(db.get(), sql.c_str(), nullptr, nullptr, nullptr) == SQLITE_OK;
+}
+
+// A throwaway P-256 key and self-signed certificate for localhost
+inline bool
+use_self_signed(ssl::context& ctx)
+{
+	EVP_PKEY* key = nullptr;
+	EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+	bool ok = kctx &&
+		EVP_PKEY_keygen_init(kctx) == 1 &&
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) == 1 &&
+		EVP_PKEY_keygen(kctx, &key) == 1;
+	EVP_PKEY_CTX_free(kctx);
+	if(!ok)
+		return false;
+
+	X509* cert = X509_new();
+	ok = cert &&
+		ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) == 1 &&
+		X509_gmtime_adj(X509_getm_notBefore(cert), 0) &&
+		X509_gmtime_adj(X509_getm_notAfter(cert), 86400) &&
+		X509_set_pubkey(cert, key) == 1 &&
+		X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+			reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0) == 1 &&
+		X509_set_issuer_name(cert, X509_get_subject_name(cert)) == 1 &&
+		X509_sign(cert, key, EVP_sha256()) > 0 &&
+		SSL_CTX_use_certificate(ctx.native_handle(), cert) == 1 &&
+		SSL_CTX_use_PrivateKey(ctx.native_handle(), key) == 1;
+
+	// As certificate::load_server_certificate does for the real thing
+	SSL_CTX_set_mode(ctx.native_handle(), SSL_MODE_RELEASE_BUFFERS);
+
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ok;
+}
+
+} // namespace bench
+
+#endif // BENCH_SERVER_H
@@ -0,0 +1,90 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#include <boost/beast/core/flat_buffer.hpp>
+
+// Recycles I/O buffers through a small per-thread free list.
+//
+// Sessions give their buffers back whenever they go idle, so a kept-alive connection
+// holds no buffer between requests, and the next request on that thread picks up one
+// that's still warm in cache instead of going back to malloc.
+namespace buffer_pool
+{
+
+// Requests up to this size are served from the pool
+constexpr std::size_t block_size = 16384;
+
+// Get a block of block_size bytes
+void* acquire();
+
+// Give a block back; it's freed if this thread already has enough spare
+void release(void*) noexcept;
+
+// Frees its block when it goes
+struct deleter
+{
+	void
+	operator()(std::uint8_t* p) const noexcept
+	{
+		release(p);
+	}
+};
+
+using block = std::unique_ptr<std::uint8_t[], deleter>;
+
+inline block
+make_block()
+{
+	return block{static_cast<std::uint8_t*>(acquire())};
+}
+
+// Lets Beast's dynamic buffers draw from the pool
+template<class T>
+struct allocator
+{
+	using value_type = T;
+	using is_always_equal = std::true_type;
+
+	allocator() = default;
+
+	template<class U>
+	allocator(const allocator<U>&) noexcept
+	{
+	}
+
+	T*
+	allocate(std::size_t n)
+	{
+		if(n * sizeof(T) <= block_size)
+			return static_cast<T*>(acquire());
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void
+	deallocate(T* p, std::size_t n) noexcept
+	{
+		if(n * sizeof(T) <= block_size)
+			return release(p);
+		::operator delete(p);
+	}
+
+	template<class U>
+	bool
+	operator==(const allocator<U>&) const noexcept
+	{
+		return true;
+	}
+};
+
+// What sessions read requests into
+using flat_buffer = boost::beast::basic_flat_buffer<allocator<char>>;
+
+} // namespace buffer_pool
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,106 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Shortening or resolving many URLs in one request.
+//
+// The body is a list of URLs or tokens: one per line, one JSON string or
+// {"url": ...} / {"token": ...} object per line, or a JSON array of either.
+// Every URL gets a token in one transaction, or every token is looked up in one
+// read, and the results come back one JSON object per line, in the order they were sent.
+namespace bulk
+{
+
+// Where bulk requests are posted
+inline constexpr std::string_view target = "/bulk";
+inline constexpr std::string_view resolve_target = "/resolve";
+
+// What a list holds
+enum class list
+{
+	urls,		// To shorten
+	tokens,		// To resolve
+};
+
+// What the list posted to a target holds, if it takes one
+std::optional<list> list_of(std::string_view target);
+
+enum class format
+{
+	lines,		// text/plain
+	ndjson,		// application/x-ndjson
+	json,		// application/json, an array
+};
+
+// The format of a bulk body from its Content-Type, if it's one we take
+std::optional<format> format_of(std::string_view content_type);
+
+// One URL or token from a request, and what became of it
+struct item
+{
+	std::string url;	// Empty if a token wasn't found
+	std::string token;	// Empty if a URL was rejected
+	std::string_view error;	// Why it was rejected
+};
+
+// Collects the URLs or tokens in a body, which can be fed in as it arrives.
+// Lines are split up as they come; a JSON array is parsed once it's all here.
+class collector
+{
+public:
+	collector(list, format, std::size_t max_items);
+
+	// Returns false once the body can't be used; error() says why.
+	// Anything fed in after that is ignored.
+	bool ingest(std::string_view);
+
+	// Call at the end of the body
+	bool finish();
+
+	std::vector<item>& items();
+	std::string_view error() const;
+	list kind() const;
+
+private:
+	bool add_line(std::string_view);
+	bool add(std::string value);
+	bool add_invalid(std::string value);
+	bool fail(std::string_view);
+
+	list list_;
+	format format_;
+	std::size_t max_items_;
+	std::string pending_;	// A partial line, or the whole body for JSON
+	std::vector<item> items_;
+	std::string_view error_;
+};
+
+// Give every URL that passed validation a token, and store them all in one transaction.
+// URLs we already have keep the token they were given before.
+// Returns false on a database error, with what went wrong in error.
+bool store(const std::string& db_path, std::vector<item>&, std::string& error);
+
+// Look up the URL for every token, all in one read.
+// Tokens we don't have are given an error.
+// Returns false on a database error, with what went wrong in error.
+bool resolve(const std::string& db_path, std::vector<item>&, std::string& error);
+
+// Append s to out as a quoted JSON string
+void append_json_string(std::string& out, std::string_view s);
+
+// The results of storing, one JSON object per line:
+// {"url": ..., "token": ..., "short": ...} or {"url": ..., "error": ...}
+std::string render(const std::vector<item>&, std::string_view hostname);
+
+// The results of resolving, one JSON object per line:
+// {"token": ..., "url": ...} or {"token": ..., "error": ...}
+std::string render_resolved(const std::vector<item>&);
+
+} // namespace bulk
+
+#endif // BULK_H
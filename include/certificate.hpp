@@ -8,7 +8,7 @@
 namespace certificate
 {
 
-bool load_server_certificate(const server_state::ServerState&, boost::asio::ssl::context&);
+bool load_server_certificate(const server_state::Config&, boost::asio::ssl::context&);
 
 } // namespace certificate
 
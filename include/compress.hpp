@@ -0,0 +1,37 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace compression
+{
+
+// Content codings we know how to produce, in order of preference
+enum class encoding
+{
+	identity,
+	gzip,
+	brotli,
+};
+
+// Pick the best encoding the client accepts out of the ones available
+encoding choose_encoding(std::string_view accept_encoding, bool have_gzip, bool have_brotli);
+
+// Content-Encoding token and docroot sibling suffix for an encoding
+std::string_view encoding_name(encoding);
+std::string_view encoding_suffix(encoding);
+
+// Returns true if it's worth compressing data of this MIME type
+bool is_compressible(std::string_view mime_type);
+
+// Compress data at a level that's quick enough to do while a request waits; these are
+// only ever called once per resource. Siblings made ahead of time can use the highest.
+// An empty optional is returned on failure.
+std::optional<std::string> gzip(std::string_view);
+std::optional<std::string> brotli(std::string_view);
+
+} // namespace compression
+
+#endif // COMPRESS_H
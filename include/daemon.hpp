@@ -1,6 +1,8 @@
 #ifndef DAEMON_H
 #define DAEMON_H
 
+#include <sys/types.h>
+#include <cstddef>
 #include <string_view>
 
 namespace daemonise
@@ -22,9 +24,18 @@ bool check_pid();
 bool write_pid();
 void remove_pid();
 
+// On the way out after an upgrade, point the PID file at the process that took over.
+// Left as it is if it can't be rewritten, since that's better than having none.
+void hand_over_pid(pid_t successor);
+
 bool drop_privs(std::string_view, std::string_view);
+
+// Raise the file descriptor limit as far as we're allowed
 bool set_rlimit();
 
+// The file descriptor limit now in force
+std::size_t fd_limit();
+
 } // namespace daemon
 
 #endif // DAEMON_H
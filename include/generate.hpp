@@ -1,13 +1,22 @@
 #ifndef GENERATE_H
 #define GENERATE_H
 
+#include <cstddef>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace generate
 {
 
 std::string generate_random_filename();
 
+// Many names at once, for bulk requests
+std::vector<std::string> generate_random_filenames(std::size_t n);
+
+// Whether a token has the shape of one we make: letters, digits, - and _, then one of our extensions
+bool looks_generated(std::string_view token);
+
 } // namespace generate
 
 #endif // GENERATE_H
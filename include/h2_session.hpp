@@ -0,0 +1,291 @@
+#ifndef H2_SESSION_H
+#define H2_SESSION_H
+
+#ifdef SHADYURL_HAVE_NGHTTP2
+
+#ifndef BOOST_BEAST_USE_STD_STRING_VIEW
+#	define BOOST_BEAST_USE_STD_STRING_VIEW
+#endif
+
+#include <nghttp2/nghttp2.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+
+#include "buffer_pool.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "ratelimit.hpp"
+#include "server_state.hpp"
+#include "session.hpp"
+#include "timeouts.hpp"
+
+namespace session
+{
+
+namespace beast = boost::beast;		// from <boost/beast.hpp>
+namespace http = beast::http;		// from <boost/beast/http.hpp>
+namespace net = boost::asio;		// from <boost/asio.hpp>
+namespace ssl = boost::asio::ssl;	// from <boost/asio/ssl.hpp>
+
+// Pick h2 over http/1.1 during the TLS handshake, if the client offers it
+void enable_h2_alpn(ssl::context&);
+
+// Did the handshake on this stream pick h2?
+bool negotiated_h2(beast::ssl_stream<beast::tcp_stream>&);
+
+// Handles an HTTP/2 connection, negotiated with ALPN.
+//
+// nghttp2 does the framing, HPACK and flow control; each stream's request is read
+// whole and passed to the same request::handle_request as HTTP/1.1, and responses
+// are sent as soon as they're ready, in any order.
+class h2_session
+	: public connection_tracker::connection
+	, public std::enable_shared_from_this<h2_session>
+{
+	// Produces a response body for nghttp2, a piece at a time
+	struct body_source
+	{
+		virtual ~body_source() = default;
+
+		// Copy up to len bytes into buf; eof is set once there's nothing left
+		virtual std::size_t read(std::uint8_t* buf, std::size_t len, bool& eof, beast::error_code&) = 0;
+	};
+
+	// Streams a message's body through its Beast body writer, so every body type works
+	template<class Body, class Fields>
+	class message_source : public body_source
+	{
+		http::response<Body, Fields> msg_;
+		typename Body::writer writer_;
+		std::optional<beast::buffers_suffix<typename Body::writer::const_buffers_type>> pending_;
+		bool more_ = true;
+
+	public:
+		explicit
+		message_source(http::response<Body, Fields>&& msg)
+			: msg_(std::move(msg))
+			, writer_(msg_.base(), msg_.body())
+		{
+		}
+
+		void
+		init(beast::error_code& ec)
+		{
+			writer_.init(ec);
+		}
+
+		std::size_t
+		read(std::uint8_t* buf, std::size_t len, bool& eof, beast::error_code& ec) override
+		{
+			std::size_t n = 0;
+			while(n < len)
+			{
+				if(!pending_ || beast::buffer_bytes(*pending_) == 0)
+				{
+					pending_.reset();
+					if(!more_)
+						break;
+
+					auto next = writer_.get(ec);
+					if(ec)
+						return 0;
+					if(!next)
+					{
+						more_ = false;
+						break;
+					}
+
+					more_ = next->second;
+					pending_.emplace(next->first);
+				}
+
+				auto const copied = net::buffer_copy(net::buffer(buf + n, len - n), *pending_);
+				pending_->consume(copied);
+				n += copied;
+			}
+
+			eof = !more_ && (!pending_ || beast::buffer_bytes(*pending_) == 0);
+			return n;
+		}
+	};
+
+	struct stream
+	{
+		http::request<http::string_body> req;
+		std::unique_ptr<body_source> body;
+		bool too_large = false;
+
+		// When the request has to have arrived by, then when the response has to have been taken.
+		// Fixed when each starts, so trickling frames doesn't buy more time.
+		std::chrono::steady_clock::time_point deadline;
+		bool received = false;
+
+		// For the access log
+		std::optional<logging::access_record> access;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	// Passed to the request handlers in place of the HTTP/1.1 queue
+	struct sender
+	{
+		h2_session& self;
+		std::int32_t stream_id;
+
+		template<class Body, class Fields>
+		void
+		operator()(http::response<Body, Fields>&& msg) const
+		{
+			self.respond(stream_id, std::move(msg));
+		}
+	};
+
+	beast::ssl_stream<beast::tcp_stream> stream_;
+	buffer_pool::flat_buffer buffer_;
+	std::shared_ptr<const server_state::ServerState> state_;
+	ratelimit::admission admission_;
+	nghttp2_session* session_ = nullptr;
+	std::unordered_map<std::int32_t, std::unique_ptr<stream>> streams_;
+
+	// Reads go into a pooled block, except when no streams are open: then we only
+	// wait for the first byte, so an idle connection holds no buffers. Once it's
+	// arrived, the rest of what the client sent is read into a block as usual.
+	buffer_pool::block read_buf_;
+	std::uint8_t first_byte_;
+	bool woken_ = false;
+
+	// When the current idle stretch ends, set when it starts
+	std::optional<std::chrono::steady_clock::time_point> idle_deadline_;
+	std::vector<std::uint8_t> write_buf_;
+	bool writing_ = false;
+	bool reading_ = false;
+	bool closing_ = false;
+	bool shutdown_waiting_ = false;	// For the read to finish
+
+	std::optional<connection_tracker::handle> tracked_;
+	std::string client_;
+
+public:
+	h2_session(
+		beast::ssl_stream<beast::tcp_stream>&& stream,
+		buffer_pool::flat_buffer&& buffer,
+		std::shared_ptr<const server_state::ServerState> state,
+		ratelimit::admission admission);
+
+	~h2_session();
+
+	h2_session(const h2_session&) = delete;
+	h2_session& operator=(const h2_session&) = delete;
+
+	void run();
+
+	// Called by the connection tracker on shutdown
+	void drain() override;
+
+private:
+	template<class Body, class Fields>
+	void
+	respond(std::int32_t stream_id, http::response<Body, Fields>&& msg)
+	{
+		auto it = streams_.find(stream_id);
+		if(it == streams_.end())
+			return;
+
+		auto& s = *it->second;
+		metrics::add(metrics::status_class(msg.result_int()));
+
+		if(s.access)
+		{
+			s.access->status = msg.result_int();
+			s.access->bytes = msg.payload_size().value_or(0);
+		}
+
+		// Header names must be lowercase, and there are no connection-specific headers in HTTP/2
+		std::vector<std::string> names;
+		std::vector<nghttp2_nv> nva;
+		names.reserve(std::distance(msg.begin(), msg.end()));
+		nva.reserve(names.capacity() + 1);
+
+		std::string const status = std::to_string(msg.result_int());
+		nva.push_back(make_nv(":status", status));
+
+		for(auto const& field : msg)
+		{
+			switch(field.name())
+			{
+			case http::field::connection:
+			case http::field::keep_alive:
+			case http::field::proxy_connection:
+			case http::field::transfer_encoding:
+			case http::field::upgrade:
+				continue;
+			default:
+				break;
+			}
+
+			auto& name = names.emplace_back(field.name_string());
+			for(auto& c : name)
+				c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			nva.push_back(make_nv(name, field.value()));
+		}
+
+		auto body = std::make_unique<message_source<Body, Fields>>(std::move(msg));
+		beast::error_code ec;
+		body->init(ec);
+		if(ec)
+		{
+			logging::fail(ec, "h2 body");
+			nghttp2_submit_rst_stream(session_, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_INTERNAL_ERROR);
+			return;
+		}
+
+		s.body = std::move(body);
+
+		nghttp2_data_provider provider;
+		provider.source.ptr = s.body.get();
+		provider.read_callback = &h2_session::on_read_body;
+		nghttp2_submit_response(session_, stream_id, nva.data(), nva.size(), &provider);
+	}
+
+	static nghttp2_nv make_nv(std::string_view name, std::string_view value);
+
+	timeouts::stage read_stage() const;
+	std::chrono::steady_clock::time_point read_deadline();
+	void submit_goaway();
+	void dispatch(std::int32_t stream_id);
+
+	void do_read();
+	void on_read(beast::error_code, std::size_t);
+	void do_write();
+	void on_write(beast::error_code, std::size_t);
+	void do_close();
+	void do_shutdown();
+	void on_shutdown(beast::error_code);
+
+	// nghttp2 callbacks; user_data is the session
+	static int on_begin_headers(nghttp2_session*, const nghttp2_frame*, void*);
+	static int on_header(nghttp2_session*, const nghttp2_frame*, const std::uint8_t*, std::size_t,
+		const std::uint8_t*, std::size_t, std::uint8_t, void*);
+	static int on_data_chunk(nghttp2_session*, std::uint8_t, std::int32_t, const std::uint8_t*,
+		std::size_t, void*);
+	static int on_frame_recv(nghttp2_session*, const nghttp2_frame*, void*);
+	static int on_stream_close(nghttp2_session*, std::int32_t, std::uint32_t, void*);
+	static ssize_t on_read_body(nghttp2_session*, std::int32_t, std::uint8_t*, std::size_t,
+		std::uint32_t*, nghttp2_data_source*, void*);
+};
+
+} // namespace session
+
+#endif // SHADYURL_HAVE_NGHTTP2
+
+#endif // H2_SESSION_H
@@ -1,6 +1,8 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <cstdint>
+#include <string>
 #include <string_view>
 
 #include <boost/beast.hpp>
@@ -14,6 +16,37 @@ void fail(beast::error_code, char const*);
 
 bool set_log_level(std::string_view);
 
+// Log a message without blocking: it's queued for a background thread to pass on to syslog.
+// Until the writer's started (it has to be after daemonising), this calls syslog() directly.
+void log(int priority, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Start the background writer. At most rate_limit messages a second reach syslog;
+// repeats of the same message are collapsed into a count.
+void start_writer(unsigned rate_limit);
+
+// Write out everything queued and stop the writer
+void stop_writer();
+
+// Open (or reopen, e.g. after rotation) the access log; an empty path turns it off.
+// The file is opened straight away, and the writer switches to it.
+bool set_access_log(const std::string& path);
+
+bool access_log_enabled();
+
+// One line of the access log
+struct access_record
+{
+	std::string client;
+	std::string method;
+	std::string target;
+	unsigned status = 0;
+	std::uint64_t bytes = 0;
+	std::uint64_t micros = 0;	// From the request header arriving to the response being written
+};
+
+// Queue a line for the access log
+void access(const access_record&);
+
 } // namespace log
 
 #endif // LOG_H
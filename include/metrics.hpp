@@ -0,0 +1,121 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Counters and latency histograms, exported in the Prometheus text format.
+//
+// Every thread updates its own cache-line-aligned shard, so recording never
+// contends with another thread; the shards are only merged when scraped.
+namespace metrics
+{
+
+enum class counter : std::size_t
+{
+	requests_file,
+	requests_post,
+	requests_template,
+	requests_url,
+	requests_bulk,
+	requests_resolve,
+	requests_bad_target,
+	requests_not_found,
+	responses_1xx,
+	responses_2xx,
+	responses_3xx,
+	responses_4xx,
+	responses_5xx,
+	tls_handshakes,
+	tls_handshake_failures,
+	ratelimited_connection_rate,	// Connections refused, by limiter
+	ratelimited_client_connections,
+	ratelimited_global,
+	ratelimited_requests,		// Requests answered with 429
+	ratelimit_evictions,		// Clients pushed out of the rate limit table
+	timeouts_handshake,		// Connections closed for being too slow, by stage
+	timeouts_header,
+	timeouts_body,
+	timeouts_idle,
+	timeouts_write,
+	bulk_urls,		// URLs given tokens by bulk requests
+	resolved_tokens,	// Tokens found by resolve requests
+	lookups_skipped_shape,	// Token lookups turned away without a query, by reason
+	lookups_skipped_filter,
+	sessions_active,	// Gauge
+	responses_queued,	// Gauge
+	count_
+};
+
+enum class histogram : std::size_t
+{
+	request_file,		// Handler time, in microseconds
+	request_post,
+	request_template,
+	request_url,
+	request_bulk,
+	request_resolve,
+	sqlite,			// Time spent in SQLite, in microseconds
+	render,			// Time spent rendering templates, in microseconds
+	tls_handshake,		// Handshake time, in microseconds
+	queue_depth,		// Responses queued on a connection when a new one is added
+	count_
+};
+
+// Add to a counter; gauges can go down too
+void add(counter, std::int64_t n = 1);
+
+// Record a value in a histogram
+void record(histogram, std::uint64_t value);
+
+// Map a response status to its counter
+counter status_class(unsigned status);
+
+// Records the time from construction to destruction in a histogram, in microseconds
+class timer
+{
+public:
+	explicit timer(histogram h)
+		: h_(h)
+		, start_(std::chrono::steady_clock::now())
+	{
+	}
+
+	~timer()
+	{
+		stop();
+	}
+
+	// Record now rather than on destruction
+	void
+	stop()
+	{
+		if(running_)
+			record(h_, elapsed());
+		running_ = false;
+	}
+
+	std::uint64_t
+	elapsed() const
+	{
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start_).count());
+	}
+
+	timer(const timer&) = delete;
+	timer& operator=(const timer&) = delete;
+
+private:
+	histogram h_;
+	std::chrono::steady_clock::time_point start_;
+	bool running_ = true;
+};
+
+// Merge every thread's metrics and format them for a scrape
+std::string render();
+
+} // namespace metrics
+
+#endif // METRICS_H
@@ -6,17 +6,21 @@
 #include <string_view>
 #include <fstream>
 #include <sstream>
-#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <system_error>
 
 
 namespace mime_type
 {
 
+// Maps file extensions to MIME types.
+// The table is built once at load time and sorted, so lookups are a
+// binary search on a string_view and never allocate.
 class MimeTypeMap
 {
 private:
-	std::unordered_map<std::string, std::string> mimetypes;
+	std::vector<std::pair<std::string, std::string>> mimetypes;
 	std::string mimetypes_file_;
 	std::string default_mimetype_;
 public:
@@ -32,8 +36,11 @@ public:
 	{
 	}
 
-	std::string_view find_extension(std::string) const;
-	std::string_view find_filename(std::string) const;
+	std::string_view find_extension(std::string_view) const;
+	std::string_view find_filename(std::string_view) const;
+
+private:
+	const std::string* lookup(std::string_view) const;
 };
 
 } // namespace mime_type
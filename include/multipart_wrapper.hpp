@@ -3,69 +3,132 @@
 
 #include "multipart_parser.h"
 
-#include <boost/algorithm/string.hpp>
+#include <boost/container/small_vector.hpp>
 
-#include <iostream>
+#include <optional>
 #include <string>
 #include <string_view>
-#include <tuple>
-#include <map>
 #include <vector>
-#include <variant>
 
 namespace multipart_wrapper
 {
 
+// A parameter of a header value, e.g. `name="url"` in `form-data; name="url"`.
+// Bare tokens such as `form-data` have no value.
+struct HeaderParam
+{
+	std::string_view name;
+	std::string_view value;
+	bool has_value;
+};
+
+// Walks the parameters of a header value in a single pass, without allocating.
+// Quoted values are returned without their quotes; backslash escapes are left as they are.
+class HeaderParams
+{
+public:
+	explicit HeaderParams(std::string_view header)
+		: rest_(header)
+	{
+	}
+
+	// Get the next parameter; returns false when there are no more
+	bool next(HeaderParam&);
+
+	// Find a parameter's value by name (case-insensitively)
+	static std::optional<std::string_view> find(std::string_view header, std::string_view name);
+
+private:
+	std::string_view rest_;
+};
+
+// Splits a whole multipart body into its sections.
+// Sections point into the body rather than copying it, so the body must outlive this object.
 class MultiPartData
 {
 public:
 	class MultiPartSection
 	{
 	public:
-		// Header params values may be either string or standalone
-		using header_params_value_type = std::variant<std::monostate, std::string>;
-		using header_params_type = std::map<std::string, header_params_value_type>;
-
-		// This maps the headers themselves, which may have a string or a map as a value
-		using header_type = std::variant<std::string, header_params_type>;
-		using header_map_type = std::map<std::string, header_type>;
-
-		MultiPartSection(const header_map_type&, std::string_view);
-		header_map_type get_headers() const;
-		std::string get_data() const;
-		static header_type parse_header_value(std::string_view);
+		struct header
+		{
+			std::string_view name;
+			std::string_view value;
+		};
+
+		// Parts rarely have more than a couple of headers
+		using header_list_type = boost::container::small_vector<header, 4>;
+
+		const header_list_type& get_headers() const;
+		std::optional<std::string_view> get_header(std::string_view) const;
+		std::string_view get_data() const;
+
 	private:
 		friend class MultiPartData;
-		header_map_type headers_;
-		std::string data_;
+		header_list_type headers_;
+		std::string_view data_;
 	};
 
-	MultiPartData(std::string_view);
+	explicit MultiPartData(std::string_view boundary);
+
+	// Split a body into sections; returns false if it's malformed.
+	// Any sections found before the problem are kept.
+	bool ingest(std::string_view);
+
+	const std::vector<MultiPartSection>& get_data() const;
+
+	// Find the section holding a form field
+	const MultiPartSection* find_field(std::string_view name) const;
+
+private:
+	std::string delimiter_;		// CRLF "--" boundary
+	std::vector<MultiPartSection> data_;
+};
+
+// Pulls a single named field out of a multipart body as it arrives, chunk by chunk.
+// Nothing but the field's value is kept, and parsing stops as soon as it's complete.
+class FieldExtractor
+{
+public:
+	FieldExtractor(std::string_view boundary, std::string_view name);
 
 	// This object cannot safely be copied or moved
-	MultiPartData(const MultiPartData&) = delete;
-	MultiPartData(MultiPartData&&) = delete;
-	MultiPartData& operator=(const MultiPartData&) = delete;
-	MultiPartData& operator=(const MultiPartData&&) = delete;
+	FieldExtractor(const FieldExtractor&) = delete;
+	FieldExtractor(FieldExtractor&&) = delete;
+	FieldExtractor& operator=(const FieldExtractor&) = delete;
+	FieldExtractor& operator=(FieldExtractor&&) = delete;
+
+	~FieldExtractor();
 
-	~MultiPartData();
+	// Feed the next chunk of the body; returns true once the field has been found
+	bool ingest(std::string_view);
 
-	void ingest(std::string_view);
-	std::vector<MultiPartSection> get_data();
+	bool done() const;
+	const std::string& value() const;
 
 private:
 	static int read_header_name(multipart_parser*, const char*, size_t);
 	static int read_header_value(multipart_parser*, const char*, size_t);
+	static int read_headers_complete(multipart_parser*);
 	static int read_body(multipart_parser*, const char*, size_t);
+	static int read_part_begin(multipart_parser*);
+	static int read_part_end(multipart_parser*);
 
-	std::string_view boundary_;
-	std::vector<MultiPartSection> data_;
+	void finish_header();
+
+	std::string boundary_;
+	std::string name_;
 	multipart_parser* parser_;
 	multipart_parser_settings callbacks_;
 
-	// Temporaries
-	MultiPartSection::header_map_type cur_header_vals_;
+	// Headers may arrive split across chunks
 	std::string cur_header_name_;
+	std::string cur_header_value_;
+	bool in_header_value_ = false;
+
+	bool matched_ = false;
+	bool done_ = false;
+	std::string value_;
 };
 
 } // namespace multipart_wrapper
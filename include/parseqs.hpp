@@ -2,6 +2,8 @@
 #define PARSEQS_H
 
 #include <cstddef>
+#include <iterator>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <tuple>
@@ -14,6 +16,75 @@ std::tuple<std::string, std::string> split_by_eq(std::string_view);
 std::string unquote(std::string_view);
 std::map<std::string, std::string> parse_qsl(std::string_view, std::size_t maxparams = 1000);
 
+// A key/value pair from a query string, still percent-encoded.
+// These point into the query string, so it must outlive them.
+struct param
+{
+	std::string_view key;
+	std::string_view value;
+};
+
+// Lazily walks the pairs of a query string without allocating.
+// Empty pairs are skipped, like parse_qsl does.
+class query_iterator
+{
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = param;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const param*;
+	using reference = const param&;
+
+	// The end iterator
+	query_iterator() = default;
+
+	explicit query_iterator(std::string_view);
+
+	reference operator*() const { return cur_; }
+	pointer operator->() const { return &cur_; }
+
+	query_iterator& operator++();
+	query_iterator operator++(int);
+
+	bool operator==(const query_iterator&) const;
+
+private:
+	void next();
+
+	std::string_view rest_;
+	param cur_;
+	bool end_ = true;
+};
+
+// A range over the pairs of a query string
+class query_string
+{
+public:
+	explicit query_string(std::string_view qs)
+		: qs_(qs)
+	{
+	}
+
+	query_iterator begin() const { return query_iterator{qs_}; }
+	query_iterator end() const { return query_iterator{}; }
+
+private:
+	std::string_view qs_;
+};
+
+// Returns true if a string has anything in it unquote would change
+bool needs_unquote(std::string_view);
+
+// Percent-decode into a caller-provided buffer of at least str.size() bytes.
+// Returns the decoded length, which is never longer than the input.
+std::size_t unquote_into(std::string_view str, char* out);
+
+// Compare a percent-encoded string against a plain one without decoding it
+bool unquoted_equals(std::string_view encoded, std::string_view plain);
+
+// Find the (still encoded) value of a key; the last one wins, like parse_qsl
+std::optional<std::string_view> find_param(std::string_view qs, std::string_view key);
+
 } // namespace parseqs
 
 #endif // PARSEQS_H
@@ -0,0 +1,117 @@
+#ifndef RANGE_BODY_H
+#define RANGE_BODY_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+namespace range_body
+{
+
+namespace beast = boost::beast;		// from <boost/beast.hpp>
+namespace http = beast::http;		// from <boost/beast/http.hpp>
+namespace net = boost::asio;		// from <boost/asio.hpp>
+
+// An inclusive byte range of a representation
+struct byte_range
+{
+	std::uint64_t first;
+	std::uint64_t last;
+
+	std::uint64_t length() const { return last - first + 1; }
+};
+
+enum class range_result
+{
+	none,		// No usable Range header, send the whole thing
+	satisfiable,	// Send the ranges
+	unsatisfiable,	// Send a 416
+};
+
+// Parse a Range header (RFC 9110 section 14.2) against a representation of the given size.
+// Overlapping ranges are coalesced; more than max_ranges ranges causes the header to be ignored.
+range_result parse_range(std::string_view, std::uint64_t size, std::vector<byte_range>&, std::size_t max_ranges = 16);
+
+// Make a boundary for multipart/byteranges responses
+std::string make_boundary();
+
+// A body which sends one or more ranges of a file.
+// Like http::file_body, but it seeks to each range instead of reading the skipped bytes.
+// More than one range is framed as multipart/byteranges.
+struct file_range_body
+{
+	// A part of the body: some framing, followed by a range of the file
+	struct part
+	{
+		std::string header;
+		std::uint64_t offset;
+		std::uint64_t length;
+	};
+
+	class value_type
+	{
+		friend struct file_range_body;
+
+		beast::file file_;
+		std::vector<part> parts_;
+		std::string trailer_;
+
+	public:
+		// Send a single range; the caller sets Content-Range
+		void assign(beast::file&& file, byte_range range);
+
+		// Send multiple ranges as multipart/byteranges with the given boundary
+		void assign(
+			beast::file&& file,
+			const std::vector<byte_range>& ranges,
+			std::string_view content_type,
+			std::uint64_t total_size,
+			std::string_view boundary);
+
+		std::uint64_t size() const;
+	};
+
+	static std::uint64_t
+	size(const value_type& body)
+	{
+		return body.size();
+	}
+
+	class writer
+	{
+		value_type& body_;
+		std::size_t index_ = 0;		// The part we're sending
+		bool header_done_ = false;	// Have we sent this part's framing yet?
+		bool seeked_ = false;		// Have we seeked to this part's range yet?
+		bool trailer_done_ = false;
+		std::uint64_t remain_ = 0;	// Bytes left in the current range
+		char buf_[4096];
+
+	public:
+		using const_buffers_type = net::const_buffer;
+
+		template<bool isRequest, class Fields>
+		writer(http::header<isRequest, Fields>&, value_type& body)
+			: body_(body)
+		{
+		}
+
+		void
+		init(beast::error_code& ec)
+		{
+			ec = {};
+		}
+
+		boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code&);
+	};
+};
+
+} // namespace range_body
+
+#endif // RANGE_BODY_H
@@ -0,0 +1,90 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include <boost/asio/ip/address.hpp>
+
+#include "server_state.hpp"
+
+// Per-client rate limiting and admission control.
+//
+// Clients are tracked in a fixed-size, sharded, set-associative table of token buckets,
+// keyed by IPv4 address or IPv6 /64. When a set is full the stalest entry is evicted,
+// which at worst hands a client a fresh bucket, so memory stays bounded however many
+// addresses turn up.
+namespace ratelimit
+{
+
+// An IPv6 address, or an IPv4 address mapped into one
+using key = std::array<std::uint8_t, 16>;
+
+// Size the table; call once, before any connections are accepted
+void init(std::size_t entries);
+
+// Tell us how many connections the file descriptor limit allows
+void set_connection_budget(std::size_t);
+
+// Apply the limits from a config; done again on reload
+void configure(const server_state::Config&);
+
+// A connection we've let in. It counts against its client's concurrent connections,
+// and the global limit, until it's destroyed.
+class admission
+{
+public:
+	admission() = default;
+	admission(admission&&) noexcept;
+	admission& operator=(admission&&) noexcept;
+	~admission();
+
+	admission(const admission&) = delete;
+	admission& operator=(const admission&) = delete;
+
+	// Take cost tokens from the client's request bucket; false if it's empty
+	bool allow_request(unsigned cost) const;
+
+private:
+	friend std::optional<admission> admit(const boost::asio::ip::address&);
+
+	void release();
+
+	key key_{};
+	bool active_ = false;	// Counted against the global limit
+	bool tracked_ = false;	// Counted against the client's connections
+};
+
+// How close the open connections are to the global limit, from 0 to 1
+double load();
+
+// Decide whether to take a new connection; rejections are counted per limiter
+std::optional<admission> admit(const boost::asio::ip::address&);
+
+// Makes a connection's admission current for the duration of a handler call
+class scope
+{
+public:
+	explicit scope(const admission*);
+	~scope();
+
+	scope(const scope&) = delete;
+	scope& operator=(const scope&) = delete;
+
+private:
+	const admission* prev_;
+};
+
+// Check the current connection's request bucket.
+// POSTs write to the database, so they cost more than anything else.
+bool allow_request(bool is_post);
+
+// Charge the current connection for a bulk or resolve request's list, once it's been
+// allowed as a POST: every ratelimit.bulkitems items past the first lot count as another.
+bool allow_bulk(std::size_t items);
+
+} // namespace ratelimit
+
+#endif // RATELIMIT_H
@@ -13,9 +13,12 @@
 #include <string>
 #include <array>
 #include <map>
+#include <memory>
+#include <optional>
 #include <tuple>
 #include <regex>
 #include <utility>
+#include <vector>
 
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
@@ -23,13 +26,24 @@
 
 #include <inja/inja.hpp>
 
+#include "bulk.hpp"
+#include "compress.hpp"
+#include "log.hpp"
 #include "generate.hpp"
+#include "metrics.hpp"
 #include "mime.hpp"
 #include "parseqs.hpp"
 #include "path.hpp"
+#include "range_body.hpp"
+#include "ratelimit.hpp"
 #include "sqlite_helper.hpp"
 #include "multipart_wrapper.hpp"
 #include "server_state.hpp"
+#include "shared_body.hpp"
+#include "static_cache.hpp"
+#include "token_filter.hpp"
+#include "trace.hpp"
+#include "urlcheck.hpp"
 
 
 namespace request
@@ -64,6 +78,18 @@ auto not_found(const auto& req, std::string_view target)
 	return res;
 }
 
+// Returns a response for a body over the limit. The rest of it isn't read, so the connection closes.
+auto payload_too_large(const auto& req)
+{
+	http::response<http::string_body> res{http::status::payload_too_large, req.version()};
+	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+	res.set(http::field::content_type, "text/plain");
+	res.keep_alive(false);
+	res.body() = "Request body too large";
+	res.prepare_payload();
+	return res;
+}
+
 // Returns a server error response
 auto server_error(const auto& req, std::string_view what)
 {
@@ -76,6 +102,19 @@ auto server_error(const auto& req, std::string_view what)
 	return res;
 }
 
+// Returns a rate limited response; kept cheap, as it's sent to clients hammering us
+auto too_many_requests(const auto& req)
+{
+	http::response<http::string_body> res{http::status::too_many_requests, req.version()};
+	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+	res.set(http::field::content_type, "text/plain");
+	res.set(http::field::retry_after, "1");
+	res.keep_alive(req.keep_alive());
+	res.body() = "Too many requests";
+	res.prepare_payload();
+	return res;
+}
+
 // Returns a permanent redirect
 auto redirect_permanent(const auto& req, std::string_view url)
 {
@@ -88,13 +127,13 @@ auto redirect_permanent(const auto& req, std::string_view url)
 
 auto ok_head_file(
 	const auto& req,
-	std::string_view path,
-	http::file_body::value_type&& body,
-	const server_state::ServerState& state)
+	std::string_view mime_type,
+	http::file_body::value_type&& body)
 {
 	http::response<http::empty_body> res{http::status::ok, req.version()};
 	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-	res.set(http::field::content_type, pathutil::get_mime_type(path, state.get_mime_type_map()));
+	res.set(http::field::content_type, mime_type);
+	res.set(http::field::accept_ranges, "bytes");
 	res.content_length(body.size());
 	res.keep_alive(req.keep_alive());
 	return res;
@@ -102,9 +141,8 @@ auto ok_head_file(
 
 auto ok_get_file(
 	const auto& req,
-	std::string_view path,
-	http::file_body::value_type&& body,
-	const server_state::ServerState& state)
+	std::string_view mime_type,
+	http::file_body::value_type&& body)
 {
 	// Cache the size since we need it after the move
 	auto const size = body.size();
@@ -114,12 +152,91 @@ auto ok_get_file(
 		std::make_tuple(std::move(body)),
 		std::make_tuple(http::status::ok, req.version())};
 	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-	res.set(http::field::content_type, pathutil::get_mime_type(path, state.get_mime_type_map()));
+	res.set(http::field::content_type, mime_type);
+	res.set(http::field::accept_ranges, "bytes");
 	res.content_length(size);
 	res.keep_alive(req.keep_alive());
 	return res;
 }
 
+// Returns a 206 with the requested ranges of a file
+auto partial_content(
+	const auto& req,
+	std::string_view mime_type,
+	const std::vector<range_body::byte_range>& ranges,
+	http::file_body::value_type&& body)
+{
+	auto const size = body.size();
+
+	http::response<range_body::file_range_body> res{http::status::partial_content, req.version()};
+	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+	res.set(http::field::accept_ranges, "bytes");
+	if(ranges.size() == 1)
+	{
+		res.set(http::field::content_type, mime_type);
+		res.set(http::field::content_range,
+			"bytes " + std::to_string(ranges[0].first) + "-" +
+			std::to_string(ranges[0].last) + "/" + std::to_string(size));
+		res.body().assign(std::move(body.file()), ranges[0]);
+	}
+	else
+	{
+		std::string boundary = range_body::make_boundary();
+		res.set(http::field::content_type, "multipart/byteranges; boundary=" + boundary);
+		res.body().assign(std::move(body.file()), ranges, mime_type, size, boundary);
+	}
+	res.keep_alive(req.keep_alive());
+	res.prepare_payload();
+	return res;
+}
+
+// Returns a 416 for ranges that don't overlap the file
+auto range_not_satisfiable(const auto& req, std::uint64_t size)
+{
+	http::response<http::empty_body> res{http::status::range_not_satisfiable, req.version()};
+	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+	res.set(http::field::content_range, "bytes */" + std::to_string(size));
+	res.keep_alive(req.keep_alive());
+	res.prepare_payload();
+	return res;
+}
+
+auto ok_head_shared(
+	const auto& req,
+	std::string_view mime_type,
+	const shared_body::shared_string_body::value_type& body)
+{
+	http::response<http::empty_body> res{http::status::ok, req.version()};
+	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+	res.set(http::field::content_type, mime_type);
+	res.content_length(shared_body::shared_string_body::size(body));
+	res.keep_alive(req.keep_alive());
+	return res;
+}
+
+auto ok_get_shared(
+	const auto& req,
+	std::string_view mime_type,
+	shared_body::shared_string_body::value_type body)
+{
+	http::response<shared_body::shared_string_body> res{http::status::ok, req.version()};
+	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+	res.set(http::field::content_type, mime_type);
+	res.keep_alive(req.keep_alive());
+	res.body() = std::move(body);
+	res.prepare_payload();
+	return res;
+}
+
+// Mark a response as one of several encoded representations
+void set_encoding(auto& res, compression::encoding enc, bool negotiable)
+{
+	if(enc != compression::encoding::identity)
+		res.set(http::field::content_encoding, compression::encoding_name(enc));
+	if(negotiable)
+		res.set(http::field::vary, "Accept-Encoding");
+}
+
 auto ok_string(
 	const auto& req,
 	std::string_view data)
@@ -146,6 +263,20 @@ auto bad_request_string(
 	return res;
 }
 
+// Returns the results of a bulk or resolve request, one JSON object per line
+auto ok_ndjson(
+	const auto& req,
+	std::string&& data)
+{
+	http::response<http::string_body> res{http::status::ok, req.version()};
+	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+	res.set(http::field::content_type, "application/x-ndjson");
+	res.keep_alive(req.keep_alive());
+	res.body() = std::move(data);
+	res.prepare_payload();
+	return res;
+}
+
 // Produce an HTTP response for a file request
 template<class Body, class Allocator, class Send>
 void
@@ -155,7 +286,7 @@ handle_file(
 	Send&& send)
 {
 	// Build the path to the requested file
-	std::string path = pathutil::path_cat(state.get_config_doc_root(), req.target());
+	std::string path = pathutil::path_cat(state.config().doc_root, req.target());
 
 	// Make sure we can handle the method
 	if(req.method() != http::verb::get &&
@@ -176,18 +307,97 @@ handle_file(
 	// Handle an unknown error
 	if(ec)
 	{
-		syslog(LOG_ERR, "Unknown error fetching file %s: %s", req.target().data(), ec.message().c_str());
+		logging::log(LOG_ERR, "Unknown error fetching file %.*s: %s", static_cast<int>(req.target().size()),
+			req.target().data(), ec.message().c_str());
 		return send(server_error(req, ec.message()));
 	}
 
+	// The entry carries the MIME type and any encoded variants.
+	// These are prepared once per file, never per request.
+	auto entry = state.get_static_cache().get_file(path, body.file().native_handle(), state.get_mime_type_map());
+	std::string_view mime_type = entry ?
+		std::string_view{entry->mime_type} :
+		pathutil::get_mime_type(path, state.get_mime_type_map());
+
+	// Pick an encoded variant if we have one the client accepts
+	bool negotiable = entry && entry->is_negotiable();
+	auto enc = compression::encoding::identity;
+	if(negotiable)
+	{
+		enc = compression::choose_encoding(
+			req[http::field::accept_encoding],
+			entry->has(compression::encoding::gzip),
+			entry->has(compression::encoding::brotli));
+	}
+
+	if(enc != compression::encoding::identity && !entry->is_sibling(enc))
+	{
+		auto variant = entry->variants.get(enc);
+		if(req.method() == http::verb::head)
+		{
+			auto res = ok_head_shared(req, mime_type, variant);
+			set_encoding(res, enc, negotiable);
+			return send(std::move(res));
+		}
+
+		auto res = ok_get_shared(req, mime_type, std::move(variant));
+		set_encoding(res, enc, negotiable);
+		return send(std::move(res));
+	}
+
+	if(enc != compression::encoding::identity)
+	{
+		// Serve the prebuilt sibling from the docroot instead
+		std::string sibling_path{path};
+		sibling_path.append(compression::encoding_suffix(enc));
+
+		http::file_body::value_type sibling;
+		sibling.open(sibling_path.c_str(), beast::file_mode::scan, ec);
+		if(ec)
+			// It went away underneath us, fall back to the original
+			enc = compression::encoding::identity;
+		else
+			body = std::move(sibling);
+	}
+
+	// Send only the requested ranges of whichever file we ended up with.
+	// We don't send validators, so any If-Range can't match and gets the whole file.
+	if(req.method() == http::verb::get &&
+		req.count(http::field::range) &&
+		!req.count(http::field::if_range))
+	{
+		std::vector<range_body::byte_range> ranges;
+		switch(range_body::parse_range(req[http::field::range], body.size(), ranges))
+		{
+		case range_body::range_result::satisfiable:
+		{
+			auto res = partial_content(req, mime_type, ranges, std::move(body));
+			set_encoding(res, enc, negotiable);
+			return send(std::move(res));
+		}
+		case range_body::range_result::unsatisfiable:
+		{
+			auto res = range_not_satisfiable(req, body.size());
+			set_encoding(res, enc, negotiable);
+			return send(std::move(res));
+		}
+		default:
+			break;
+		}
+	}
+
 	// Respond to HEAD request
 	if(req.method() == http::verb::head)
 	{
-		return send(ok_head_file(req, path, std::move(body), state));
+		auto res = ok_head_file(req, mime_type, std::move(body));
+		set_encoding(res, enc, negotiable);
+		return send(std::move(res));
 	}
 	else if(req.method() == http::verb::get)
 	{
-		return send(ok_get_file(req, path, std::move(body), state));
+		auto res = ok_get_file(req, mime_type, std::move(body));
+		set_encoding(res, enc, negotiable);
+		return send(std::move(res));
 	}
 	else
 	{
@@ -195,21 +405,28 @@ handle_file(
 	}
 }
 
-// Produce an HTTP response for a post request
+// Get the boundary out of a multipart Content-Type, if there is one
+inline std::optional<std::string_view>
+multipart_boundary(std::string_view content_type)
+{
+	auto boundary = multipart_wrapper::HeaderParams::find(content_type, "boundary");
+	if(!boundary || boundary->empty())
+		return std::nullopt;
+
+	return boundary;
+}
+
+// Store a URL we've been given and render the result page.
+// The URL must already have been validated with urlcheck.
 template<class Body, class Allocator, class Send>
 void
-handle_post(
+handle_post_url(
 	const server_state::ServerState& state,
 	http::request<Body, http::basic_fields<Allocator>>&& req,
+	const std::string& url,
 	Send&& send)
 {
-	if(req.method() != http::verb::post)
-	{
-		// POST requests only please!
-		return send(bad_request(req, "Unknown HTTP-method"));
-	}
-
-	std::string path = pathutil::path_cat(state.get_config_doc_root(), req.target());
+	std::string path = pathutil::path_cat(state.config().doc_root, req.target());
 
 	if(req.target().back() == '/')
 		path.append("index.html");
@@ -219,7 +436,78 @@ handle_post(
 	inja::Environment env;
 	inja::json data;
 
-	data["hostname"] = state.get_config_hostname();
+	data["hostname"] = state.config().hostname;
+
+	std::string token = generate::generate_random_filename();
+	data["url"] = url;
+	data["token"] = token;
+
+	trace::mark(trace::phase::sqlite_begin);
+	metrics::timer sqlite_timer{metrics::histogram::sqlite};
+	auto db = sqlite_helper::make_sqlite3_handle(state.config().db_path.c_str());
+	sqlite3_stmt *res;
+	int rc = sqlite3_prepare_v2(
+		db.get(),
+		"INSERT INTO urls (token, url) VALUES (?, ?);",
+		-1,
+		&res,
+		nullptr);
+	if(rc != SQLITE_OK)
+	{
+		std::string error{sqlite3_errmsg(db.get())};
+		logging::log(LOG_ERR, "Error with sqlite3: %s", error.c_str());
+		return send(server_error(req, "SQL error: " + error));
+	}
+
+	sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(res); }};
+
+	sqlite3_bind_text(res, 1, token.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(res, 2, url.c_str(), -1, SQLITE_STATIC);
+
+	int step = sqlite3_step(res);
+	if(step != SQLITE_DONE)
+	{
+		std::string error{sqlite3_errmsg(db.get())};
+		logging::log(LOG_ERR, "Error with sqlite3: %s", error.c_str());
+		return send(server_error(req, "SQL error: " + error));
+	}
+
+	sqlite_timer.stop();
+	trace::mark(trace::phase::sqlite_end);
+	token_filter::add(token);
+
+	inja::Template temp;
+	std::string result;
+
+	try
+	{
+		trace::mark(trace::phase::render_begin);
+		metrics::timer render_timer{metrics::histogram::render};
+		temp = env.parse_template(path);
+		result = env.render(temp, data);
+		trace::mark(trace::phase::render_end);
+	}
+	catch(std::exception& e)
+	{
+		return send(bad_request(req, std::string("Could not serve page: ") + e.what()));
+	}
+
+	return send(ok_string(req, result));
+}
+
+// Produce an HTTP response for a post request
+template<class Body, class Allocator, class Send>
+void
+handle_post(
+	const server_state::ServerState& state,
+	http::request<Body, http::basic_fields<Allocator>>&& req,
+	Send&& send)
+{
+	if(req.method() != http::verb::post)
+	{
+		// POST requests only please!
+		return send(bad_request(req, "Unknown HTTP-method"));
+	}
 
 	std::string url;
 
@@ -227,66 +515,46 @@ handle_post(
 
 	if(content_type == "application/x-www-form-urlencoded")
 	{
-		std::map qsm = parseqs::parse_qsl(req.body());
-		auto it = qsm.find("url");
-		if(it == qsm.end())
+		// Only the url parameter is decoded, straight into its final home,
+		// and it's validated as it's decoded.
+		auto value = parseqs::find_param(req.body(), "url");
+		if(!value)
 		{
 			return send(bad_request(req, "No URL parameter passed"));
 		}
 
-		url = it->second;
+		auto error = urlcheck::decode_url(*value, url);
+		if(error != urlcheck::url_error::none)
+		{
+			return send(bad_request(req, urlcheck::describe(error)));
+		}
 	}
 	else if(content_type.starts_with("multipart/form-data"))
 	{
-		using MultiPartData = multipart_wrapper::MultiPartData;
-		using MultiPartSection = MultiPartData::MultiPartSection;
-		auto hv = MultiPartSection::parse_header_value(content_type);
-
-		if(std::holds_alternative<std::string>(hv))
+		auto boundary = multipart_boundary(content_type);
+		if(!boundary)
 		{
 			return send(bad_request(req, "Bad request"));
 		}
 
-		auto hvmap = std::get<MultiPartSection::header_params_type>(hv);
-		if(std::holds_alternative<std::monostate>(hvmap["boundary"]))
+		// Most multipart posts are streamed by the session (see below),
+		// but if the whole body is here, split it up in place.
+		multipart_wrapper::MultiPartData mpd{*boundary};
+		mpd.ingest(req.body());
+		if(auto section = mpd.find_field("url"))
 		{
-			return send(bad_request(req, "Bad request"));
-		}
-		std::string boundary{std::get<std::string>(hvmap["boundary"])};
-		if(boundary.empty())
-		{
-			return send(bad_request(req, "Bad request"));
+			url = section->get_data();
 		}
 
-		MultiPartData mpd{boundary};
-		std::string body{req.body()};
-		boost::trim_right(body);
-		mpd.ingest(body);
-		auto form_data = mpd.get_data();
-		for(auto& elem : form_data)
+		if(url == "")
 		{
-			auto h = elem.get_headers();
-			auto cd = h["Content-Disposition"];
-			if(std::holds_alternative<std::string>(cd))
-			{
-				continue;
-			}
-
-			auto cdmap = std::get<MultiPartSection::header_params_type>(cd);
-			if(std::holds_alternative<std::monostate>(cdmap["name"]))
-			{
-				continue;
-			}
-			if(std::get<std::string>(cdmap["name"]) == "url")
-			{
-				url = elem.get_data();
-				break;
-			}
+			return send(bad_request(req, "No URL specified"));
 		}
 
-		if(url == "")
+		auto error = urlcheck::check_url(url);
+		if(error != urlcheck::url_error::none)
 		{
-			return send(bad_request(req, "No URL specified"));
+			return send(bad_request(req, urlcheck::describe(error)));
 		}
 	}
 	else
@@ -294,57 +562,225 @@ handle_post(
 		return send(bad_request(req, "Bad content type " + std::string(content_type)));
 	}
 
-	if(!(url.starts_with("http://") || url.starts_with("https://")))
+	return handle_post_url(state, std::move(req), url, std::forward<Send>(send));
+}
+
+// Multipart posts to the shortener can have their url field pulled out
+// while the body is being read, rather than buffering the whole thing.
+// Returns the boundary if this request should be streamed.
+// The boundary points into the header's fields.
+template<class Fields>
+std::optional<std::string_view>
+streamable_post_boundary(const http::request_header<Fields>& header)
+{
+	if(header.method() != http::verb::post || header.target() != "/post.html")
+		return std::nullopt;
+
+	std::string_view content_type = header[http::field::content_type];
+	if(!content_type.starts_with("multipart/form-data"))
+		return std::nullopt;
+
+	return multipart_boundary(content_type);
+}
+
+// Finish a streamed post once the body has been read
+template<class Body, class Allocator, class Send>
+void
+handle_streamed_post(
+	const server_state::ServerState& state,
+	http::request<Body, http::basic_fields<Allocator>>&& req,
+	const multipart_wrapper::FieldExtractor& fe,
+	Send&& send)
+{
+	// This bypasses handle_request, so it's limited and counted here
+	if(!ratelimit::allow_request(true))
+		return send(too_many_requests(req));
+
+	if(!fe.done() || fe.value().empty())
 	{
-		return send(bad_request(req, "Invalid URL"));
+		return send(bad_request(req, "No URL specified"));
 	}
 
-	std::string token = generate::generate_random_filename();
-	data["url"] = url;
-	data["token"] = token;
+	metrics::add(metrics::counter::requests_post);
+	metrics::timer request_timer{metrics::histogram::request_post};
 
-	auto db = sqlite_helper::make_sqlite3_handle(state.get_config_db_path().data());
-	sqlite3_stmt *res;
-	int rc = sqlite3_prepare_v2(
-		db.get(),
-		"INSERT INTO urls (token, url) VALUES (?, ?);",
-		-1,
-		&res,
-		nullptr);
-	if(rc != SQLITE_OK)
+	std::string url{fe.value()};
+	auto error = urlcheck::check_url(url);
+	if(error != urlcheck::url_error::none)
 	{
-		std::string error{sqlite3_errmsg(db.get())};
-		syslog(LOG_ERR, "Error with sqlite3: %s", error.c_str());
+		return send(bad_request(req, urlcheck::describe(error)));
+	}
+
+	return handle_post_url(state, std::move(req), url, std::forward<Send>(send));
+}
+
+// Give the URLs a bulk request collected their tokens and send them back
+template<class Body, class Allocator, class Send>
+void
+handle_bulk_urls(
+	const server_state::ServerState& state,
+	http::request<Body, http::basic_fields<Allocator>>&& req,
+	bulk::collector& urls,
+	Send&& send)
+{
+	if(!urls.finish())
+	{
+		return send(bad_request(req, urls.error()));
+	}
+
+	// Only now do we know how much work it is
+	if(!ratelimit::allow_bulk(urls.items().size()))
+		return send(too_many_requests(req));
+
+	trace::mark(trace::phase::sqlite_begin);
+	metrics::timer sqlite_timer{metrics::histogram::sqlite};
+	std::string error;
+	if(!bulk::store(state.config().db_path, urls.items(), error))
+	{
+		logging::log(LOG_ERR, "Error with sqlite3: %s", error.c_str());
 		return send(server_error(req, "SQL error: " + error));
 	}
+	sqlite_timer.stop();
+	trace::mark(trace::phase::sqlite_end);
 
-	sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(res); }};
+	auto const stored = std::count_if(urls.items().begin(), urls.items().end(),
+		[](const bulk::item& it) { return !it.token.empty(); });
+	metrics::add(metrics::counter::bulk_urls, stored);
 
-	sqlite3_bind_text(res, 1, token.c_str(), -1, SQLITE_STATIC);
-	sqlite3_bind_text(res, 2, url.c_str(), -1, SQLITE_STATIC);
+	return send(ok_ndjson(req, bulk::render(urls.items(), state.config().hostname)));
+}
 
-	int step = sqlite3_step(res);
-	if(step != SQLITE_DONE)
+// Produce an HTTP response for a bulk request that was read whole,
+// e.g. over HTTP/2, or with a Content-Type we don't stream
+template<class Body, class Allocator, class Send>
+void
+handle_bulk(
+	const server_state::ServerState& state,
+	http::request<Body, http::basic_fields<Allocator>>&& req,
+	Send&& send)
+{
+	if(req.method() != http::verb::post)
 	{
-		std::string error{sqlite3_errmsg(db.get())};
-		syslog(LOG_ERR, "Error with sqlite3: %s", error.c_str());
+		// POST requests only please!
+		return send(bad_request(req, "Unknown HTTP-method"));
+	}
+
+	std::string_view content_type = req[http::field::content_type];
+	auto format = bulk::format_of(content_type);
+	if(!format)
+	{
+		return send(bad_request(req, "Bad content type " + std::string(content_type)));
+	}
+
+	bulk::collector urls{bulk::list::urls, *format, state.config().bulk_max_urls};
+	urls.ingest(req.body());
+	return handle_bulk_urls(state, std::move(req), urls, std::forward<Send>(send));
+}
+
+// Look up the tokens a resolve request collected and send back their URLs
+template<class Body, class Allocator, class Send>
+void
+handle_resolve_tokens(
+	const server_state::ServerState& state,
+	http::request<Body, http::basic_fields<Allocator>>&& req,
+	bulk::collector& tokens,
+	Send&& send)
+{
+	if(!tokens.finish())
+	{
+		return send(bad_request(req, tokens.error()));
+	}
+
+	// Only now do we know how much work it is
+	if(!ratelimit::allow_bulk(tokens.items().size()))
+		return send(too_many_requests(req));
+
+	trace::mark(trace::phase::sqlite_begin);
+	metrics::timer sqlite_timer{metrics::histogram::sqlite};
+	std::string error;
+	if(!bulk::resolve(state.config().db_path, tokens.items(), error))
+	{
+		logging::log(LOG_ERR, "Error with sqlite3: %s", error.c_str());
 		return send(server_error(req, "SQL error: " + error));
 	}
+	sqlite_timer.stop();
+	trace::mark(trace::phase::sqlite_end);
 
-	inja::Template temp;
-	std::string result;
+	auto const found = std::count_if(tokens.items().begin(), tokens.items().end(),
+		[](const bulk::item& it) { return !it.url.empty(); });
+	metrics::add(metrics::counter::resolved_tokens, found);
 
-	try
+	return send(ok_ndjson(req, bulk::render_resolved(tokens.items())));
+}
+
+// Produce an HTTP response for a resolve request that was read whole
+template<class Body, class Allocator, class Send>
+void
+handle_resolve(
+	const server_state::ServerState& state,
+	http::request<Body, http::basic_fields<Allocator>>&& req,
+	Send&& send)
+{
+	if(req.method() != http::verb::post)
 	{
-		temp = env.parse_template(path);
-		result = env.render(temp, data);
+		// POST requests only please!
+		return send(bad_request(req, "Unknown HTTP-method"));
 	}
-	catch(std::exception& e)
+
+	std::string_view content_type = req[http::field::content_type];
+	auto format = bulk::format_of(content_type);
+	if(!format)
 	{
-		return send(bad_request(req, std::string("Could not serve page: ") + e.what()));
+		return send(bad_request(req, "Bad content type " + std::string(content_type)));
 	}
 
-	return send(ok_string(req, result));
+	bulk::collector tokens{bulk::list::tokens, *format, state.config().bulk_max_urls};
+	tokens.ingest(req.body());
+	return handle_resolve_tokens(state, std::move(req), tokens, std::forward<Send>(send));
+}
+
+// Bulk and resolve requests are split up as the body arrives, and have their own, larger, body limit.
+// Returns a collector for the body if this request should be streamed.
+template<class Fields>
+std::unique_ptr<bulk::collector>
+streamable_bulk(const http::request_header<Fields>& header, const server_state::Config& config)
+{
+	if(header.method() != http::verb::post)
+		return nullptr;
+
+	auto list = bulk::list_of(header.target());
+	auto format = bulk::format_of(header[http::field::content_type]);
+	if(!list || !format)
+		return nullptr;
+
+	return std::make_unique<bulk::collector>(*list, *format, config.bulk_max_urls);
+}
+
+// Finish a streamed bulk or resolve request once the body has been read
+template<class Body, class Allocator, class Send>
+void
+handle_streamed_bulk(
+	const server_state::ServerState& state,
+	http::request<Body, http::basic_fields<Allocator>>&& req,
+	bulk::collector& list,
+	Send&& send)
+{
+	// This bypasses handle_request, so it's limited and counted here
+	if(!ratelimit::allow_request(true))
+		return send(too_many_requests(req));
+
+	if(list.kind() == bulk::list::tokens)
+	{
+		metrics::add(metrics::counter::requests_resolve);
+		metrics::timer request_timer{metrics::histogram::request_resolve};
+
+		return handle_resolve_tokens(state, std::move(req), list, std::forward<Send>(send));
+	}
+
+	metrics::add(metrics::counter::requests_bulk);
+	metrics::timer request_timer{metrics::histogram::request_bulk};
+
+	return handle_bulk_urls(state, std::move(req), list, std::forward<Send>(send));
 }
 
 // Handle serving a template
@@ -363,29 +799,44 @@ handle_get_template(
 
 	// These are templated pages
 	// Off to the templating engine
-	std::string path = pathutil::path_cat(state.get_config_doc_root(), req.target());
+	std::string path = pathutil::path_cat(state.config().doc_root, req.target());
 
 	if(req.target().back() == '/')
 		path.append("index.html");
 
-	inja::Environment env;
-	inja::json data;
-
-	data["hostname"] = state.get_config_hostname();
-
-	inja::Template temp;
-	std::string result;
+	// These only depend on the configuration, so they're rendered
+	// (and compressed) once and served from the cache afterwards.
+	std::shared_ptr<const static_cache::Variants> page;
 	try
 	{
-		temp = env.parse_template(path);
-		result = env.render(temp, data);
+		page = state.get_static_cache().get_page(path, [&]
+		{
+			trace::mark(trace::phase::render_begin);
+			metrics::timer render_timer{metrics::histogram::render};
+			inja::Environment env;
+			inja::json data;
+
+			data["hostname"] = state.config().hostname;
+
+			inja::Template temp = env.parse_template(path);
+			auto page = env.render(temp, data);
+			trace::mark(trace::phase::render_end);
+			return page;
+		});
 	}
 	catch(std::exception& e)
 	{
 		return send(bad_request(req, std::string("Could not serve page: ") + e.what()));
 	}
 
-	return send(ok_string(req, result));
+	auto enc = compression::choose_encoding(
+		req[http::field::accept_encoding],
+		page->gzip != nullptr,
+		page->brotli != nullptr);
+
+	auto res = ok_get_shared(req, "text/html", page->get(enc));
+	set_encoding(res, enc, page->gzip || page->brotli);
+	return send(std::move(res));
 }
 
 // Handle getting a shortened/shady URL
@@ -402,8 +853,18 @@ handle_get_url(
 		return send(bad_request(req, "Unknown HTTP-method"));
 	}
 
+	// ;)
+	static constexpr std::string_view unknown_token_url = "https://www.youtube.com/watch?v=dQw4w9WgXcQ?autoplay=1";
+
+	// Scanners asking for /wp-login.php and the like don't need the database to tell them no
+	std::string token{req.target().substr(1)};
+	if(!token_filter::may_contain(state.config().db_path, token))
+		return send(redirect_permanent(req, unknown_token_url));
+
 	// We assume this is a shortened URL otherwise.
-	auto db = sqlite_helper::make_sqlite3_handle(state.get_config_db_path().data());
+	trace::mark(trace::phase::sqlite_begin);
+	metrics::timer sqlite_timer{metrics::histogram::sqlite};
+	auto db = sqlite_helper::make_sqlite3_handle(state.config().db_path.c_str());
 	sqlite3_stmt *res;
 	int rc = sqlite3_prepare_v2(
 		db.get(),
@@ -414,18 +875,17 @@ handle_get_url(
 	if(rc != SQLITE_OK)
 	{
 		std::string error{sqlite3_errmsg(db.get())};
-		syslog(LOG_ERR, "Error with sqlite3: %s", error.c_str());
+		logging::log(LOG_ERR, "Error with sqlite3: %s", error.c_str());
 		return send(server_error(req, "SQL error: " + error));
 	}
 
 	sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(res); }};
 
-	std::string token{req.target().substr(1)};
 	rc = sqlite3_bind_text(res, 1, token.c_str(), -1, SQLITE_STATIC);
 	if(rc != SQLITE_OK)
 	{
 		std::string error{sqlite3_errmsg(db.get())};
-		syslog(LOG_ERR, "Error with sqlite3: %s", error.c_str());
+		logging::log(LOG_ERR, "Error with sqlite3: %s", error.c_str());
 		return send(server_error(req, "SQL error:" + error));
 	}
 
@@ -437,13 +897,16 @@ handle_get_url(
 	}
 	else
 	{
-		// ;)
-		url = "https://www.youtube.com/watch?v=dQw4w9WgXcQ?autoplay=1";
+		url = unknown_token_url;
 	}
+
+	sqlite_timer.stop();
+	trace::mark(trace::phase::sqlite_end);
 	return send(redirect_permanent(req, url));
 }
 
-#define REQ_ROUTE_DEF(re, fn) {std::regex{re}, static_cast<fn_ptr_type>(&fn)}
+#define REQ_ROUTE_DEF(re, fn, route) {std::regex{re}, static_cast<fn_ptr_type>(&fn), \
+	metrics::counter::requests_##route, metrics::histogram::request_##route}
 
 // This function produces an HTTP response for the given
 // request. The type of the response object depends on the
@@ -461,12 +924,14 @@ handle_request(
 			const server_state::ServerState& state,
 			http::request<Body, http::basic_fields<Allocator>>&&,
 			Send&&);
-	static const std::array<std::tuple<std::regex, fn_ptr_type>, 5> routes{{
-		REQ_ROUTE_DEF(R"RE(^/(assets/.*|favicon\.ico|robots\.txt)$)RE", handle_file),
-		REQ_ROUTE_DEF(R"RE(^/post\.html$)RE", handle_post),
-		REQ_ROUTE_DEF(R"RE(^/$)RE", handle_get_template),
-		REQ_ROUTE_DEF(R"RE(^/(.*\.html)?$)RE", handle_get_template),
-		REQ_ROUTE_DEF(R"RE(^/[^/]+$)RE", handle_get_url),
+	static const std::array<std::tuple<std::regex, fn_ptr_type, metrics::counter, metrics::histogram>, 7> routes{{
+		REQ_ROUTE_DEF(R"RE(^/(assets/.*|favicon\.ico|robots\.txt)$)RE", handle_file, file),
+		REQ_ROUTE_DEF(R"RE(^/post\.html$)RE", handle_post, post),
+		REQ_ROUTE_DEF(R"RE(^/bulk$)RE", handle_bulk, bulk),
+		REQ_ROUTE_DEF(R"RE(^/resolve$)RE", handle_resolve, resolve),
+		REQ_ROUTE_DEF(R"RE(^/$)RE", handle_get_template, template),
+		REQ_ROUTE_DEF(R"RE(^/(.*\.html)?$)RE", handle_get_template, template),
+		REQ_ROUTE_DEF(R"RE(^/[^/]+$)RE", handle_get_url, url),
 	}};
 
 	// Request path must be absolute and not contain "..".
@@ -474,15 +939,23 @@ handle_request(
 		req.target()[0] != '/' ||
 		req.target().find("..") != std::string_view::npos)
 	{
+		metrics::add(metrics::counter::requests_bad_target);
 		return send(bad_request(req, "Illegal request-target"));
 	}
 
+	// Turn away clients over their request rate before doing any real work
+	if(!ratelimit::allow_request(req.method() == http::verb::post))
+		return send(too_many_requests(req));
+
 	// std::regex_search only takes strings
 	std::string target{req.target()};
-	for(auto& [re, fn] : routes)
+	for(auto& [re, fn, count, latency] : routes)
 	{
 		if(std::regex_search(target, re))
 		{
+			trace::mark(trace::phase::routed);
+			metrics::add(count);
+			metrics::timer request_timer{latency};
 			return fn(
 				state,
 				std::forward<decltype(req)>(req),
@@ -490,6 +963,7 @@ handle_request(
 		}
 	}
 
+	metrics::add(metrics::counter::requests_not_found);
 	return send(not_found(req, target));
 }
 
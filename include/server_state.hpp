@@ -1,43 +1,167 @@
 #ifndef SERVER_STATE_H
 #define SERVER_STATE_H
 
+#include <memory>
 #include <optional>
 #include <cstdint>
-#include <string_view>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <boost/asio/ssl/context.hpp>
 
 #include <toml++/toml.h>
 
 #include "mime.hpp"
+#include "static_cache.hpp"
 
 namespace server_state
 {
 
+// What a listener expects its clients to speak
+enum class listen_mode
+{
+	detect,		// Sniff each connection for a TLS handshake
+	tls,
+	plain,
+};
+
+// One [[listen]] entry
+struct Listen
+{
+	std::string address = "0.0.0.0";
+	std::uint16_t port = 0;
+	listen_mode mode = listen_mode::detect;
+
+	// Socket options; 0 leaves the system default
+	std::uint32_t backlog = 0;
+	std::uint32_t rcvbuf = 0;
+	std::uint32_t sndbuf = 0;
+	bool nodelay = false;
+	bool keepalive = false;
+	bool reuseport = false;
+
+	bool operator==(const Listen&) const = default;
+};
+
+// The configuration, parsed and validated once when it's loaded.
+// Missing keys get their defaults here.
+struct Config
+{
+	// [[listen]], or the older [listen] table's ip, port and port2, which detect TLS
+	std::vector<Listen> listeners;
+	std::uint16_t metrics_port = 0;	// Only ever on localhost; 0 to turn off
+
+	// [config]
+	std::uint32_t threads = 2;
+	std::string doc_root = ".";
+	std::string hostname = "z6a.info";
+	std::string log_level = "info";
+	bool daemon = false;
+	std::string cert_file = "cert.pem";
+	std::string key_file = "key.pem";
+	std::string dh_file = "dh.pem";
+	std::string user;
+	std::string group;
+	std::string db_path = "urls.db";
+
+	// How long to wait for connections to finish on shutdown, in seconds
+	std::uint32_t drain_timeout = 30;
+
+	// Requests slower than this are traced and logged, in milliseconds; 0 to turn off
+	std::uint32_t slow_request_ms = 0;
+
+	// Where to write the access log; empty to turn it off
+	std::string access_log;
+
+	// At most this many messages a second are passed on to syslog
+	std::uint32_t log_rate_limit = 100;
+
+	// Offer HTTP/2 to TLS clients, if we were built with it
+	bool http2 = true;
+
+	// Most connections open at once; 0 to work it out from the file descriptor limit
+	std::uint32_t max_connections = 0;
+
+	// Per-client limits, by IPv4 address or IPv6 /64; rates are per second, and 0 turns a limit off.
+	// Bursts default to a second's worth.
+	std::uint32_t connection_rate = 0;
+	std::uint32_t connection_burst = 0;
+	std::uint32_t max_connections_per_client = 0;
+	std::uint32_t request_rate = 0;
+	std::uint32_t request_burst = 0;
+	std::uint32_t post_cost = 10;		// Request tokens a POST takes
+	std::uint32_t bulk_items = 100;		// URLs or tokens in a bulk request that count as one POST
+
+	// Clients tracked by the rate limiter; only read at startup
+	std::uint32_t ratelimit_entries = 65536;
+
+	// How long each stage of a connection may take, in seconds
+	std::uint32_t handshake_timeout = 10;
+	std::uint32_t header_timeout = 10;
+	std::uint32_t body_timeout = 30;
+	std::uint32_t idle_timeout = 30;
+	std::uint32_t write_timeout = 30;
+
+	// Past this percentage of maxconnections, idle and handshake timeouts shrink; 0 to turn off
+	std::uint32_t overload_percent = 75;
+
+	// Limits on bulk shortening and resolve requests; the body can be read as it arrives, so it can be larger
+	std::uint32_t bulk_max_body = 8 * 1024 * 1024;
+	std::uint32_t bulk_max_urls = 10000;	// URLs or tokens
+
+	// Tokens the lookup filter is sized for, and bits of it per token; only read at startup.
+	// 0 tokens turns the filter off, and every token is looked up.
+	std::uint32_t filter_tokens = 1000000;
+	std::uint32_t filter_bits_per_token = 10;
+};
+
+// Build a Config from a parsed config file.
+// Relative certificate paths are taken to be relative to base_dir, the directory we started in,
+// since a daemon has moved to / by the time it reloads.
+// Problems are logged, and an empty optional is returned.
+std::optional<Config> parse_config(const toml::table&, const std::filesystem::path& base_dir);
+
 // This is a state class passed around to servers to keep the number of parameters low.
+// It's immutable once built, apart from the caches; a reload builds a new one.
 class ServerState
 {
 public:
-	ServerState(const toml::table&, const mime_type::MimeTypeMap&);
+	ServerState(Config, mime_type::MimeTypeMap, boost::asio::ssl::context&&);
 
-	const toml::table& get_config_table() const;
+	const Config& config() const;
 	const mime_type::MimeTypeMap& get_mime_type_map() const;
+	static_cache::StaticCache& get_static_cache() const;
+
+	// TLS streams need a non-const context, but nothing changes it after loading
+	boost::asio::ssl::context& get_ssl_context() const;
+
+private:
+	const Config config_;
+	const mime_type::MimeTypeMap mtm_;
+	mutable boost::asio::ssl::context ssl_ctx_;
+
+	// Caches are filled in lazily while serving requests
+	mutable static_cache::StaticCache static_cache_;
+};
+
+// Load the config file, MIME types and certificates into a new ServerState.
+// Problems are logged and nullptr is returned; on reload, the old state stays in use.
+std::shared_ptr<const ServerState> load_state(const std::string& config_file, const std::string& mimetypes_file);
+
+// Holds the current ServerState.
+// Connections take a snapshot when they're accepted and keep it until they close,
+// so a new state can be published at any time without disturbing them.
+class StateHolder
+{
+public:
+	explicit StateHolder(std::shared_ptr<const ServerState>);
+
+	std::shared_ptr<const ServerState> get() const;
+	void set(std::shared_ptr<const ServerState>);
 
-	std::uint32_t get_config_threads() const;
-	std::string_view get_config_address() const;
-	std::uint16_t get_config_port() const;
-	std::uint16_t get_config_port2() const;
-	std::string_view get_config_doc_root() const;
-	std::string_view get_config_hostname() const;
-	std::string_view get_config_log_level() const;
-	bool get_config_daemon() const;
-	std::string_view get_config_cert_file() const;
-	std::string_view get_config_key_file() const;
-	std::string_view get_config_dh_file() const;
-	std::string_view get_config_user() const;
-	std::string_view get_config_group() const;
-	std::string_view get_config_db_path() const;
 private:
-	toml::table tbl_;
-	mime_type::MimeTypeMap mtm_;
+	std::shared_ptr<const ServerState> state_;
 };
 
 } // namespace server_state;
@@ -20,13 +20,21 @@
 #	define BOOST_BEAST_USE_STD_STRING_VIEW
 #endif
 
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/beast/ssl.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
@@ -35,9 +43,16 @@
 #include <regex>
 #include <utility>
 
+#include "buffer_pool.hpp"
+#include "bulk.hpp"
 #include "log.hpp"
+#include "metrics.hpp"
+#include "multipart_wrapper.hpp"
+#include "ratelimit.hpp"
 #include "request.hpp"
 #include "server_state.hpp"
+#include "timeouts.hpp"
+#include "trace.hpp"
 
 namespace session
 {
@@ -48,11 +63,50 @@ namespace net = boost::asio;		// from <boost/asio.hpp>
 namespace ssl = boost::asio::ssl;	// from <boost/asio/ssl.hpp>
 using tcp = boost::asio::ip::tcp;	// from <boost/asio/ip/tcp.hpp>
 
+// Keeps track of open connections, so a shutdown can let them finish first
+class connection_tracker
+{
+public:
+	// A connection that can be asked to wind down
+	struct connection
+	{
+		virtual ~connection() = default;
+
+		// Finish the current request and close; close straight away if idle
+		virtual void drain() = 0;
+	};
+
+	using handle = std::list<std::weak_ptr<connection>>::iterator;
+
+	handle add(std::weak_ptr<connection>);
+	void remove(handle);
+	std::size_t count() const;
+
+	bool
+	draining() const
+	{
+		return draining_.load(std::memory_order_relaxed);
+	}
+
+	// Ask every connection to finish up; on_empty is called once the last has closed
+	void drain(std::function<void()> on_empty);
+
+private:
+	mutable std::mutex lock_;
+	std::list<std::weak_ptr<connection>> connections_;
+	std::atomic<bool> draining_{false};
+	std::function<void()> on_empty_;
+	std::chrono::steady_clock::time_point last_report_;
+};
+
+// The process-wide tracker
+connection_tracker& connections();
+
 // Handles an HTTP server connection.
 // This uses the Curiously Recurring Template Pattern so that
 // the same code works with both SSL streams and regular sockets.
 template<class Derived>
-class http_session
+class http_session : public connection_tracker::connection
 {
 	// Access the derived class, this is part of
 	// the Curiously Recurring Template Pattern idiom.
@@ -62,6 +116,13 @@ class http_session
 		return static_cast<Derived&>(*this);
 	}
 
+	// An access log line waiting for its response to be written
+	struct pending_access
+	{
+		logging::access_record record;
+		std::chrono::steady_clock::time_point start;
+	};
+
 	// This queue is used for HTTP pipelining.
 	class queue
 	{
@@ -76,6 +137,12 @@ class http_session
 		{
 			virtual ~work() = default;
 			virtual void operator()() = 0;
+
+			// The trace of the request this responds to, if we're tracing
+			std::unique_ptr<trace::request_trace> trace;
+
+			// Its access log line, if we're logging them
+			std::optional<pending_access> access;
 		};
 
 		http_session& self_;
@@ -90,6 +157,13 @@ class http_session
 			items_.reserve(limit);
 		}
 
+		~queue()
+		{
+			// Anything left over was never sent
+			if(!items_.empty())
+				metrics::add(metrics::counter::responses_queued, -static_cast<std::int64_t>(items_.size()));
+		}
+
 		// Returns `true` if we have reached the queue limit
 		bool
 		is_full() const
@@ -97,6 +171,34 @@ class http_session
 			return items_.size() >= limit;
 		}
 
+		// Returns `true` if there's nothing left to send
+		bool
+		is_empty() const
+		{
+			return items_.empty();
+		}
+
+		// Called when a message finishes sending, before on_write
+		void
+		finish_request()
+		{
+			BOOST_ASSERT(!items_.empty());
+			auto& item = *items_.front();
+			if(auto& t = item.trace)
+			{
+				t->mark(trace::phase::written);
+				trace::finish(std::move(t));
+			}
+
+			if(item.access)
+			{
+				item.access->record.micros = static_cast<std::uint64_t>(
+					std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now() - item.access->start).count());
+				logging::access(item.access->record);
+			}
+		}
+
 		// Called when a message finishes sending
 		// Returns `true` if the caller should initiate a read
 		bool
@@ -105,6 +207,7 @@ class http_session
 			BOOST_ASSERT(!items_.empty());
 			auto const was_full = is_full();
 			items_.erase(items_.begin());
+			metrics::add(metrics::counter::responses_queued, -1);
 			if(!items_.empty())
 				(*items_.front())();
 			return was_full;
@@ -132,6 +235,13 @@ class http_session
 				void
 				operator()()
 				{
+					// When shutting down, the last response we'll send says so
+					if(connections().draining() && self_.queue_.items_.size() == 1)
+						msg_.keep_alive(false);
+
+					beast::get_lowest_layer(self_.derived().stream()).expires_after(
+						timeouts::deadline(self_.state_->config(), timeouts::stage::write));
+
 					http::async_write(
 						self_.derived().stream(),
 						msg_,
@@ -142,52 +252,358 @@ class http_session
 				}
 			};
 
+			metrics::add(metrics::status_class(msg.result_int()));
+			metrics::record(metrics::histogram::queue_depth, items_.size());
+			metrics::add(metrics::counter::responses_queued);
+
+			if(self_.access_)
+			{
+				self_.access_->record.status = msg.result_int();
+				self_.access_->record.bytes = msg.payload_size().value_or(0);
+			}
+
 			// Allocate and store the work
 			items_.push_back(
 				std::make_unique<work_impl>(self_, std::move(msg)));
 
+			// The request's trace goes with its response
+			if(self_.trace_)
+			{
+				self_.trace_->mark(trace::phase::queued);
+				items_.back()->trace = std::move(self_.trace_);
+			}
+
+			if(self_.access_)
+			{
+				items_.back()->access = std::move(self_.access_);
+				self_.access_.reset();
+			}
+
 			// If there was no previous work, start this one
 			if(items_.size() == 1)
 				(*items_.front())();
 		}
 	};
 
-	const server_state::ServerState& state_;
+	// The state this connection was accepted with; it's kept for as long as the connection lasts
+	std::shared_ptr<const server_state::ServerState> state_;
 	queue queue_;
 
-	// The parser is stored in an optional container so we can
-	// construct it from scratch it at the beginning of each new message.
+	// The header is read on its own first, so we can decide how to read the body.
+	// The parsers are stored in optional containers so we can
+	// construct them from scratch at the beginning of each new message.
+	std::optional<http::request_parser<http::empty_body>> header_parser_;
 	std::optional<http::request_parser<http::string_body>> parser_;
 
+	// Streamed multipart posts are read a chunk at a time into this
+	std::optional<http::request_parser<http::buffer_body>> stream_parser_;
+	std::optional<multipart_wrapper::FieldExtractor> extractor_;
+	std::unique_ptr<char[]> chunk_;
+
+	// As are bulk and resolve requests; only held while one is being read
+	std::unique_ptr<bulk::collector> bulk_;
+
+	// Our entry in the connection tracker, once we're in it
+	std::optional<connection_tracker::handle> tracked_;
+
+	// Counts us against the connection limits, and holds our client's request bucket
+	ratelimit::admission admission_;
+
+	// Are we waiting for a request with nothing received yet?
+	bool idle_ = false;
+
+	// Has a request been answered yet? Until then, waiting counts against the header timeout.
+	bool served_ = false;
+
+	// The whole body has to arrive by this time, however it's read
+	std::chrono::steady_clock::time_point body_deadline_;
+
+	// The trace of the request being read, if we're tracing
+	std::unique_ptr<trace::request_trace> trace_;
+
+	// The access log line of the request being read, and who it's from, if we're logging them
+	std::optional<pending_access> access_;
+	std::string client_;
+
+	enum
+	{
+		// Size of each chunk of a streamed body
+		chunk_size = 8192,
+
+		// Largest body of anything but a bulk request
+		body_limit = 10000
+	};
+
+	// The first byte of the next request; all we read while idle, so no buffer is held
+	char first_byte_;
+
 protected:
-	beast::flat_buffer buffer_;
+	buffer_pool::flat_buffer buffer_;
+
+	const std::shared_ptr<const server_state::ServerState>&
+	state() const
+	{
+		return state_;
+	}
+
+	const server_state::Config&
+	config() const
+	{
+		return state_->config();
+	}
+
+	// For handing the connection over to another session
+	ratelimit::admission
+	release_admission()
+	{
+		return std::move(admission_);
+	}
+
+	// Mark a phase of the request being read, if we're tracing
+	void
+	mark(trace::phase p)
+	{
+		if(trace_)
+			trace_->mark(p);
+	}
 
 public:
 	// Construct the session
 	http_session(
-		beast::flat_buffer buffer,
-		const server_state::ServerState& state)
-		: state_(state)
+		buffer_pool::flat_buffer buffer,
+		std::shared_ptr<const server_state::ServerState> state,
+		ratelimit::admission admission,
+		std::unique_ptr<trace::request_trace> trace)
+		: state_(std::move(state))
 		, queue_(*this)
+		, admission_(std::move(admission))
+		, trace_(std::move(trace))
 		, buffer_(std::move(buffer))
 	{
 	}
 
+	~http_session()
+	{
+		if(tracked_)
+		{
+			connections().remove(*tracked_);
+			metrics::add(metrics::counter::sessions_active, -1);
+		}
+	}
+
+	// Called by the derived class when the connection starts
+	void
+	track()
+	{
+		tracked_ = connections().add(derived().weak_from_this());
+		metrics::add(metrics::counter::sessions_active);
+
+		if(logging::access_log_enabled())
+		{
+			beast::error_code ec;
+			auto const remote = beast::get_lowest_layer(derived().stream()).socket().remote_endpoint(ec);
+			if(!ec)
+				client_ = remote.address().to_string();
+		}
+	}
+
+	// Called by the connection tracker on shutdown
+	void
+	drain() override
+	{
+		net::dispatch(
+			derived().stream().get_executor(),
+			[self = derived().shared_from_this()]
+			{
+				// Anything in progress finishes first; do_read() closes the connection after
+				if(self->idle_ && self->buffer_.size() == 0)
+					beast::get_lowest_layer(self->derived().stream()).cancel();
+			});
+	}
+
 	void
 	do_read()
+	{
+		// Don't start on another request if we're shutting down
+		if(connections().draining())
+		{
+			if(queue_.is_empty())
+				return derived().do_eof();
+			return;
+		}
+
+		// Wait for the next request to start arriving, unless it already has
+		if(buffer_.size() == 0)
+		{
+			// Hold on to as little as possible while we wait: the buffer goes back to
+			// the pool, and the parsers are made afresh for the next request anyway
+			buffer_.shrink_to_fit();
+			header_parser_.reset();
+			parser_.reset();
+			stream_parser_.reset();
+			chunk_.reset();
+
+			beast::get_lowest_layer(derived().stream()).expires_after(
+				timeouts::deadline(config(), idle_stage()));
+
+			idle_ = true;
+
+			derived().stream().async_read_some(
+				net::buffer(&first_byte_, 1),
+				beast::bind_front_handler(
+					&http_session::on_idle_read,
+					derived().shared_from_this()));
+			return;
+		}
+
+		do_read_header();
+	}
+
+	timeouts::stage
+	idle_stage() const
+	{
+		return served_ ? timeouts::stage::idle : timeouts::stage::header;
+	}
+
+	void
+	on_idle_read(beast::error_code ec, std::size_t bytes_transferred)
+	{
+		idle_ = false;
+
+		// This means they closed the connection
+		if(ec == net::error::eof)
+			return derived().do_eof();
+
+		// We were idle when a shutdown started
+		if(ec == net::error::operation_aborted && connections().draining())
+			return derived().do_eof();
+
+		if(ec)
+		{
+			timeouts::note(ec, idle_stage());
+			return logging::fail(ec, "read");
+		}
+
+		buffer_.commit(net::buffer_copy(buffer_.prepare(1), net::buffer(&first_byte_, bytes_transferred)));
+
+		// Time spent waiting for this request isn't part of it
+		if(!trace_)
+			trace_ = trace::start();
+		mark(trace::phase::arrived);
+
+		do_read_header();
+	}
+
+	void
+	do_read_header()
 	{
 		// Construct a new parser for each message
-		parser_.emplace();
+		header_parser_.emplace();
+
+		// The first request's trace was started when the connection was accepted, and
+		// a kept-alive one's when it arrived. A pipelined one's already here.
+		if(!trace_)
+		{
+			trace_ = trace::start();
+			mark(trace::phase::arrived);
+		}
 
 		// Apply a reasonable limit to the allowed size
 		// of the body in bytes to prevent abuse.
-		parser_->body_limit(10000);
+		// Which limit applies depends on the header, so for now it's the larger one.
+		header_parser_->body_limit(std::max<std::uint64_t>(body_limit, config().bulk_max_body));
 
 		// Set the timeout.
-		beast::get_lowest_layer(
-			derived().stream()).expires_after(std::chrono::seconds(30));
+		beast::get_lowest_layer(derived().stream()).expires_after(
+			timeouts::deadline(config(), timeouts::stage::header));
+
+		// Read the header using the parser-oriented interface
+		http::async_read_header(
+			derived().stream(),
+			buffer_,
+			*header_parser_,
+			beast::bind_front_handler(
+				&http_session::on_read_header,
+				derived().shared_from_this()));
+	}
+
+	void
+	on_read_header(beast::error_code ec, std::size_t bytes_transferred)
+	{
+		boost::ignore_unused(bytes_transferred);
+
+		// This means they closed the connection
+		if(ec == http::error::end_of_stream)
+			return derived().do_eof();
+
+		// Its Content-Length was over even the larger limit
+		if(ec == http::error::body_limit)
+			return queue_(request::payload_too_large(header_parser_->get()));
+
+		if(ec)
+		{
+			timeouts::note(ec, timeouts::stage::header);
+			return logging::fail(ec, "read");
+		}
+
+		if(trace_)
+		{
+			auto& header = header_parser_->get();
+			trace_->mark(trace::phase::header_read);
+			trace_->method = header.method_string();
+			trace_->target = header.target().substr(0, 256);
+		}
+
+		if(logging::access_log_enabled())
+		{
+			auto& header = header_parser_->get();
+			access_.emplace();
+			access_->start = std::chrono::steady_clock::now();
+			access_->record.client = client_;
+			access_->record.method = header.method_string();
+			access_->record.target = header.target().substr(0, 1024);
+		}
+
+		body_deadline_ = std::chrono::steady_clock::now() +
+			timeouts::deadline(config(), timeouts::stage::body);
+
+		// Only bulk and resolve requests may have large bodies. A Content-Length has already been
+		// checked against the larger limit, and chunked bodies are checked as they're read.
+		// This carries over to whichever parser reads the body.
+		auto list = request::streamable_bulk(header_parser_->get(), config());
+		std::uint64_t const limit = list ? config().bulk_max_body : std::uint32_t{body_limit};
+		if(auto length = header_parser_->content_length(); length && *length > limit)
+			return queue_(request::payload_too_large(header_parser_->get()));
+		header_parser_->body_limit(limit);
+
+		if(auto boundary = request::streamable_post_boundary(header_parser_->get()))
+		{
+			// Pull the URL out of the body as it arrives.
+			// The extractor copies the boundary, so set it up before the header moves.
+			extractor_.emplace(*boundary, "url");
+			stream_parser_.emplace(std::move(*header_parser_));
+			if(!chunk_)
+				chunk_ = std::make_unique<char[]>(chunk_size);
+
+			return do_read_body_chunk();
+		}
+
+		if(list)
+		{
+			// Split the URLs or tokens out as they arrive, so the body is never held whole
+			bulk_ = std::move(list);
+			stream_parser_.emplace(std::move(*header_parser_));
+			if(!chunk_)
+				chunk_ = std::make_unique<char[]>(chunk_size);
+
+			return do_read_body_chunk();
+		}
+
+		// Read the rest of the message into a string
+		parser_.emplace(std::move(*header_parser_));
+
+		beast::get_lowest_layer(derived().stream()).expires_at(body_deadline_);
 
-		// Read a request using the parser-oriented interface
 		http::async_read(
 			derived().stream(),
 			buffer_,
@@ -202,15 +618,92 @@ public:
 	{
 		boost::ignore_unused(bytes_transferred);
 
-		// This means they closed the connection
-		if(ec == http::error::end_of_stream)
-			return derived().do_eof();
+		// A chunked body that went over the limit
+		if(ec == http::error::body_limit)
+			return queue_(request::payload_too_large(parser_->get()));
+
+		if(ec)
+		{
+			timeouts::note(ec, timeouts::stage::body);
+			return logging::fail(ec, "read");
+		}
+
+		// Send the response
+		if(trace_)
+			trace_->mark(trace::phase::body_read);
+		{
+			trace::scope ts{trace_.get()};
+			ratelimit::scope rs{&admission_};
+			request::handle_request(*state_, parser_->release(), queue_);
+		}
+		served_ = true;
+
+		// If we aren't at the queue limit, try to pipeline another request
+		if(!queue_.is_full())
+			do_read();
+	}
+
+	void
+	do_read_body_chunk()
+	{
+		auto& body = stream_parser_->get().body();
+		body.data = chunk_.get();
+		body.size = chunk_size;
+
+		beast::get_lowest_layer(derived().stream()).expires_at(body_deadline_);
+
+		http::async_read(
+			derived().stream(),
+			buffer_,
+			*stream_parser_,
+			beast::bind_front_handler(
+				&http_session::on_read_body_chunk,
+				derived().shared_from_this()));
+	}
+
+	void
+	on_read_body_chunk(beast::error_code ec, std::size_t bytes_transferred)
+	{
+		boost::ignore_unused(bytes_transferred);
+
+		// This just means the chunk buffer is full
+		if(ec == http::error::need_buffer)
+			ec = {};
+
+		if(ec == http::error::body_limit)
+			return queue_(request::payload_too_large(stream_parser_->get()));
 
 		if(ec)
+		{
+			timeouts::note(ec, timeouts::stage::body);
 			return logging::fail(ec, "read");
+		}
+
+		// Once the field's been found the rest of the body is only read, not parsed
+		auto& body = stream_parser_->get().body();
+		std::string_view data{chunk_.get(), chunk_size - body.size};
+		if(bulk_)
+			bulk_->ingest(data);
+		else if(!extractor_->done())
+			extractor_->ingest(data);
+
+		if(!stream_parser_->is_done())
+			return do_read_body_chunk();
 
 		// Send the response
-		request::handle_request(state_, parser_->release(), queue_);
+		if(trace_)
+			trace_->mark(trace::phase::body_read);
+		{
+			trace::scope ts{trace_.get()};
+			ratelimit::scope rs{&admission_};
+			if(bulk_)
+				request::handle_streamed_bulk(*state_, stream_parser_->release(), *bulk_, queue_);
+			else
+				request::handle_streamed_post(*state_, stream_parser_->release(), *extractor_, queue_);
+		}
+		served_ = true;
+		extractor_.reset();
+		bulk_.reset();
 
 		// If we aren't at the queue limit, try to pipeline another request
 		if(!queue_.is_full())
@@ -223,7 +716,12 @@ public:
 		boost::ignore_unused(bytes_transferred);
 
 		if(ec)
+		{
+			timeouts::note(ec, timeouts::stage::write);
 			return logging::fail(ec, "write");
+		}
+
+		queue_.finish_request();
 
 		if(close)
 		{
@@ -253,11 +751,15 @@ public:
 	// Create the session
 	plain_http_session(
 		beast::tcp_stream&& stream,
-		beast::flat_buffer&& buffer,
-		const server_state::ServerState& state)
+		buffer_pool::flat_buffer&& buffer,
+		std::shared_ptr<const server_state::ServerState> state,
+		ratelimit::admission admission,
+		std::unique_ptr<trace::request_trace> trace)
 		: http_session<plain_http_session>(
 			std::move(buffer),
-			state)
+			std::move(state),
+			std::move(admission),
+			std::move(trace))
 		, stream_(std::move(stream))
 	{
 	}
@@ -265,6 +767,8 @@ public:
 	beast::tcp_stream& stream();
 	beast::tcp_stream release_stream();
 	void do_eof();
+private:
+	void on_run();
 };
 
 //------------------------------------------------------------------------------
@@ -275,17 +779,22 @@ class ssl_http_session
 	, public std::enable_shared_from_this<ssl_http_session>
 {
 	beast::ssl_stream<beast::tcp_stream> stream_;
+	std::chrono::steady_clock::time_point handshake_start_;
 
 public:
 	// Create the http_session
 	ssl_http_session(
 		beast::tcp_stream&& stream,
 		ssl::context& ctx,
-		beast::flat_buffer&& buffer,
-		const server_state::ServerState& state)
+		buffer_pool::flat_buffer&& buffer,
+		std::shared_ptr<const server_state::ServerState> state,
+		ratelimit::admission admission,
+		std::unique_ptr<trace::request_trace> trace)
 		: http_session<ssl_http_session>(
 			std::move(buffer),
-			state)
+			std::move(state),
+			std::move(admission),
+			std::move(trace))
 		, stream_(std::move(stream), ctx)
 	{
 	}
@@ -295,6 +804,7 @@ public:
 	beast::ssl_stream<beast::tcp_stream> release_stream();
 	void do_eof();
 private:
+	void on_run();
 	void on_handshake(beast::error_code, std::size_t);
 	void on_shutdown(beast::error_code);
 };
@@ -302,48 +812,120 @@ private:
 //------------------------------------------------------------------------------
 
 // Detects SSL handshakes
-class detect_session : public std::enable_shared_from_this<detect_session>
+class detect_session
+	: public connection_tracker::connection
+	, public std::enable_shared_from_this<detect_session>
 {
 	beast::tcp_stream stream_;
-	ssl::context& ctx_;
-	const server_state::ServerState& state_;
-	beast::flat_buffer buffer_;
+	beast::tcp_stream::executor_type executor_;	// Still ours once the stream's handed on
+	std::shared_ptr<const server_state::ServerState> state_;
+	buffer_pool::flat_buffer buffer_;
+	ratelimit::admission admission_;
+	std::unique_ptr<trace::request_trace> trace_;
+
+	// Tracked until the session we launch has tracked itself, so a drain waits for us
+	std::optional<connection_tracker::handle> tracked_;
+	bool detecting_ = false;
 public:
-	explicit
 	detect_session(
 		tcp::socket&& socket,
-		ssl::context& ctx,
-		const server_state::ServerState& state)
+		std::shared_ptr<const server_state::ServerState> state,
+		ratelimit::admission admission)
 		: stream_(std::move(socket))
-		, ctx_(ctx)
-		, state_(state)
+		, executor_(stream_.get_executor())
+		, state_(std::move(state))
+		, admission_(std::move(admission))
 	{
 	}
 
+	~detect_session();
+
 	void run();
 	void on_run();
 	void on_detect(beast::error_code, bool);
 
+	// Called by the connection tracker on shutdown
+	void drain() override;
 };
 
+// Answers a single metrics scrape
+class metrics_session : public std::enable_shared_from_this<metrics_session>
+{
+	beast::tcp_stream stream_;
+	beast::flat_buffer buffer_;
+	http::request<http::string_body> req_;
+	http::response<http::string_body> res_;
+
+public:
+	explicit
+	metrics_session(tcp::socket&& socket)
+		: stream_(std::move(socket))
+	{
+	}
+
+	void run();
+private:
+	void on_read(beast::error_code, std::size_t);
+	void on_write(beast::error_code, std::size_t);
+};
+
+// Accepts scrapes on the metrics port, which only listens on localhost
+class metrics_listener : public std::enable_shared_from_this<metrics_listener>
+{
+	net::io_context& ioc_;
+	tcp::acceptor acceptor_;
+
+public:
+	metrics_listener(net::io_context&, tcp::endpoint);
+	metrics_listener(net::io_context&, tcp::endpoint, tcp::acceptor::native_handle_type);
+
+	void run();
+	void stop();
+	tcp::acceptor::native_handle_type native_handle();
+private:
+	void do_accept();
+	void on_accept(beast::error_code, tcp::socket);
+};
+
+// Where a [[listen]] entry binds; the address was checked when the config was parsed
+tcp::endpoint listen_endpoint(const server_state::Listen&);
+
 // Accepts incoming connections and launches the sessions
 class listener : public std::enable_shared_from_this<listener>
 {
 	net::io_context& ioc_;
-	ssl::context& ctx_;
 	tcp::acceptor acceptor_;
-	const server_state::ServerState& state_;
+	const server_state::Listen options_;
+	const server_state::StateHolder& state_;
+
+	// Waits out running short of file descriptors before accepting again
+	net::steady_timer backoff_;
 
 public:
 	listener(
 		net::io_context&,
-		ssl::context&,
-		tcp::endpoint,
-		const server_state::ServerState&);
+		const server_state::Listen&,
+		const server_state::StateHolder&);
+
+	// Adopt a socket that's already listening, e.g. one inherited from the process we're replacing
+	listener(
+		net::io_context&,
+		const server_state::Listen&,
+		tcp::acceptor::native_handle_type,
+		const server_state::StateHolder&);
+
 	void run();
+
+	// Stop accepting; connections already accepted carry on
+	void stop();
+
+	tcp::acceptor::native_handle_type native_handle();
 private:
+	void set_buffer_sizes();
 	void do_accept();
 	void on_accept(beast::error_code, tcp::socket);
+	void on_backoff(beast::error_code);
+	void launch(tcp::socket&&, ratelimit::admission);
 };
 
 } // namespace session
@@ -0,0 +1,66 @@
+#ifndef SHARED_BODY_H
+#define SHARED_BODY_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <boost/optional.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+namespace shared_body
+{
+
+namespace beast = boost::beast;		// from <boost/beast.hpp>
+namespace http = beast::http;		// from <boost/beast/http.hpp>
+namespace net = boost::asio;		// from <boost/asio.hpp>
+
+// A response body which shares an immutable string with a cache.
+// This lets cached responses be sent without copying them per request.
+struct shared_string_body
+{
+	using value_type = std::shared_ptr<const std::string>;
+
+	static std::uint64_t
+	size(const value_type& body)
+	{
+		return body ? body->size() : 0;
+	}
+
+	class writer
+	{
+		const value_type& body_;
+
+	public:
+		using const_buffers_type = net::const_buffer;
+
+		template<bool isRequest, class Fields>
+		explicit
+		writer(const http::header<isRequest, Fields>&, const value_type& body)
+			: body_(body)
+		{
+		}
+
+		void
+		init(beast::error_code& ec)
+		{
+			ec = {};
+		}
+
+		boost::optional<std::pair<const_buffers_type, bool>>
+		get(beast::error_code& ec)
+		{
+			ec = {};
+			if(!body_ || body_->empty())
+				return boost::none;
+
+			return {{const_buffers_type{body_->data(), body_->size()}, false}};
+		}
+	};
+};
+
+} // namespace shared_body
+
+#endif // SHARED_BODY_H
@@ -0,0 +1,107 @@
+#ifndef STATIC_CACHE_H
+#define STATIC_CACHE_H
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "compress.hpp"
+#include "mime.hpp"
+
+namespace static_cache
+{
+
+// The encoded representations of a resource we keep in memory
+struct Variants
+{
+	std::shared_ptr<const std::string> identity;
+	std::shared_ptr<const std::string> gzip;
+	std::shared_ptr<const std::string> brotli;
+
+	std::shared_ptr<const std::string> get(compression::encoding) const;
+};
+
+// What we know about a file in the docroot
+struct FileEntry
+{
+	std::int64_t mtime;	// In nanoseconds, so a rewrite within the same second is noticed
+	std::uint64_t size;
+
+	// Looked up once, when the entry is built
+	std::string mime_type;
+
+	// Prebuilt .gz/.br siblings in the docroot take precedence over our own
+	bool gzip_sibling;
+	bool brotli_sibling;
+
+	// Compressed copies made by us when there's no sibling
+	Variants variants;
+
+	bool has(compression::encoding) const;
+	bool is_sibling(compression::encoding) const;
+
+	// Returns true if the response varies by Accept-Encoding
+	bool is_negotiable() const;
+};
+
+// Caches compressed variants of static files and rendered static pages,
+// so nothing is ever compressed more than once.
+class StaticCache
+{
+public:
+	// Files bigger than this are only served compressed if a sibling exists
+	static constexpr std::uint64_t max_compress_size = 1024 * 1024;
+
+	// Look up the entry for an opened file, (re)building it if it changed on disk
+	std::shared_ptr<const FileEntry> get_file(const std::string& path, int fd, const mime_type::MimeTypeMap&);
+
+	// Look up a rendered page, calling render() to produce it the first time.
+	// Any exception thrown by render() is propagated and nothing is cached.
+	template<class Render>
+	std::shared_ptr<const Variants>
+	get_page(const std::string& path, Render&& render)
+	{
+		{
+			std::shared_lock lock{lock_};
+			auto it = pages_.find(path);
+			if(it != pages_.end())
+				return it->second;
+		}
+
+		auto page = make_page(std::forward<Render>(render)());
+
+		std::unique_lock lock{lock_};
+		return pages_.try_emplace(path, std::move(page)).first->second;
+	}
+
+	// Drop everything, e.g. on reload
+	void clear();
+
+private:
+	static std::shared_ptr<const Variants> make_page(std::string&&);
+	static std::shared_ptr<const FileEntry> make_file(const std::string& path, int fd,
+		std::int64_t mtime, std::uint64_t size, const mime_type::MimeTypeMap&);
+
+	// An entry being built, which other requests for the same version of the file wait for
+	struct Building
+	{
+		std::int64_t mtime;
+		std::uint64_t size;
+		std::shared_future<std::shared_ptr<const FileEntry>> entry;
+	};
+
+	std::shared_mutex lock_;
+	std::unordered_map<std::string, std::shared_ptr<const FileEntry>> files_;
+	std::unordered_map<std::string, Building> building_;
+	std::unordered_map<std::string, std::shared_ptr<const Variants>> pages_;
+};
+
+} // namespace static_cache
+
+#endif // STATIC_CACHE_H
@@ -0,0 +1,38 @@
+#ifndef TIMEOUTS_H
+#define TIMEOUTS_H
+
+#include <chrono>
+#include <cstddef>
+
+#include <boost/system/error_code.hpp>
+
+#include "server_state.hpp"
+
+// Deadlines for each stage of a connection.
+//
+// Each stage has its own timeout, so a client can't hold a session open by trickling
+// bytes at whichever stage is most generous. When the open connections near the
+// connection limit, idle and handshake deadlines shrink, so the connections that cost
+// us memory without doing anything are the first to go.
+namespace timeouts
+{
+
+enum class stage : std::size_t
+{
+	handshake,	// SSL detection, the TLS handshake and TLS shutdown
+	header,		// Reading a request header
+	body,		// Reading a request body, all of it
+	idle,		// Waiting for the next request on a kept-alive connection
+	write,		// Writing a response
+	count_
+};
+
+// How long a stage may take now
+std::chrono::steady_clock::duration deadline(const server_state::Config&, stage);
+
+// Count it if an operation failed because its stage ran out of time
+void note(const boost::system::error_code&, stage);
+
+} // namespace timeouts
+
+#endif // TIMEOUTS_H
@@ -0,0 +1,31 @@
+#ifndef TOKEN_FILTER_H
+#define TOKEN_FILTER_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Turning away lookups for tokens we don't have, without asking the database.
+//
+// Scanners ask for things like /wp-login.php and /.env, which would otherwise each
+// cost a SQLite query. A request is only looked up if its token has the shape of
+// one we make, and a Bloom filter over every stored token says it might be there.
+// The filter never forgets a token: ours are added as they're stored, and anything
+// another process stores is caught up on before a token is turned away.
+namespace token_filter
+{
+
+// Size the filter for this many tokens and load every token in the database into it.
+// Call once, before any connections are accepted. 0 tokens turns it all off.
+// Returns false if the database couldn't be read, and the filter stays off.
+bool init(const std::string& db_path, std::size_t tokens, unsigned bits_per_token);
+
+// Add a token we've just stored
+void add(std::string_view token);
+
+// Whether a token might be in the database; false means it certainly isn't
+bool may_contain(const std::string& db_path, std::string_view token);
+
+} // namespace token_filter
+
+#endif // TOKEN_FILTER_H
@@ -0,0 +1,102 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Optional per-request phase tracing.
+//
+// When a slow request threshold is configured, each request records when it passed
+// through each phase. Requests over the threshold are logged with a breakdown, and kept
+// in a ring buffer that can be fetched as a Chrome trace (chrome://tracing, Perfetto).
+// When it's off, the cost is a relaxed load and a branch per phase.
+namespace trace
+{
+
+enum class phase : std::size_t
+{
+	accepted,	// Connection-level phases are only recorded for the first request
+	detected,
+	handshaken,
+	arrived,	// The first byte of the request, when it was waited for on its own
+	header_read,
+	body_read,
+	routed,
+	sqlite_begin,
+	sqlite_end,
+	render_begin,
+	render_end,
+	queued,
+	written,
+	count_
+};
+
+struct request_trace
+{
+	// Nanoseconds on the steady clock; 0 if the phase never happened
+	std::array<std::uint64_t, static_cast<std::size_t>(phase::count_)> at{};
+	std::string method;
+	std::string target;
+
+	void
+	mark(phase p)
+	{
+		at[static_cast<std::size_t>(p)] = static_cast<std::uint64_t>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	std::uint64_t
+	get(phase p) const
+	{
+		return at[static_cast<std::size_t>(p)];
+	}
+};
+
+// Set the slow request threshold; 0 turns tracing off
+void configure(std::uint32_t slow_ms);
+
+bool enabled();
+
+// Start a trace, or return nullptr if tracing is off
+std::unique_ptr<request_trace> start();
+
+// The trace for the request being handled on this thread, if any
+request_trace* current();
+
+// Mark a phase of the current request
+inline void
+mark(phase p)
+{
+	if(auto t = current())
+		t->mark(p);
+}
+
+// Makes a trace current for the duration of a handler call
+class scope
+{
+public:
+	explicit scope(request_trace*);
+	~scope();
+
+	scope(const scope&) = delete;
+	scope& operator=(const scope&) = delete;
+
+private:
+	request_trace* prev_;
+};
+
+// Called when the response has been written; logs and keeps the trace if it was slow
+void finish(std::unique_ptr<request_trace>);
+
+// The slow requests kept, as Chrome trace-event JSON
+std::string chrome_json();
+
+} // namespace trace
+
+#endif // TRACE_H
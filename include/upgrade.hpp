@@ -0,0 +1,44 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <sys/types.h>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+
+// Hands the listening sockets over to a newly started binary, so it can be upgraded without refusing connections.
+//
+// On SIGUSR2 the running process starts a new copy of its executable with the listening sockets
+// inherited, listed in SHADYURL_LISTEN_FDS. The new process adopts them, and once it's serving it
+// sends SIGQUIT to the old one, which stops accepting and exits when its connections finish.
+namespace upgrade
+{
+
+// Call first thing in main, before anything changes directory
+void init(char* argv[]);
+
+// Returns true if we were started by a running instance handing over its sockets
+bool is_upgrade();
+
+// Take the inherited listening socket bound to the endpoint; returns -1 if there isn't one
+int take_listener(const boost::asio::ip::tcp::endpoint&);
+
+// Close any inherited sockets that weren't taken, e.g. for a port that's been removed
+void close_unused();
+
+// Tell the process we're replacing that we're serving now
+void notify_ready();
+
+// Start a new copy of the binary, handing it the given listening sockets.
+// Returns false if it couldn't be started.
+bool spawn(const std::vector<int>& fds);
+
+// Note that a child has exited, as reaped on SIGCHLD
+void child_exited(pid_t);
+
+// The new binary we started, if it's still running; 0 if there isn't one
+pid_t successor();
+
+} // namespace upgrade
+
+#endif // UPGRADE_H
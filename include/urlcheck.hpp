@@ -0,0 +1,43 @@
+#ifndef URLCHECK_H
+#define URLCHECK_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace urlcheck
+{
+
+enum class url_error
+{
+	none,
+	control_character,
+	bad_scheme,
+	userinfo,
+	bad_host,
+	bad_port,
+};
+
+// Percent-decode a form value into out and validate it as a URL, in one pass over the input.
+// Control characters, raw or escaped, are rejected while decoding.
+url_error decode_url(std::string_view encoded, std::string& out);
+
+// Validate a URL we already have in the clear, e.g. from a multipart field
+url_error check_url(std::string& url);
+
+// A human-readable reason for an error
+std::string_view describe(url_error);
+
+// The scanning kernel picked for this CPU at startup
+std::string_view kernel_name();
+
+// The kernels this CPU can run, best first
+std::vector<std::string_view> kernels();
+
+// Switch to another kernel, for benchmarks and tests; false if this CPU can't run it.
+// Not thread-safe, so only call it before anything else is checking URLs.
+bool use_kernel(std::string_view name);
+
+} // namespace urlcheck
+
+#endif // URLCHECK_H
@@ -0,0 +1,60 @@
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "buffer_pool.hpp"
+
+namespace buffer_pool
+{
+
+// Most spare blocks each thread keeps
+constexpr std::size_t max_spare = 64;
+
+// Set once this thread's list is gone, for blocks released during thread exit
+static thread_local bool gone = false;
+
+struct free_list
+{
+	std::vector<void*> blocks;
+
+	free_list()
+	{
+		blocks.reserve(max_spare);
+	}
+
+	~free_list()
+	{
+		gone = true;
+		for(auto p : blocks)
+			::operator delete(p);
+	}
+};
+
+static thread_local free_list spare;
+
+void*
+acquire()
+{
+	if(gone || spare.blocks.empty())
+		return ::operator new(block_size);
+
+	auto p = spare.blocks.back();
+	spare.blocks.pop_back();
+	return p;
+}
+
+void
+release(void* p) noexcept
+{
+	if(!p)
+		return;
+
+	// Blocks can come back on a different thread than they left; that's fine, it just
+	// moves them to this thread's list
+	if(!gone && spare.blocks.size() < max_spare)
+		spare.blocks.push_back(p);
+	else
+		::operator delete(p);
+}
+
+} // namespace buffer_pool
@@ -0,0 +1,590 @@
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include <nlohmann/json.hpp>
+
+#include "bulk.hpp"
+#include "generate.hpp"
+#include "sqlite_helper.hpp"
+#include "token_filter.hpp"
+#include "urlcheck.hpp"
+
+namespace bulk
+{
+
+// Longer lines than this aren't URLs anyone should be shortening
+constexpr std::size_t max_line = 65536;
+
+// A new token is tried this many times if one is already taken
+constexpr int token_attempts = 3;
+
+// Fewer tokens than this are looked up one by one; more are joined against urls,
+// which costs a temporary table but visits the index in order
+constexpr std::size_t join_threshold = 64;
+
+// How long a bulk store waits for the write lock, in milliseconds
+constexpr int store_busy_timeout = 5000;
+
+static std::string_view
+trim(std::string_view s)
+{
+	while(!s.empty() && std::isspace(static_cast<unsigned char>(s.front())))
+		s.remove_prefix(1);
+	while(!s.empty() && std::isspace(static_cast<unsigned char>(s.back())))
+		s.remove_suffix(1);
+	return s;
+}
+
+static bool
+iequals(std::string_view a, std::string_view b)
+{
+	return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y)
+	{
+		return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+	});
+}
+
+std::optional<format>
+format_of(std::string_view content_type)
+{
+	// Parameters like charset don't matter; it's all URLs
+	auto const type = trim(content_type.substr(0, content_type.find(';')));
+
+	if(iequals(type, "text/plain"))
+		return format::lines;
+	if(iequals(type, "application/x-ndjson") || iequals(type, "application/jsonl"))
+		return format::ndjson;
+	if(iequals(type, "application/json"))
+		return format::json;
+
+	return std::nullopt;
+}
+
+std::optional<list>
+list_of(std::string_view target)
+{
+	if(target == bulk::target)
+		return list::urls;
+	if(target == resolve_target)
+		return list::tokens;
+
+	return std::nullopt;
+}
+
+// The URL or token in a JSON value, which is either the thing itself or an object with one
+static std::optional<std::string>
+value_of(const nlohmann::json& value, list kind)
+{
+	if(value.is_string())
+		return value.get<std::string>();
+
+	if(value.is_object())
+	{
+		auto it = value.find(kind == list::urls ? "url" : "token");
+		if(it != value.end() && it->is_string())
+			return it->get<std::string>();
+	}
+
+	return std::nullopt;
+}
+
+collector::collector(list l, format f, std::size_t max_items)
+	: list_(l)
+	, format_(f)
+	, max_items_(max_items)
+{
+}
+
+bool
+collector::fail(std::string_view why)
+{
+	error_ = why;
+	pending_.clear();
+	pending_.shrink_to_fit();
+	return false;
+}
+
+bool
+collector::add(std::string value)
+{
+	if(items_.size() >= max_items_)
+		return fail(list_ == list::urls ? "Too many URLs" : "Too many tokens");
+
+	auto& it = items_.emplace_back();
+	if(list_ == list::tokens)
+	{
+		// Anything can be looked up; what we don't have just isn't found
+		it.token = std::move(value);
+		return true;
+	}
+
+	it.url = std::move(value);
+
+	auto const error = urlcheck::check_url(it.url);
+	if(error != urlcheck::url_error::none)
+		it.error = urlcheck::describe(error);
+
+	return true;
+}
+
+bool
+collector::add_invalid(std::string value)
+{
+	// Keep its place in the results, so they still line up with what was sent
+	if(!add(std::move(value)))
+		return false;
+
+	items_.back().error = list_ == list::urls ?
+		"Not a JSON string or {\"url\": ...} object" :
+		"Not a JSON string or {\"token\": ...} object";
+	return true;
+}
+
+bool
+collector::add_line(std::string_view line)
+{
+	line = trim(line);
+	if(line.empty())
+		return true;
+
+	if(format_ == format::lines)
+		return add(std::string{line});
+
+	auto json = nlohmann::json::parse(line, nullptr, false);
+	auto value = json.is_discarded() ? std::nullopt : value_of(json, list_);
+	if(!value)
+		return add_invalid(std::string{line});
+
+	return add(std::move(*value));
+}
+
+bool
+collector::ingest(std::string_view data)
+{
+	if(!error_.empty())
+		return false;
+
+	// JSON arrays can only be parsed whole
+	if(format_ == format::json)
+	{
+		pending_.append(data);
+		return true;
+	}
+
+	while(!data.empty())
+	{
+		auto const nl = data.find('\n');
+		if(nl == std::string_view::npos)
+		{
+			if(pending_.size() + data.size() > max_line)
+				return fail("Line too long");
+
+			pending_.append(data);
+			return true;
+		}
+
+		// Only a line split across chunks is copied
+		bool ok;
+		if(pending_.empty())
+		{
+			ok = add_line(data.substr(0, nl));
+		}
+		else
+		{
+			pending_.append(data.substr(0, nl));
+			ok = add_line(pending_);
+			pending_.clear();
+		}
+
+		if(!ok)
+			return false;
+
+		data.remove_prefix(nl + 1);
+	}
+
+	return true;
+}
+
+bool
+collector::finish()
+{
+	if(!error_.empty())
+		return false;
+
+	if(format_ == format::json)
+	{
+		auto value = nlohmann::json::parse(pending_, nullptr, false);
+		pending_.clear();
+		pending_.shrink_to_fit();
+
+		if(value.is_discarded() || !value.is_array())
+			return fail("Body isn't a JSON array");
+
+		for(auto& element : value)
+		{
+			auto v = value_of(element, list_);
+			if(!(v ? add(std::move(*v)) : add_invalid(element.dump())))
+				return false;
+		}
+	}
+	else if(!pending_.empty())
+	{
+		if(!add_line(pending_))
+			return false;
+		pending_.clear();
+	}
+
+	if(items_.empty())
+		return fail(list_ == list::urls ? "No URLs given" : "No tokens given");
+
+	return true;
+}
+
+std::vector<item>&
+collector::items()
+{
+	return items_;
+}
+
+std::string_view
+collector::error() const
+{
+	return error_;
+}
+
+list
+collector::kind() const
+{
+	return list_;
+}
+
+bool
+store(const std::string& db_path, std::vector<item>& items, std::string& error)
+{
+	auto db = sqlite_helper::make_sqlite3_handle(db_path.c_str());
+	if(!db)
+	{
+		error = "Could not open the database";
+		return false;
+	}
+
+	// Something else may be writing, another bulk store even; wait our turn for a while.
+	// A store that still can't get the lock fails with SQLITE_BUSY, rather than holding the thread up.
+	sqlite3_busy_timeout(db.get(), store_busy_timeout);
+
+	auto exec = [&](const char* sql)
+	{
+		if(sqlite3_exec(db.get(), sql, nullptr, nullptr, nullptr) == SQLITE_OK)
+			return true;
+
+		error = sqlite3_errmsg(db.get());
+		return false;
+	};
+
+	sqlite3_stmt* insert = nullptr;
+	sqlite3_stmt* lookup = nullptr;
+	sqlite_helper::scope_exit cleanup{[&]
+	{
+		sqlite3_finalize(insert);
+		sqlite3_finalize(lookup);
+	}};
+
+	// Both UNIQUE constraints are handled below, so a clash doesn't abort everything
+	if(sqlite3_prepare_v2(db.get(), "INSERT OR IGNORE INTO urls (token, url) VALUES (?, ?);",
+			-1, &insert, nullptr) != SQLITE_OK ||
+		sqlite3_prepare_v2(db.get(), "SELECT token FROM urls WHERE url = ?;",
+			-1, &lookup, nullptr) != SQLITE_OK)
+	{
+		error = sqlite3_errmsg(db.get());
+		return false;
+	}
+
+	auto const valid = static_cast<std::size_t>(std::count_if(items.begin(), items.end(),
+		[](const item& it) { return it.error.empty(); }));
+	auto tokens = generate::generate_random_filenames(valid);
+
+	// One transaction means one journal sync, not one per URL.
+	// IMMEDIATE takes the write lock up front, so we can't lose a race to upgrade it.
+	if(!exec("BEGIN IMMEDIATE;"))
+		return false;
+
+	auto rollback = [&]
+	{
+		error = sqlite3_errmsg(db.get());
+		sqlite3_exec(db.get(), "ROLLBACK;", nullptr, nullptr, nullptr);
+		return false;
+	};
+
+	std::size_t next = 0;
+	for(auto& it : items)
+	{
+		if(!it.error.empty())
+			continue;
+
+		std::string token = std::move(tokens[next++]);
+		for(int attempt = 0; attempt < token_attempts && it.token.empty(); attempt++)
+		{
+			sqlite3_bind_text(insert, 1, token.data(), static_cast<int>(token.size()), SQLITE_STATIC);
+			sqlite3_bind_text(insert, 2, it.url.data(), static_cast<int>(it.url.size()), SQLITE_STATIC);
+			if(sqlite3_step(insert) != SQLITE_DONE)
+				return rollback();
+			sqlite3_reset(insert);
+
+			if(sqlite3_changes(db.get()) == 1)
+			{
+				it.token = std::move(token);
+				break;
+			}
+
+			// Either we have this URL already, maybe from earlier in this batch, or the token's taken
+			sqlite3_bind_text(lookup, 1, it.url.data(), static_cast<int>(it.url.size()), SQLITE_STATIC);
+			int rc = sqlite3_step(lookup);
+			if(rc == SQLITE_ROW)
+				it.token = reinterpret_cast<const char*>(sqlite3_column_text(lookup, 0));
+			else if(rc != SQLITE_DONE)
+				return rollback();
+			sqlite3_reset(lookup);
+
+			if(it.token.empty())
+				token = generate::generate_random_filename();
+		}
+
+		if(it.token.empty())
+			it.error = "Could not make a unique token";
+	}
+
+	if(!exec("COMMIT;"))
+	{
+		sqlite3_exec(db.get(), "ROLLBACK;", nullptr, nullptr, nullptr);
+		return false;
+	}
+
+	for(auto& it : items)
+	{
+		if(!it.token.empty())
+			token_filter::add(it.token);
+	}
+
+	return true;
+}
+
+// Look up each token with the one statement
+static bool
+resolve_each(sqlite3* db, std::vector<item>& items)
+{
+	sqlite3_stmt* select = nullptr;
+	sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(select); }};
+
+	if(sqlite3_prepare_v2(db, "SELECT url FROM urls WHERE token = ?;", -1, &select, nullptr) != SQLITE_OK)
+		return false;
+
+	for(auto& it : items)
+	{
+		if(!it.error.empty())
+			continue;
+
+		sqlite3_bind_text(select, 1, it.token.data(), static_cast<int>(it.token.size()), SQLITE_STATIC);
+		int rc = sqlite3_step(select);
+		if(rc == SQLITE_ROW)
+			it.url = reinterpret_cast<const char*>(sqlite3_column_text(select, 0));
+		else if(rc != SQLITE_DONE)
+			return false;
+		sqlite3_reset(select);
+	}
+
+	return true;
+}
+
+// Look up every token at once. The temporary table is keyed by token, so the join
+// walks the urls index in order instead of seeking all over it; on a cold page cache
+// that's the difference between reading each page once and reading it once per token.
+static bool
+resolve_joined(sqlite3* db, std::vector<item>& items)
+{
+	sqlite3_stmt* insert = nullptr;
+	sqlite3_stmt* select = nullptr;
+	sqlite_helper::scope_exit cleanup{[&]
+	{
+		sqlite3_finalize(insert);
+		sqlite3_finalize(select);
+	}};
+
+	// Each connection has its own temporary tables, and they go when it closes
+	if(sqlite3_exec(db, "CREATE TEMP TABLE lookup (token TEXT NOT NULL, pos INTEGER NOT NULL, "
+			"PRIMARY KEY (token, pos)) WITHOUT ROWID;", nullptr, nullptr, nullptr) != SQLITE_OK)
+		return false;
+
+	if(sqlite3_prepare_v2(db, "INSERT INTO temp.lookup (token, pos) VALUES (?, ?);",
+			-1, &insert, nullptr) != SQLITE_OK ||
+		// CROSS JOIN keeps lookup as the outer loop, whatever the planner guesses
+		sqlite3_prepare_v2(db, "SELECT l.pos, u.url FROM temp.lookup AS l "
+			"CROSS JOIN urls AS u ON u.token = l.token;", -1, &select, nullptr) != SQLITE_OK)
+		return false;
+
+	for(std::size_t i = 0; i < items.size(); i++)
+	{
+		auto& it = items[i];
+		if(!it.error.empty())
+			continue;
+
+		sqlite3_bind_text(insert, 1, it.token.data(), static_cast<int>(it.token.size()), SQLITE_STATIC);
+		sqlite3_bind_int64(insert, 2, static_cast<sqlite3_int64>(i));
+		if(sqlite3_step(insert) != SQLITE_DONE)
+			return false;
+		sqlite3_reset(insert);
+	}
+
+	int rc;
+	while((rc = sqlite3_step(select)) == SQLITE_ROW)
+	{
+		auto const pos = static_cast<std::size_t>(sqlite3_column_int64(select, 0));
+		items[pos].url = reinterpret_cast<const char*>(sqlite3_column_text(select, 1));
+	}
+
+	return rc == SQLITE_DONE;
+}
+
+bool
+resolve(const std::string& db_path, std::vector<item>& items, std::string& error)
+{
+	auto db = sqlite_helper::make_sqlite3_handle(db_path.c_str());
+	if(!db)
+	{
+		error = "Could not open the database";
+		return false;
+	}
+
+	sqlite3_busy_timeout(db.get(), 1000);
+
+	// Tokens we certainly don't have aren't looked up
+	for(auto& it : items)
+	{
+		if(it.error.empty() && !token_filter::may_contain(db_path, it.token))
+			it.error = "Not found";
+	}
+
+	auto const valid = static_cast<std::size_t>(std::count_if(items.begin(), items.end(),
+		[](const item& it) { return it.error.empty(); }));
+
+	// One read transaction, so every token is looked up in the same snapshot
+	if(sqlite3_exec(db.get(), "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK)
+	{
+		error = sqlite3_errmsg(db.get());
+		return false;
+	}
+
+	bool const ok = valid < join_threshold ? resolve_each(db.get(), items) : resolve_joined(db.get(), items);
+	if(!ok)
+	{
+		error = sqlite3_errmsg(db.get());
+		sqlite3_exec(db.get(), "ROLLBACK;", nullptr, nullptr, nullptr);
+		return false;
+	}
+
+	sqlite3_exec(db.get(), "COMMIT;", nullptr, nullptr, nullptr);
+
+	for(auto& it : items)
+	{
+		if(it.error.empty() && it.url.empty())
+			it.error = "Not found";
+	}
+
+	return true;
+}
+
+void
+append_json_string(std::string& out, std::string_view s)
+{
+	out.push_back('"');
+	for(char c : s)
+	{
+		switch(c)
+		{
+		case '"':
+			out.append("\\\"");
+			break;
+		case '\\':
+			out.append("\\\\");
+			break;
+		default:
+			if(static_cast<unsigned char>(c) < 0x20)
+			{
+				char buf[8];
+				std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+				out.append(buf);
+			}
+			else
+			{
+				out.push_back(c);
+			}
+		}
+	}
+	out.push_back('"');
+}
+
+std::string
+render(const std::vector<item>& items, std::string_view hostname)
+{
+	std::string out;
+	out.reserve(items.size() * 160);
+
+	for(auto& it : items)
+	{
+		out.append("{\"url\":");
+		append_json_string(out, it.url);
+		if(it.token.empty())
+		{
+			out.append(",\"error\":");
+			append_json_string(out, it.error);
+		}
+		else
+		{
+			out.append(",\"token\":");
+			append_json_string(out, it.token);
+
+			// Matches the link on post.html
+			out.append(",\"short\":\"http://");
+			out.append(hostname).append("/").append(it.token).append("\"");
+		}
+		out.append("}\n");
+	}
+
+	return out;
+}
+
+std::string
+render_resolved(const std::vector<item>& items)
+{
+	std::string out;
+	out.reserve(items.size() * 120);
+
+	for(auto& it : items)
+	{
+		out.append("{\"token\":");
+		append_json_string(out, it.token);
+		if(it.url.empty())
+		{
+			out.append(",\"error\":");
+			append_json_string(out, it.error);
+		}
+		else
+		{
+			out.append(",\"url\":");
+			append_json_string(out, it.url);
+		}
+		out.append("}\n");
+	}
+
+	return out;
+}
+
+} // namespace bulk
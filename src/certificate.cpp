@@ -7,7 +7,11 @@
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/ssl/context.hpp>
 
+#include <openssl/ssl.h>
+
 #include "certificate.hpp"
+#include "h2_session.hpp"
+#include "log.hpp"
 #include "server_state.hpp"
 
 namespace certificate
@@ -17,7 +21,7 @@ namespace certificate
  * the context for use with a server.
  */
 bool
-load_server_certificate(const server_state::ServerState& state, boost::asio::ssl::context& ctx)
+load_server_certificate(const server_state::Config& config, boost::asio::ssl::context& ctx)
 {
 	using namespace boost::asio;
 
@@ -26,36 +30,45 @@ load_server_certificate(const server_state::ServerState& state, boost::asio::ssl
 		ssl::context::no_sslv2 |
 		ssl::context::single_dh_use);
 
+	// Let OpenSSL free its record buffers while a connection has nothing in flight;
+	// they're most of what an idle TLS connection costs
+	SSL_CTX_set_mode(ctx.native_handle(), SSL_MODE_RELEASE_BUFFERS);
+
 	try
 	{
-		ctx.use_certificate_chain_file(state.get_config_cert_file().data());
+		ctx.use_certificate_chain_file(config.cert_file.c_str());
 	}
 	catch(std::exception& e)
 	{
-		syslog(LOG_ALERT, "Could not load certificate file: %s", e.what());
+		logging::log(LOG_ALERT, "Could not load certificate file: %s", e.what());
 		return false;
 	}
 
 	try
 	{
-		ctx.use_private_key_file(state.get_config_key_file().data(), ssl::context::file_format::pem);
+		ctx.use_private_key_file(config.key_file.c_str(), ssl::context::file_format::pem);
 	}
 	catch(std::exception& e)
 	{
-		syslog(LOG_ALERT, "Could not load private key file: %s", e.what());
+		logging::log(LOG_ALERT, "Could not load private key file: %s", e.what());
 		return false;
 	}
 
 	try
 	{
-		ctx.use_tmp_dh_file(state.get_config_dh_file().data());
+		ctx.use_tmp_dh_file(config.dh_file.c_str());
 	}
 	catch(std::exception& e)
 	{
-		syslog(LOG_ALERT, "Could not load DH parameter file: %s", e.what());
+		logging::log(LOG_ALERT, "Could not load DH parameter file: %s", e.what());
 		return false;
 	}
 
+#ifdef SHADYURL_HAVE_NGHTTP2
+	if(config.http2)
+		session::enable_h2_alpn(ctx);
+#endif // SHADYURL_HAVE_NGHTTP2
+
 	return true;
 }
 
@@ -0,0 +1,218 @@
+#include <zlib.h>
+
+#ifdef SHADYURL_HAVE_BROTLI
+#	include <brotli/encode.h>
+#endif
+
+#include <boost/algorithm/string.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "compress.hpp"
+
+namespace compression
+{
+
+static inline std::string_view
+trim(std::string_view str)
+{
+	while(!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+		str.remove_prefix(1);
+	while(!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+		str.remove_suffix(1);
+	return str;
+}
+
+// Parse a qvalue (RFC 9110 section 12.4.2) into thousandths
+static int
+parse_qvalue(std::string_view params)
+{
+	// Look for a q parameter amongst the coding's parameters
+	while(!params.empty())
+	{
+		auto const pos = params.find(';');
+		std::string_view param = trim(params.substr(0, pos));
+		params = (pos == std::string_view::npos) ? std::string_view{} : params.substr(pos + 1);
+
+		if(param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') || param[1] != '=')
+			continue;
+
+		std::string_view value = param.substr(2);
+		if(value.empty() || (value[0] != '0' && value[0] != '1'))
+			return 0;
+
+		int q = (value[0] - '0') * 1000;
+		if(value.size() > 1 && value[1] == '.')
+		{
+			int scale = 100;
+			for(std::size_t i = 2; i < value.size() && i < 5; i++, scale /= 10)
+			{
+				if(value[i] < '0' || value[i] > '9')
+					break;
+				q += (value[i] - '0') * scale;
+			}
+		}
+
+		return std::min(q, 1000);
+	}
+
+	return 1000;
+}
+
+encoding
+choose_encoding(std::string_view accept_encoding, bool have_gzip, bool have_brotli)
+{
+	// -1 means "not mentioned"
+	int q_gzip = -1;
+	int q_brotli = -1;
+	int q_any = -1;
+
+	while(!accept_encoding.empty())
+	{
+		auto const pos = accept_encoding.find(',');
+		std::string_view item = accept_encoding.substr(0, pos);
+		accept_encoding = (pos == std::string_view::npos) ? std::string_view{} : accept_encoding.substr(pos + 1);
+
+		auto const semi = item.find(';');
+		std::string_view coding = trim(item.substr(0, semi));
+		int q = (semi == std::string_view::npos) ? 1000 : parse_qvalue(item.substr(semi + 1));
+
+		if(boost::iequals(coding, "gzip") || boost::iequals(coding, "x-gzip"))
+			q_gzip = q;
+		else if(boost::iequals(coding, "br"))
+			q_brotli = q;
+		else if(coding == "*")
+			q_any = q;
+	}
+
+	if(q_gzip < 0)
+		q_gzip = std::max(q_any, 0);
+	if(q_brotli < 0)
+		q_brotli = std::max(q_any, 0);
+
+	if(!have_gzip)
+		q_gzip = 0;
+	if(!have_brotli)
+		q_brotli = 0;
+
+	// Brotli wins ties, it's almost always smaller
+	if(q_brotli > 0 && q_brotli >= q_gzip)
+		return encoding::brotli;
+	if(q_gzip > 0)
+		return encoding::gzip;
+
+	return encoding::identity;
+}
+
+std::string_view
+encoding_name(encoding enc)
+{
+	switch(enc)
+	{
+	case encoding::gzip:
+		return "gzip";
+	case encoding::brotli:
+		return "br";
+	default:
+		return "identity";
+	}
+}
+
+std::string_view
+encoding_suffix(encoding enc)
+{
+	switch(enc)
+	{
+	case encoding::gzip:
+		return ".gz";
+	case encoding::brotli:
+		return ".br";
+	default:
+		return "";
+	}
+}
+
+bool
+is_compressible(std::string_view mime_type)
+{
+	// Strip any parameters
+	mime_type = trim(mime_type.substr(0, mime_type.find(';')));
+
+	return mime_type.starts_with("text/") ||
+		mime_type == "application/javascript" ||
+		mime_type == "application/json" ||
+		mime_type == "application/xml" ||
+		mime_type == "application/xhtml+xml" ||
+		mime_type == "application/rss+xml" ||
+		mime_type == "application/atom+xml" ||
+		mime_type == "image/svg+xml" ||
+		mime_type == "image/x-icon" ||
+		mime_type == "image/vnd.microsoft.icon";
+}
+
+// Most of the gain for a fraction of the time: brotli 11 is around 50 times slower than 5
+constexpr int gzip_level = 6;
+constexpr int brotli_quality = 5;
+
+std::optional<std::string>
+gzip(std::string_view data)
+{
+	z_stream zs{};
+
+	// 15 window bits plus 16 selects the gzip wrapper
+	if(deflateInit2(&zs, gzip_level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return std::nullopt;
+
+	std::string out;
+	out.resize(deflateBound(&zs, data.size()));
+
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	zs.avail_in = data.size();
+	zs.next_out = reinterpret_cast<Bytef*>(out.data());
+	zs.avail_out = out.size();
+
+	int rc = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if(rc != Z_STREAM_END)
+		return std::nullopt;
+
+	out.resize(zs.total_out);
+	return out;
+}
+
+std::optional<std::string>
+brotli(std::string_view data)
+{
+#ifdef SHADYURL_HAVE_BROTLI
+	std::size_t size = BrotliEncoderMaxCompressedSize(data.size());
+	if(size == 0)
+		return std::nullopt;
+
+	std::string out;
+	out.resize(size);
+
+	if(!BrotliEncoderCompress(
+		brotli_quality,
+		BROTLI_DEFAULT_WINDOW,
+		BROTLI_MODE_TEXT,
+		data.size(),
+		reinterpret_cast<const uint8_t*>(data.data()),
+		&size,
+		reinterpret_cast<uint8_t*>(out.data())))
+	{
+		return std::nullopt;
+	}
+
+	out.resize(size);
+	return out;
+#else
+	(void)data;
+	return std::nullopt;
+#endif // SHADYURL_HAVE_BROTLI
+}
+
+} // namespace compression
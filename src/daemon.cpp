@@ -14,6 +14,8 @@
 #include <pwd.h>
 #include <grp.h>
 #include <fstream>
+#include <limits>
+#include <string>
 #include <string_view>
 
 #include "daemon.hpp"
@@ -155,26 +157,73 @@ check_pid()
 		return false;
 }
 
-// Returns true if PID written, false otherwise
-bool
-write_pid()
+// Returns true if PID written, false otherwise.
+// The file is replaced atomically, so there's never a moment it's missing or
+// half-written, even when a new binary is taking over from us.
+static bool
+write_pid(pid_t pid)
 {
-	pid_t pid = getpid();
+	std::string tmp_path{pid_file_path};
+	tmp_path.append(".tmp");
 
-	std::ofstream pid_file{pid_file_path.data(), std::ofstream::out | std::ofstream::trunc};
+	std::ofstream pid_file{tmp_path, std::ofstream::out | std::ofstream::trunc};
 	if(!pid_file)
 		return false;
 
 	pid_file << static_cast<int>(pid);
 	pid_file.close();
+	if(!pid_file)
+	{
+		(void)unlink(tmp_path.c_str());
+		return false;
+	}
+
+	if(rename(tmp_path.c_str(), pid_file_path.data()) == -1)
+	{
+		int saved_errno = errno;
+		(void)unlink(tmp_path.c_str());
+		errno = saved_errno;
+		return false;
+	}
 
 	return true;
 }
 
+bool
+write_pid()
+{
+	return write_pid(getpid());
+}
+
+// Whether the PID file names us
+static bool
+pid_is_ours()
+{
+	std::ifstream pid_file{pid_file_path.data()};
+	if(!pid_file)
+		return false;
+
+	int pid = 0;
+	pid_file >> pid;
+	return static_cast<pid_t>(pid) == getpid();
+}
+
+// Only removes the PID file if it's ours, so we don't remove the one
+// written by a new binary that's taken over from us
 void
 remove_pid()
 {
-	(void)unlink(pid_file_path.data());
+	if(pid_is_ours())
+		(void)unlink(pid_file_path.data());
+}
+
+void
+hand_over_pid(pid_t successor)
+{
+	// The new binary may have written it already, or not been allowed to
+	if(pid_is_ours() && !write_pid(successor))
+		syslog(LOG_WARNING, "Could not hand the PID file over to process %d: %s",
+			static_cast<int>(successor), strerror(errno));
 }
 
 bool
@@ -253,30 +302,34 @@ set_rlimit()
 {
 	struct rlimit rlim;
 
-	// Maybe configurable in the future? For now good enough.
-	const unsigned long long int rlim_core = RLIM_INFINITY;
-	const unsigned long long int rlim_nofile = RLIM_INFINITY;
-
-	if(rlim_core >= 0)
+	// Every connection needs a descriptor, so take as many as we're allowed
+	if(getrlimit(RLIMIT_NOFILE, &rlim) != 0)
 	{
-		rlim.rlim_cur = rlim.rlim_max = (rlim_core >= RLIM_INFINITY) ? RLIM_INFINITY : rlim_core;
-		if(setrlimit(RLIMIT_CORE, &rlim) != 0)
-		{
-			syslog(LOG_ALERT, "Couldn't set max core file size: %s", strerror(errno));
-			return false;
-		}
+		syslog(LOG_ALERT, "Couldn't get max file descriptors: %s", strerror(errno));
+		return false;
 	}
-	if(rlim_nofile >= 0)
+
+	if(rlim.rlim_cur == rlim.rlim_max)
+		return true;
+
+	rlim.rlim_cur = rlim.rlim_max;
+	if(setrlimit(RLIMIT_NOFILE, &rlim) != 0)
 	{
-		rlim.rlim_cur = rlim.rlim_max = (rlim_nofile >= RLIM_INFINITY) ? RLIM_INFINITY : rlim_nofile;
-		if(setrlimit(RLIMIT_NOFILE, &rlim) != 0)
-		{
-			syslog(LOG_ALERT, "Couldn't set max file descriptors: %s", strerror(errno));
-			return false;
-		}
+		syslog(LOG_ALERT, "Couldn't set max file descriptors: %s", strerror(errno));
+		return false;
 	}
 
-	return 0;
+	return true;
+}
+
+std::size_t
+fd_limit()
+{
+	struct rlimit rlim;
+	if(getrlimit(RLIMIT_NOFILE, &rlim) != 0 || rlim.rlim_cur == RLIM_INFINITY)
+		return std::numeric_limits<std::size_t>::max();
+
+	return static_cast<std::size_t>(rlim.rlim_cur);
 }
 
 } // namespace daemon
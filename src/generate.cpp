@@ -4,9 +4,10 @@
 #include <iostream>
 #include <sstream>
 #include <string>
-#include <string>
+#include <string_view>
 #include <array>
 #include <random>
+#include <vector>
 
 namespace generate
 {
@@ -225,12 +226,10 @@ generate_randstr(std::mt19937& mt)
 	return os.str();
 };
 
-std::string
-generate_random_filename()
+static std::string
+generate_random_filename(std::mt19937& mt)
 {
 	std::vector<std::string> out;
-	std::random_device rd;
-	std::mt19937 mt{rd()};
 	std::uniform_int_distribution<std::size_t> dist_nsfw(0, nsfw.size() - 1);
 	std::uniform_int_distribution<std::size_t> dist_ext(0, ext.size() - 1);
 	std::uniform_int_distribution<std::size_t> dist_len(5, 8);
@@ -260,4 +259,49 @@ generate_random_filename()
 	return os.str();
 }
 
+std::string
+generate_random_filename()
+{
+	std::random_device rd;
+	std::mt19937 mt{rd()};
+	return generate_random_filename(mt);
+}
+
+std::vector<std::string>
+generate_random_filenames(std::size_t n)
+{
+	// Seeding reads the random device and sets up 2.5KB of state, so it's only done once
+	std::random_device rd;
+	std::mt19937 mt{rd()};
+
+	std::vector<std::string> names;
+	names.reserve(n);
+	for(std::size_t i = 0; i < n; i++)
+		names.push_back(generate_random_filename(mt));
+
+	return names;
+}
+
+bool
+looks_generated(std::string_view token)
+{
+	// Longer than anything we'd make, with room to spare
+	constexpr std::size_t max_token = 512;
+	if(token.size() > max_token)
+		return false;
+
+	auto const dot = token.rfind('.');
+	if(dot == 0 || dot == std::string_view::npos)
+		return false;
+
+	auto const suffix = token.substr(dot);
+	if(std::find(ext.begin(), ext.end(), suffix) == ext.end())
+		return false;
+
+	return std::all_of(token.begin(), token.begin() + static_cast<std::ptrdiff_t>(dot), [](char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+	});
+}
+
 } // namespace generate
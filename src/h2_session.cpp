@@ -0,0 +1,529 @@
+#ifdef SHADYURL_HAVE_NGHTTP2
+
+#ifndef BOOST_BEAST_USE_STD_STRING_VIEW
+#	define BOOST_BEAST_USE_STD_STRING_VIEW
+#endif // BOOST_BEAST_USE_STD_STRING_VIEW
+
+#include <syslog.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <openssl/ssl.h>
+
+#include <boost/asio/dispatch.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+
+#include "bulk.hpp"
+#include "h2_session.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "request.hpp"
+
+namespace session
+{
+
+using tcp = boost::asio::ip::tcp;	// from <boost/asio/ip/tcp.hpp>
+
+// Request bodies are limited the same as for HTTP/1.1
+static constexpr std::size_t body_limit = 10000;
+
+// Writes are batched up to this size
+static constexpr std::size_t write_batch = 65536;
+
+static int
+select_alpn(SSL*, const unsigned char** out, unsigned char* outlen,
+	const unsigned char* in, unsigned int inlen, void*)
+{
+	// Prefers h2, then http/1.1
+	if(nghttp2_select_next_protocol(const_cast<unsigned char**>(out), outlen, in, inlen) < 0)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
+void
+enable_h2_alpn(ssl::context& ctx)
+{
+	SSL_CTX_set_alpn_select_cb(ctx.native_handle(), select_alpn, nullptr);
+}
+
+bool
+negotiated_h2(beast::ssl_stream<beast::tcp_stream>& stream)
+{
+	const unsigned char* proto = nullptr;
+	unsigned int len = 0;
+	SSL_get0_alpn_selected(stream.native_handle(), &proto, &len);
+	return len == 2 && std::memcmp(proto, "h2", 2) == 0;
+}
+
+h2_session::h2_session(
+	beast::ssl_stream<beast::tcp_stream>&& stream,
+	buffer_pool::flat_buffer&& buffer,
+	std::shared_ptr<const server_state::ServerState> state,
+	ratelimit::admission admission)
+	: stream_(std::move(stream))
+	, buffer_(std::move(buffer))
+	, state_(std::move(state))
+	, admission_(std::move(admission))
+{
+	nghttp2_session_callbacks* callbacks;
+	nghttp2_session_callbacks_new(&callbacks);
+	nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, &h2_session::on_begin_headers);
+	nghttp2_session_callbacks_set_on_header_callback(callbacks, &h2_session::on_header);
+	nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, &h2_session::on_data_chunk);
+	nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, &h2_session::on_frame_recv);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &h2_session::on_stream_close);
+	nghttp2_session_server_new(&session_, callbacks, this);
+	nghttp2_session_callbacks_del(callbacks);
+}
+
+h2_session::~h2_session()
+{
+	nghttp2_session_del(session_);
+
+	if(tracked_)
+	{
+		connections().remove(*tracked_);
+		metrics::add(metrics::counter::sessions_active, -1);
+	}
+}
+
+nghttp2_nv
+h2_session::make_nv(std::string_view name, std::string_view value)
+{
+	return {
+		reinterpret_cast<std::uint8_t*>(const_cast<char*>(name.data())),
+		reinterpret_cast<std::uint8_t*>(const_cast<char*>(value.data())),
+		name.size(),
+		value.size(),
+		NGHTTP2_NV_FLAG_NONE};
+}
+
+// Called on the session's strand, straight after the handshake
+void
+h2_session::run()
+{
+	tracked_ = connections().add(weak_from_this());
+	metrics::add(metrics::counter::sessions_active);
+
+	if(logging::access_log_enabled())
+	{
+		beast::error_code ec;
+		auto const remote = beast::get_lowest_layer(stream_).socket().remote_endpoint(ec);
+		if(!ec)
+			client_ = remote.address().to_string();
+	}
+
+	// The same limit on outstanding requests per connection as pipelining, give or take
+	nghttp2_settings_entry settings[] = {
+		{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100},
+	};
+	nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, settings, std::size(settings));
+
+	if(connections().draining())
+		submit_goaway();
+
+	// Anything read along with the handshake
+	if(buffer_.size() > 0)
+	{
+		auto const data = buffer_.data();
+		auto const rv = nghttp2_session_mem_recv(session_,
+			static_cast<const std::uint8_t*>(data.data()), data.size());
+		buffer_.consume(buffer_.size());
+		buffer_.shrink_to_fit();
+		if(rv < 0)
+		{
+			logging::log(LOG_INFO, "h2: %s", nghttp2_strerror(static_cast<int>(rv)));
+			return do_close();
+		}
+	}
+
+	do_write();
+	do_read();
+}
+
+void
+h2_session::drain()
+{
+	net::dispatch(
+		stream_.get_executor(),
+		[self = shared_from_this()]
+		{
+			// Streams in progress finish; the connection closes once they have
+			self->submit_goaway();
+			self->do_write();
+		});
+}
+
+void
+h2_session::submit_goaway()
+{
+	nghttp2_submit_goaway(session_, NGHTTP2_FLAG_NONE,
+		nghttp2_session_get_last_proc_stream_id(session_), NGHTTP2_NO_ERROR, nullptr, 0);
+}
+
+void
+h2_session::dispatch(std::int32_t stream_id)
+{
+	auto it = streams_.find(stream_id);
+	if(it == streams_.end())
+		return;
+
+	auto& s = *it->second;
+	s.received = true;
+	s.deadline = std::chrono::steady_clock::now() +
+		timeouts::deadline(state_->config(), timeouts::stage::write);
+
+	if(s.access)
+	{
+		s.access->method = s.req.method_string();
+		s.access->target = s.req.target().substr(0, 1024);
+	}
+
+	if(s.too_large)
+		return sender{*this, stream_id}(request::payload_too_large(s.req));
+
+	// Every stream takes from the connection's request bucket
+	ratelimit::scope rs{&admission_};
+	request::handle_request(*state_, std::move(s.req), sender{*this, stream_id});
+}
+
+timeouts::stage
+h2_session::read_stage() const
+{
+	if(streams_.empty())
+		return timeouts::stage::idle;
+
+	for(auto const& [id, s] : streams_)
+	{
+		if(!s->received)
+			return timeouts::stage::body;
+	}
+
+	return timeouts::stage::write;
+}
+
+// The earliest of the open streams' deadlines, or the idle one if there are none
+std::chrono::steady_clock::time_point
+h2_session::read_deadline()
+{
+	if(streams_.empty())
+	{
+		if(!idle_deadline_)
+			idle_deadline_ = std::chrono::steady_clock::now() +
+				timeouts::deadline(state_->config(), timeouts::stage::idle);
+		return *idle_deadline_;
+	}
+
+	auto earliest = std::chrono::steady_clock::time_point::max();
+	for(auto const& [id, s] : streams_)
+		earliest = std::min(earliest, s->deadline);
+	return earliest;
+}
+
+void
+h2_session::do_read()
+{
+	if(closing_)
+		return;
+
+	// With no streams open we're just waiting for the client, as on a kept-alive connection
+	beast::get_lowest_layer(stream_).expires_at(read_deadline());
+
+	net::mutable_buffer buf;
+	if(streams_.empty() && !woken_)
+	{
+		read_buf_.reset();
+		buf = net::buffer(&first_byte_, 1);
+	}
+	else
+	{
+		if(!read_buf_)
+			read_buf_ = buffer_pool::make_block();
+		buf = net::buffer(read_buf_.get(), buffer_pool::block_size);
+	}
+
+	reading_ = true;
+	stream_.async_read_some(
+		buf,
+		beast::bind_front_handler(
+			&h2_session::on_read,
+			shared_from_this()));
+}
+
+void
+h2_session::on_read(beast::error_code ec, std::size_t bytes_transferred)
+{
+	reading_ = false;
+	if(closing_)
+	{
+		// do_close() cancelled us so it could shut down
+		if(shutdown_waiting_)
+			do_shutdown();
+		return;
+	}
+
+	if(ec)
+	{
+		timeouts::note(ec, read_stage());
+		if(ec != net::error::eof && ec != ssl::error::stream_truncated && ec != beast::error::timeout)
+			logging::fail(ec, "h2 read");
+		closing_ = true;
+		return;
+	}
+
+	// After the one-byte wait, read whatever else came with it into a block;
+	// after a block, go back to waiting if that left no streams open
+	woken_ = !read_buf_;
+
+	auto const data = woken_ ? &first_byte_ : read_buf_.get();
+	auto const rv = nghttp2_session_mem_recv(session_, data, bytes_transferred);
+	if(rv < 0)
+	{
+		logging::log(LOG_INFO, "h2: %s", nghttp2_strerror(static_cast<int>(rv)));
+		return do_close();
+	}
+
+	do_write();
+	do_read();
+}
+
+void
+h2_session::do_write()
+{
+	if(writing_ || closing_)
+		return;
+
+	// Gather up everything nghttp2 has to send
+	while(write_buf_.size() < write_batch)
+	{
+		const std::uint8_t* data;
+		auto const n = nghttp2_session_mem_send(session_, &data);
+		if(n < 0)
+		{
+			logging::log(LOG_INFO, "h2: %s", nghttp2_strerror(static_cast<int>(n)));
+			return do_close();
+		}
+		if(n == 0)
+			break;
+
+		write_buf_.insert(write_buf_.end(), data, data + n);
+	}
+
+	if(write_buf_.empty())
+	{
+		// Both sides are done, e.g. after a GOAWAY
+		if(!nghttp2_session_want_read(session_) && !nghttp2_session_want_write(session_))
+			do_close();
+		return;
+	}
+
+	writing_ = true;
+	beast::get_lowest_layer(stream_).expires_after(
+		timeouts::deadline(state_->config(), timeouts::stage::write));
+
+	net::async_write(
+		stream_,
+		net::buffer(write_buf_),
+		beast::bind_front_handler(
+			&h2_session::on_write,
+			shared_from_this()));
+}
+
+void
+h2_session::on_write(beast::error_code ec, std::size_t bytes_transferred)
+{
+	boost::ignore_unused(bytes_transferred);
+	writing_ = false;
+
+	if(ec)
+	{
+		closing_ = true;
+		timeouts::note(ec, timeouts::stage::write);
+		return logging::fail(ec, "h2 write");
+	}
+
+	write_buf_.clear();
+	if(streams_.empty())
+		write_buf_.shrink_to_fit();
+	do_write();
+}
+
+void
+h2_session::do_close()
+{
+	if(closing_)
+		return;
+	closing_ = true;
+
+	// The shutdown can't run alongside a read, so stop that and shut down once it's finished
+	if(reading_)
+	{
+		shutdown_waiting_ = true;
+		return beast::get_lowest_layer(stream_).cancel();
+	}
+
+	do_shutdown();
+}
+
+void
+h2_session::do_shutdown()
+{
+	shutdown_waiting_ = false;
+	beast::get_lowest_layer(stream_).expires_after(
+		timeouts::deadline(state_->config(), timeouts::stage::handshake));
+
+	stream_.async_shutdown(
+		beast::bind_front_handler(
+			&h2_session::on_shutdown,
+			shared_from_this()));
+}
+
+void
+h2_session::on_shutdown(beast::error_code ec)
+{
+	if(ec && ec != ssl::error::stream_truncated)
+		logging::fail(ec, "h2 shutdown");
+
+	beast::get_lowest_layer(stream_).close();
+}
+
+int
+h2_session::on_begin_headers(nghttp2_session*, const nghttp2_frame* frame, void* user_data)
+{
+	auto self = static_cast<h2_session*>(user_data);
+	if(frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+		return 0;
+
+	auto s = std::make_unique<stream>();
+	s->req.version(20);
+	s->deadline = std::chrono::steady_clock::now() +
+		timeouts::deadline(self->state_->config(), timeouts::stage::body);
+	self->idle_deadline_.reset();
+	if(logging::access_log_enabled())
+	{
+		s->access.emplace();
+		s->access->client = self->client_;
+		s->start = std::chrono::steady_clock::now();
+	}
+
+	self->streams_[frame->hd.stream_id] = std::move(s);
+	return 0;
+}
+
+int
+h2_session::on_header(nghttp2_session*, const nghttp2_frame* frame,
+	const std::uint8_t* name, std::size_t namelen,
+	const std::uint8_t* value, std::size_t valuelen,
+	std::uint8_t, void* user_data)
+{
+	auto self = static_cast<h2_session*>(user_data);
+	auto it = self->streams_.find(frame->hd.stream_id);
+	if(it == self->streams_.end())
+		return 0;
+
+	auto& req = it->second->req;
+	std::string_view n{reinterpret_cast<const char*>(name), namelen};
+	std::string_view v{reinterpret_cast<const char*>(value), valuelen};
+
+	// nghttp2 has already checked the pseudo-headers are valid
+	if(n == ":method")
+		req.method_string(v);
+	else if(n == ":path")
+		req.target(v);
+	else if(n == ":authority")
+		req.set(http::field::host, v);
+	else if(!n.starts_with(':'))
+		req.insert(n, v);
+
+	return 0;
+}
+
+int
+h2_session::on_data_chunk(nghttp2_session*, std::uint8_t, std::int32_t stream_id,
+	const std::uint8_t* data, std::size_t len, void* user_data)
+{
+	auto self = static_cast<h2_session*>(user_data);
+	auto it = self->streams_.find(stream_id);
+	if(it == self->streams_.end())
+		return 0;
+
+	// Bulk and resolve requests are read whole here, but they get their own limit
+	auto& s = *it->second;
+	auto& body = s.req.body();
+	auto const limit = bulk::list_of(s.req.target()) ? self->state_->config().bulk_max_body : body_limit;
+	if(s.too_large || body.size() + len > limit)
+	{
+		s.too_large = true;
+		return 0;
+	}
+
+	body.append(reinterpret_cast<const char*>(data), len);
+	return 0;
+}
+
+int
+h2_session::on_frame_recv(nghttp2_session*, const nghttp2_frame* frame, void* user_data)
+{
+	auto self = static_cast<h2_session*>(user_data);
+
+	// The request is complete
+	if((frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA) &&
+		(frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+		self->dispatch(frame->hd.stream_id);
+
+	return 0;
+}
+
+int
+h2_session::on_stream_close(nghttp2_session*, std::int32_t stream_id, std::uint32_t error_code,
+	void* user_data)
+{
+	auto self = static_cast<h2_session*>(user_data);
+	auto it = self->streams_.find(stream_id);
+	if(it == self->streams_.end())
+		return 0;
+
+	auto& s = *it->second;
+	if(s.access && s.body && error_code == NGHTTP2_NO_ERROR)
+	{
+		s.access->micros = static_cast<std::uint64_t>(
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - s.start).count());
+		logging::access(*s.access);
+	}
+
+	self->streams_.erase(it);
+	return 0;
+}
+
+ssize_t
+h2_session::on_read_body(nghttp2_session*, std::int32_t, std::uint8_t* buf, std::size_t length,
+	std::uint32_t* data_flags, nghttp2_data_source* source, void*)
+{
+	auto body = static_cast<body_source*>(source->ptr);
+
+	beast::error_code ec;
+	bool eof = false;
+	auto const n = body->read(buf, length, eof, ec);
+	if(ec)
+	{
+		logging::fail(ec, "h2 body");
+		return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+	}
+
+	if(eof)
+		*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+
+	return static_cast<ssize_t>(n);
+}
+
+} // namespace session
+
+#endif // SHADYURL_HAVE_NGHTTP2
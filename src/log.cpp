@@ -4,8 +4,18 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <string>
 #include <string_view>
+#include <thread>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/beast/core.hpp>
@@ -45,7 +55,7 @@ fail(beast::error_code ec, char const* what)
         if(ec == ssl::error::stream_truncated)
                 return;
 
-	syslog(LOG_INFO, "%s: %s", what, ec.message().c_str());
+	log(LOG_INFO, "%s: %s", what, ec.message().c_str());
 }
 
 bool
@@ -90,4 +100,352 @@ set_log_level(std::string_view level)
 	return true;
 }
 
+// Messages are passed to the writer on a lock-free stack: producers push with a CAS,
+// and the writer takes the whole stack at once and reverses it back into order.
+struct record
+{
+	record* next;
+	int priority;
+	std::string text;
+};
+
+// Priorities for records that aren't syslog messages
+enum
+{
+	access_priority = -1,		// A line for the access log
+	reopen_priority = -2,		// Switch to next_access_fd
+	stop_priority = -3,		// Write everything out and stop
+};
+
+// Messages queued past this are dropped rather than letting a storm eat our memory
+static constexpr std::size_t max_pending = 65536;
+
+static std::atomic<record*> head{nullptr};
+static std::atomic<std::size_t> pending{0};
+static std::atomic<std::size_t> overflowed{0};
+static std::atomic<std::size_t> access_overflowed{0};
+static std::atomic<bool> running{false};
+static std::atomic<bool> access_enabled{false};
+
+// The access log the writer should switch to; -1 turns it off, and no_change is just that
+static constexpr int no_change = -2;
+static std::atomic<int> next_access_fd{no_change};
+static std::thread writer;
+
+static void
+push(int priority, std::string&& text)
+{
+	// Control records always get through
+	if(priority >= access_priority && pending.fetch_add(1, std::memory_order_relaxed) >= max_pending)
+	{
+		pending.fetch_sub(1, std::memory_order_relaxed);
+		(priority == access_priority ? access_overflowed : overflowed).fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	// Once it's pushed, the record belongs to the writer and mustn't be touched
+	auto r = new record{nullptr, priority, std::move(text)};
+	auto prev = head.load(std::memory_order_relaxed);
+	do
+	{
+		r->next = prev;
+	}
+	while(!head.compare_exchange_weak(prev, r, std::memory_order_release, std::memory_order_relaxed));
+
+	// The writer only sleeps when the stack is empty
+	if(prev == nullptr)
+		head.notify_one();
+}
+
+// The writer's state; only touched by the writer thread
+struct writer_state
+{
+	unsigned rate_limit;
+	double tokens;
+	std::chrono::steady_clock::time_point last_refill;
+	std::size_t rate_limited = 0;
+
+	int last_priority = 0;
+	std::string last_text;
+	std::size_t repeats = 0;
+
+	int access_fd = -1;
+	std::string access_buf;
+
+	void
+	flush_repeats()
+	{
+		if(repeats > 0)
+			syslog(last_priority, "Last message repeated %zu times", repeats);
+		repeats = 0;
+	}
+
+	// Say what was held back
+	void
+	report_dropped()
+	{
+		flush_repeats();
+
+		if(rate_limited > 0)
+			syslog(LOG_WARNING, "%zu log messages dropped by the rate limit", rate_limited);
+		rate_limited = 0;
+
+		if(auto n = overflowed.exchange(0, std::memory_order_relaxed))
+			syslog(LOG_WARNING, "%zu log messages dropped, the queue was full", n);
+		if(auto n = access_overflowed.exchange(0, std::memory_order_relaxed))
+			syslog(LOG_WARNING, "%zu access log lines dropped, the queue was full", n);
+	}
+
+	void
+	message(int priority, std::string& text)
+	{
+		if(priority == last_priority && text == last_text)
+		{
+			repeats++;
+			return;
+		}
+
+		flush_repeats();
+
+		// Token bucket, refilled continuously
+		auto const now = std::chrono::steady_clock::now();
+		tokens = std::min<double>(rate_limit,
+			tokens + std::chrono::duration<double>(now - last_refill).count() * rate_limit);
+		last_refill = now;
+
+		if(tokens < 1)
+		{
+			rate_limited++;
+			return;
+		}
+		tokens -= 1;
+
+		if(rate_limited > 0)
+		{
+			syslog(LOG_WARNING, "%zu log messages dropped by the rate limit", rate_limited);
+			rate_limited = 0;
+		}
+
+		syslog(priority, "%s", text.c_str());
+		last_priority = priority;
+		last_text.swap(text);
+	}
+
+	void
+	reopen()
+	{
+		int fd = next_access_fd.exchange(no_change, std::memory_order_acquire);
+		if(fd == no_change)
+			return;
+
+		flush_access();
+		if(access_fd != -1)
+			(void)close(access_fd);
+		access_fd = fd;
+	}
+
+	// Access log lines are written a batch at a time
+	void
+	flush_access()
+	{
+		std::size_t off = 0;
+		while(access_fd != -1 && off < access_buf.size())
+		{
+			auto const n = ::write(access_fd, access_buf.data() + off, access_buf.size() - off);
+			if(n == -1)
+			{
+				if(errno == EINTR)
+					continue;
+
+				syslog(LOG_ERR, "Could not write access log: %s", strerror(errno));
+				break;
+			}
+			off += static_cast<std::size_t>(n);
+		}
+
+		access_buf.clear();
+	}
+};
+
+static void
+run_writer(unsigned rate_limit)
+{
+	writer_state ws;
+	ws.rate_limit = rate_limit;
+	ws.tokens = rate_limit;
+	ws.last_refill = std::chrono::steady_clock::now();
+
+	bool stop = false;
+	while(!stop)
+	{
+		record* list = head.exchange(nullptr, std::memory_order_acquire);
+		if(!list)
+		{
+			ws.report_dropped();
+			head.wait(nullptr, std::memory_order_acquire);
+			continue;
+		}
+
+		// Put the batch back in the order it was logged
+		record* batch = nullptr;
+		while(list)
+		{
+			record* next = list->next;
+			list->next = batch;
+			batch = list;
+			list = next;
+		}
+
+		std::size_t count = 0;
+		while(batch)
+		{
+			record* r = batch;
+			batch = batch->next;
+
+			switch(r->priority)
+			{
+			case access_priority:
+				ws.access_buf.append(r->text);
+				count++;
+				break;
+			case reopen_priority:
+				ws.reopen();
+				break;
+			case stop_priority:
+				stop = true;
+				break;
+			default:
+				ws.message(r->priority, r->text);
+				count++;
+				break;
+			}
+
+			delete r;
+		}
+
+		ws.flush_access();
+		pending.fetch_sub(count, std::memory_order_relaxed);
+	}
+
+	ws.report_dropped();
+	ws.flush_access();
+	if(ws.access_fd != -1)
+		(void)close(ws.access_fd);
+}
+
+void
+log(int priority, const char* fmt, ...)
+{
+	va_list ap;
+
+	if(!running.load(std::memory_order_relaxed))
+	{
+		va_start(ap, fmt);
+		vsyslog(priority, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	// Don't bother queueing what syslog would throw away
+	if(!(setlogmask(0) & LOG_MASK(LOG_PRI(priority))))
+		return;
+
+	char buf[512];
+	va_start(ap, fmt);
+	int len = std::vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		return;
+
+	push(priority, std::string(buf, std::min<std::size_t>(static_cast<std::size_t>(len), sizeof(buf) - 1)));
+}
+
+void
+start_writer(unsigned rate_limit)
+{
+	if(running.exchange(true))
+		return;
+
+	writer = std::thread{run_writer, rate_limit ? rate_limit : 1};
+}
+
+void
+stop_writer()
+{
+	if(!running.exchange(false))
+		return;
+
+	push(stop_priority, {});
+	writer.join();
+}
+
+bool
+set_access_log(const std::string& path)
+{
+	// Opened here rather than by the writer, so it's done before privileges are dropped
+	int fd = -1;
+	if(!path.empty())
+	{
+		fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+		if(fd == -1)
+		{
+			log(LOG_ERR, "Could not open access log %s: %s", path.c_str(), strerror(errno));
+			return false;
+		}
+	}
+
+	// A file opened by an earlier call the writer hasn't picked up yet is superseded
+	int old = next_access_fd.exchange(fd, std::memory_order_release);
+	if(old >= 0)
+		(void)close(old);
+
+	access_enabled.store(fd != -1, std::memory_order_relaxed);
+	push(reopen_priority, {});
+	return true;
+}
+
+bool
+access_log_enabled()
+{
+	return access_enabled.load(std::memory_order_relaxed);
+}
+
+void
+access(const access_record& rec)
+{
+	if(!access_log_enabled())
+		return;
+
+	// A compact, space-separated line; the time is in milliseconds since the epoch
+	auto const now = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+
+	std::string line;
+	line.reserve(64 + rec.client.size() + rec.method.size() + rec.target.size());
+
+	char num[24];
+	auto append_num = [&](auto n)
+	{
+		auto res = std::to_chars(num, num + sizeof(num), n);
+		line.append(num, res.ptr);
+	};
+
+	append_num(now);
+	line.push_back(' ');
+	line.append(rec.client.empty() ? "-" : rec.client);
+	line.push_back(' ');
+	line.append(rec.method);
+	line.push_back(' ');
+	line.append(rec.target);
+	line.push_back(' ');
+	append_num(rec.status);
+	line.push_back(' ');
+	append_num(rec.bytes);
+	line.push_back(' ');
+	append_num(rec.micros);
+	line.push_back('\n');
+
+	push(access_priority, std::move(line));
+}
+
 } // namespace log
@@ -18,7 +18,10 @@
 #	define BOOST_BEAST_USE_STD_STRING_VIEW
 #endif // BOOST_BEAST_USE_STD_STRING_VIEW
 
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <syslog.h>
+#include <unistd.h>
 #include <stdarg.h>
 #include <algorithm>
 #include <cstdlib>
@@ -26,6 +29,7 @@
 #include <cstdint>
 #include <cerrno>
 #include <cstdio>
+#include <filesystem>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -38,15 +42,19 @@
 #include <boost/beast/ssl.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/config.hpp>
 
-#include <toml++/toml.h>
-
-#include "certificate.hpp"
+#include "log.hpp"
 #include "session.hpp"
 #include "path.hpp"
+#include "ratelimit.hpp"
 #include "server_state.hpp"
 #include "daemon.hpp"
+#include "token_filter.hpp"
+#include "trace.hpp"
+#include "upgrade.hpp"
+#include "urlcheck.hpp"
 
 namespace beast = boost::beast;		// from <boost/beast.hpp>
 namespace http = beast::http;		// from <boost/beast/http.hpp>
@@ -54,9 +62,128 @@ namespace net = boost::asio;		// from <boost/asio.hpp>
 namespace ssl = boost::asio::ssl;	// from <boost/asio/ssl.hpp>
 using tcp = boost::asio::ip::tcp;	// from <boost/asio/ip/tcp.hpp>
 
+// Warn about settings that were changed but can't take effect until a restart
+static void
+check_restart_needed(const server_state::Config& running, const server_state::Config& loaded)
+{
+	auto warn = [](const char* name)
+	{
+		logging::log(LOG_WARNING, "Changing %s requires a restart; the old value is still in use", name);
+	};
+
+	if(loaded.listeners != running.listeners)
+		warn("listen");
+	if(loaded.metrics_port != running.metrics_port)
+		warn("metricsport");
+	if(loaded.threads != running.threads)
+		warn("config.threads");
+	if(loaded.daemon != running.daemon)
+		warn("config.daemon");
+	if(loaded.user != running.user || loaded.group != running.group)
+		warn("config.user/config.group");
+	if(loaded.log_rate_limit != running.log_rate_limit)
+		warn("config.logratelimit");
+	if(loaded.ratelimit_entries != running.ratelimit_entries)
+		warn("ratelimit.entries");
+	if(loaded.filter_tokens != running.filter_tokens ||
+		loaded.filter_bits_per_token != running.filter_bits_per_token)
+		warn("filter.tokens/filter.bitspertoken");
+}
+
+// On SIGHUP, build a new state from the config file and publish it.
+// New connections pick it up; existing ones keep the state they were accepted with.
+static void
+wait_for_reload(
+	net::signal_set& signals,
+	server_state::StateHolder& holder,
+	const server_state::Config& running,
+	const std::string& config_file,
+	const std::string& mimetypes_file)
+{
+	signals.async_wait(
+		[&signals, &holder, &running, &config_file, &mimetypes_file](beast::error_code const& ec, int)
+		{
+			if(ec)
+				return;
+
+			logging::log(LOG_INFO, "Reloading configuration");
+
+			auto state = server_state::load_state(config_file, mimetypes_file);
+			if(!state)
+			{
+				logging::log(LOG_ERR, "Reload failed, carrying on with the old configuration");
+			}
+			else if(!logging::set_log_level(state->config().log_level))
+			{
+				logging::log(LOG_ERR, "Reload failed, carrying on with the old configuration");
+			}
+			else
+			{
+				check_restart_needed(running, state->config());
+				trace::configure(state->config().slow_request_ms);
+				ratelimit::configure(state->config());
+				(void)logging::set_access_log(state->config().access_log);
+				holder.set(std::move(state));
+				logging::log(LOG_INFO, "Reloaded configuration");
+			}
+
+			wait_for_reload(signals, holder, running, config_file, mimetypes_file);
+		});
+}
+
+// On SIGUSR2, start a new binary and hand it our listening sockets.
+// SIGCHLD tells us if it exited, which it only does if it failed to start.
+static void
+wait_for_upgrade(
+	net::signal_set& signals,
+	const std::vector<std::shared_ptr<session::listener>>& listeners,
+	const std::shared_ptr<session::metrics_listener>& metrics_listener)
+{
+	signals.async_wait(
+		[&signals, &listeners, &metrics_listener](beast::error_code const& ec, int signal_number)
+		{
+			if(ec)
+				return;
+
+			if(signal_number == SIGCHLD)
+			{
+				int status;
+				pid_t pid;
+				while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+				{
+					logging::log(LOG_ERR, "New binary (process %d) exited with status %d, upgrade failed",
+						static_cast<int>(pid), WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+					upgrade::child_exited(pid);
+				}
+			}
+			else
+			{
+				std::vector<int> fds;
+				for(auto& l : listeners)
+				{
+					int fd = l->native_handle();
+					if(fd != -1)
+						fds.push_back(fd);
+				}
+
+				if(metrics_listener && metrics_listener->native_handle() != -1)
+					fds.push_back(metrics_listener->native_handle());
+
+				logging::log(LOG_INFO, "Upgrading binary");
+				if(!upgrade::spawn(fds))
+					logging::log(LOG_ERR, "Upgrade failed, carrying on");
+			}
+
+			wait_for_upgrade(signals, listeners, metrics_listener);
+		});
+}
+
 int main(int argc, char* argv[])
 {
-	if(!daemonise::check_pid())
+	upgrade::init(argv);
+
+	// When upgrading, the old process is still running until we tell it to stop
+	if(!upgrade::is_upgrade() && !daemonise::check_pid())
 	{
 		std::cerr << "Process already running" << std::endl;
 		return EXIT_FAILURE;
@@ -65,79 +192,136 @@ int main(int argc, char* argv[])
 	// Open the logger
 	openlog("urlshorten", LOG_PID | LOG_NDELAY, LOG_DAEMON);
 
-	syslog(LOG_INFO, "Starting urlshorten");
+	logging::log(LOG_INFO, "Starting urlshorten");
+	logging::log(LOG_DEBUG, "Using %s URL scanning kernel", urlcheck::kernel_name().data());
 
-	// Load config data
-	toml::table tbl;
-	try
-	{
-		tbl = toml::parse_file("config.toml");
-	}
-	catch(const toml::parse_error& err)
+	// Remember where everything came from, as daemonising changes directory
+	auto const config_file = std::filesystem::absolute("config.toml").string();
+	auto const mimetypes_file = std::filesystem::absolute("mimetypes.txt").string();
+
+	// Load config data, MIME types and certificates
+	auto initial = server_state::load_state(config_file, mimetypes_file);
+	if(!initial)
 	{
-		syslog(LOG_ALERT, "Parsing of config file failed: %s", err.what());
 		return EXIT_FAILURE;
 	}
 
-	mime_type::MimeTypeMap mtm{"mimetypes.txt"};
-	server_state::ServerState state{tbl, mtm};
+	// Settings that only take effect at startup are read from this copy
+	auto const cfg = initial->config();
+	server_state::StateHolder holder{std::move(initial)};
 
-	if(!logging::set_log_level(state.get_config_log_level()))
+	if(!logging::set_log_level(cfg.log_level))
 	{
 		return EXIT_FAILURE;
 	}
 
-	auto const address = net::ip::make_address(state.get_config_address());
-	auto const port = static_cast<unsigned short>(state.get_config_port());
+	trace::configure(cfg.slow_request_ms);
 
 	// The io_context is required for all I/O
-	net::io_context ioc{static_cast<int>(state.get_config_threads())};
+	net::io_context ioc{static_cast<int>(cfg.threads)};
 
-	// The SSL context is required, and holds certificates
-	ssl::context ctx{ssl::context::tlsv12};
-
-	// This holds the self-signed certificate used by the server
-	if(!certificate::load_server_certificate(state, ctx))
+	// Create and launch the listening ports, adopting the old process's sockets if we're an upgrade
+	std::vector<std::shared_ptr<session::listener>> listeners;
+	for(auto const& options : cfg.listeners)
 	{
-		return EXIT_FAILURE;
-	}
+		int fd = upgrade::take_listener(session::listen_endpoint(options));
+		auto l = (fd != -1) ?
+			std::make_shared<session::listener>(ioc, options, fd, holder) :
+			std::make_shared<session::listener>(ioc, options, holder);
 
-	// Create and launch a listening port
-	std::make_shared<session::listener>(
-		ioc,
-		ctx,
-		tcp::endpoint{address, port},
-		state)->run();
+		l->run();
+		listeners.push_back(std::move(l));
+	}
 
-	if(state.get_config_port2())
+	// Metrics are only for whoever's on this machine
+	std::shared_ptr<session::metrics_listener> metrics_listener;
+	if(cfg.metrics_port)
 	{
-		auto const port2 = static_cast<unsigned short>(state.get_config_port2());
-		std::make_shared<session::listener>(
-			ioc,
-			ctx,
-			tcp::endpoint{address, port2},
-			state)->run();
+		tcp::endpoint endpoint{net::ip::address_v4::loopback(), cfg.metrics_port};
+
+		int fd = upgrade::take_listener(endpoint);
+		metrics_listener = (fd != -1) ?
+			std::make_shared<session::metrics_listener>(ioc, endpoint, fd) :
+			std::make_shared<session::metrics_listener>(ioc, endpoint);
+		metrics_listener->run();
 	}
 
-	// Capture SIGINT and SIGTERM to perform a clean shutdown
-	net::signal_set signals(ioc, SIGINT, SIGTERM);
+	upgrade::close_unused();
+
+	// Capture SIGHUP to reload without dropping any connections
+	net::signal_set reload_signals(ioc, SIGHUP);
+	wait_for_reload(reload_signals, holder, cfg, config_file, mimetypes_file);
+
+	// Capture SIGUSR2 to upgrade the binary
+	net::signal_set upgrade_signals(ioc, SIGUSR2, SIGCHLD);
+	wait_for_upgrade(upgrade_signals, listeners, metrics_listener);
+
+	// Capture SIGINT, SIGTERM and SIGQUIT to shut down once every connection has finished.
+	// SIGQUIT is also how a new binary tells us it's taken over.
+	net::signal_set signals(ioc, SIGINT, SIGTERM, SIGQUIT);
+	net::steady_timer drain_timer(ioc);
 	signals.async_wait(
-		[&](beast::error_code const&, int)
+		[&](beast::error_code const& ec, int)
 		{
-			// Stop the `io_context`. This will cause `run()`
-			// to return immediately, eventually destroying the
-			// `io_context` and all of the sockets in it.
-			ioc.stop();
+			if(ec)
+				return;
+
+			// This one can be changed by a reload
+			auto const drain_timeout = holder.get()->config().drain_timeout;
+			logging::log(LOG_INFO, "Shutting down, waiting up to %" PRIu32 " seconds for connections to finish",
+				drain_timeout);
+
+			for(auto& l : listeners)
+				l->stop();
+			if(metrics_listener)
+				metrics_listener->stop();
+
+			reload_signals.cancel();
+			upgrade_signals.cancel();
+
+			// Don't wait forever for slow clients
+			drain_timer.expires_after(std::chrono::seconds(drain_timeout));
+			drain_timer.async_wait(
+				[&](beast::error_code const& ec)
+				{
+					if(ec)
+						return;
+
+					logging::log(LOG_NOTICE, "Timed out draining, closing %zu connections",
+						session::connections().count());
+					ioc.stop();
+				});
+
+			// Asking again means right now
+			signals.async_wait(
+				[&](beast::error_code const& ec, int)
+				{
+					if(ec)
+						return;
+
+					logging::log(LOG_NOTICE, "Stopping now, closing %zu connections",
+						session::connections().count());
+					ioc.stop();
+				});
+
+			session::connections().drain(
+				[&ioc]
+				{
+					// Stop the `io_context`. This will cause `run()`
+					// to return immediately, eventually destroying the
+					// `io_context` and anything still waiting in it.
+					ioc.stop();
+				});
 		});
 
 	// Ready to daemonise.
 	ioc.notify_fork(net::io_context::fork_prepare);
-	if(state.get_config_daemon())
+	if(cfg.daemon && !upgrade::is_upgrade())
 	{
 		bool is_daemon = daemonise::daemonise(daemonise::D_NO_CLOSE_FILES);
 		if(is_daemon == false)
 		{
-			syslog(LOG_ALERT, "Could not daemonise: %s", strerror(errno));
+			logging::log(LOG_ALERT, "Could not daemonise: %s", strerror(errno));
 			return EXIT_FAILURE;
 		}
 	}
@@ -145,30 +329,52 @@ int main(int argc, char* argv[])
 
 	if(!daemonise::write_pid())
 	{
-		syslog(LOG_ALERT, "Could not write PID file: %s", strerror(errno));
-		return EXIT_FAILURE;
+		if(!upgrade::is_upgrade())
+		{
+			logging::log(LOG_ALERT, "Could not write PID file: %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		// The old process may well have dropped the privileges needed to write it
+		logging::log(LOG_WARNING, "Could not update PID file: %s", strerror(errno));
 	}
 
-	// Drop privileges
-	if(!daemonise::drop_privs(state.get_config_user(), state.get_config_group()))
-	{
-		syslog(LOG_ALERT, "Could not drop privileges: %s", strerror(errno));
+	// Open the access log while we still can
+	if(!logging::set_access_log(cfg.access_log))
 		return EXIT_FAILURE;
-	}
 
-#if 0
-	// Set rlimit
-	if(!daemonise::set_rlimit())
+	// Drop privileges; when upgrading, they're already gone if the old process dropped them
+	if((!upgrade::is_upgrade() || geteuid() == 0) && !daemonise::drop_privs(cfg.user, cfg.group))
 	{
-		syslog(LOG_ALERT, "Could not set rlimit: %s", strerror(errno));
+		logging::log(LOG_ALERT, "Could not drop privileges: %s", strerror(errno));
 		return EXIT_FAILURE;
 	}
-#endif
+
+	// Size the connection limit to the file descriptors we can have, keeping some back
+	// for the database, logs and listeners. A connection sending a static file holds
+	// two, so allow for that.
+	(void)daemonise::set_rlimit();
+	auto const fds = daemonise::fd_limit();
+	constexpr std::size_t reserved_fds = 64;
+	ratelimit::set_connection_budget(fds > reserved_fds ? (fds - reserved_fds) / 2 : 1);
+	ratelimit::init(cfg.ratelimit_entries);
+	ratelimit::configure(cfg);
+
+	// Load the tokens once we're the user who'll be reading the database.
+	// Without the filter, every token is looked up, so carry on.
+	if(!token_filter::init(cfg.db_path, cfg.filter_tokens, cfg.filter_bits_per_token))
+		logging::log(LOG_WARNING, "Carrying on without the token filter");
+
+	// From here on, logging is done off the I/O threads
+	logging::start_writer(cfg.log_rate_limit);
+
+	// We're ready to serve, so the process we're replacing can stop accepting
+	upgrade::notify_ready();
 
 	// Run the I/O service on the requested number of threads
 	std::vector<std::thread> v;
-	v.reserve(state.get_config_threads() - 1);
-	for(auto i = state.get_config_threads() - 1; i > 0; --i)
+	v.reserve(cfg.threads - 1);
+	for(auto i = cfg.threads - 1; i > 0; --i)
 		v.emplace_back(
 		[&ioc]
 		{
@@ -176,13 +382,19 @@ int main(int argc, char* argv[])
 		});
 	ioc.run();
 
-	// (If we get here, it means we got a SIGINT or SIGTERM)
+	// (If we get here, it means we got a SIGINT, SIGTERM or SIGQUIT, and finished draining)
 
-	daemonise::remove_pid();
+	// After an upgrade, the PID file belongs to the new binary, even if it couldn't write it
+	if(auto next = upgrade::successor())
+		daemonise::hand_over_pid(next);
+	else
+		daemonise::remove_pid();
 
 	// Block until all the threads exit
 	for(auto& t : v)
 		t.join();
 
+	logging::stop_writer();
+
 	return EXIT_SUCCESS;
 }
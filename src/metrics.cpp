@@ -0,0 +1,312 @@
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace metrics
+{
+
+constexpr std::size_t num_counters = static_cast<std::size_t>(counter::count_);
+constexpr std::size_t num_histograms = static_cast<std::size_t>(histogram::count_);
+
+// Histograms are log-linear, like HdrHistogram: values below 16 get a bucket each,
+// then every power of two is split into 8 buckets, for a precision of 1/8th.
+// Values past 2^40 (about twelve days in microseconds) go in the last bucket.
+constexpr unsigned sub_bits = 3;
+constexpr unsigned linear_max = 1u << (sub_bits + 1);
+constexpr unsigned max_exponent = 40;
+constexpr std::size_t num_buckets = linear_max + (max_exponent - sub_bits) * (1u << sub_bits);
+
+static std::size_t
+bucket_index(std::uint64_t value)
+{
+	if(value < linear_max)
+		return static_cast<std::size_t>(value);
+
+	unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(value));
+	if(exponent > max_exponent)
+		return num_buckets - 1;
+
+	auto const sub = (value >> (exponent - sub_bits)) & ((1u << sub_bits) - 1);
+	return linear_max + (exponent - sub_bits - 1) * (1u << sub_bits) + sub;
+}
+
+// The largest value that lands in a bucket
+static std::uint64_t
+bucket_max(std::size_t index)
+{
+	if(index < linear_max)
+		return index;
+
+	auto const exponent = (index - linear_max) / (1u << sub_bits) + sub_bits + 1;
+	auto const sub = (index - linear_max) % (1u << sub_bits);
+	return (((1u << sub_bits) + sub + 1) << (exponent - sub_bits)) - 1;
+}
+
+// Each thread only ever writes to its own shard, so a plain load and store is
+// enough; the atomics are only there so scrapes can read them safely.
+template<class T>
+static inline void
+bump(std::atomic<T>& a, T n)
+{
+	a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct alignas(64) shard
+{
+	struct hist
+	{
+		std::array<std::atomic<std::uint64_t>, num_buckets> buckets{};
+		std::atomic<std::uint64_t> sum{0};
+	};
+
+	std::array<std::atomic<std::int64_t>, num_counters> counters{};
+	std::array<hist, num_histograms> histograms{};
+};
+
+// Shards are kept when their thread exits, so nothing it counted is lost
+static std::mutex shards_lock;
+static std::vector<std::unique_ptr<shard>> shards;
+
+static shard&
+local_shard()
+{
+	thread_local shard* local = []
+	{
+		auto s = std::make_unique<shard>();
+		auto ptr = s.get();
+
+		std::lock_guard lock{shards_lock};
+		shards.push_back(std::move(s));
+		return ptr;
+	}();
+
+	return *local;
+}
+
+void
+add(counter c, std::int64_t n)
+{
+	bump(local_shard().counters[static_cast<std::size_t>(c)], n);
+}
+
+void
+record(histogram h, std::uint64_t value)
+{
+	auto& hist = local_shard().histograms[static_cast<std::size_t>(h)];
+	bump(hist.buckets[bucket_index(value)], std::uint64_t{1});
+	bump(hist.sum, value);
+}
+
+counter
+status_class(unsigned status)
+{
+	if(status < 200)
+		return counter::responses_1xx;
+	if(status < 300)
+		return counter::responses_2xx;
+	if(status < 400)
+		return counter::responses_3xx;
+	if(status < 500)
+		return counter::responses_4xx;
+	return counter::responses_5xx;
+}
+
+struct counter_desc
+{
+	std::string_view name;
+	std::string_view labels;
+	std::string_view type;
+	std::string_view help;
+};
+
+static const std::array<counter_desc, num_counters> counter_descs{{
+	{"shadyurl_requests_total", "route=\"file\"", "counter", "Requests by route"},
+	{"shadyurl_requests_total", "route=\"post\"", "counter", "Requests by route"},
+	{"shadyurl_requests_total", "route=\"template\"", "counter", "Requests by route"},
+	{"shadyurl_requests_total", "route=\"url\"", "counter", "Requests by route"},
+	{"shadyurl_requests_total", "route=\"bulk\"", "counter", "Requests by route"},
+	{"shadyurl_requests_total", "route=\"resolve\"", "counter", "Requests by route"},
+	{"shadyurl_requests_total", "route=\"bad_target\"", "counter", "Requests by route"},
+	{"shadyurl_requests_total", "route=\"not_found\"", "counter", "Requests by route"},
+	{"shadyurl_responses_total", "code=\"1xx\"", "counter", "Responses by status class"},
+	{"shadyurl_responses_total", "code=\"2xx\"", "counter", "Responses by status class"},
+	{"shadyurl_responses_total", "code=\"3xx\"", "counter", "Responses by status class"},
+	{"shadyurl_responses_total", "code=\"4xx\"", "counter", "Responses by status class"},
+	{"shadyurl_responses_total", "code=\"5xx\"", "counter", "Responses by status class"},
+	{"shadyurl_tls_handshakes_total", "", "counter", "Completed TLS handshakes"},
+	{"shadyurl_tls_handshake_failures_total", "", "counter", "Failed TLS handshakes"},
+	{"shadyurl_ratelimited_total", "limiter=\"connrate\"", "counter", "Connections and requests refused by the rate limiter"},
+	{"shadyurl_ratelimited_total", "limiter=\"perclient\"", "counter", "Connections and requests refused by the rate limiter"},
+	{"shadyurl_ratelimited_total", "limiter=\"global\"", "counter", "Connections and requests refused by the rate limiter"},
+	{"shadyurl_ratelimited_total", "limiter=\"request\"", "counter", "Connections and requests refused by the rate limiter"},
+	{"shadyurl_ratelimit_evictions_total", "", "counter", "Clients evicted from the rate limit table"},
+	{"shadyurl_timeouts_total", "stage=\"handshake\"", "counter", "Connections closed for being too slow, by stage"},
+	{"shadyurl_timeouts_total", "stage=\"header\"", "counter", "Connections closed for being too slow, by stage"},
+	{"shadyurl_timeouts_total", "stage=\"body\"", "counter", "Connections closed for being too slow, by stage"},
+	{"shadyurl_timeouts_total", "stage=\"idle\"", "counter", "Connections closed for being too slow, by stage"},
+	{"shadyurl_timeouts_total", "stage=\"write\"", "counter", "Connections closed for being too slow, by stage"},
+	{"shadyurl_bulk_urls_total", "", "counter", "URLs given tokens by bulk requests"},
+	{"shadyurl_resolved_tokens_total", "", "counter", "Tokens found by resolve requests"},
+	{"shadyurl_lookups_skipped_total", "reason=\"shape\"", "counter", "Token lookups turned away without a query"},
+	{"shadyurl_lookups_skipped_total", "reason=\"filter\"", "counter", "Token lookups turned away without a query"},
+	{"shadyurl_sessions_active", "", "gauge", "Open HTTP sessions"},
+	{"shadyurl_responses_queued", "", "gauge", "Responses waiting to be sent, over all sessions"},
+}};
+
+struct histogram_desc
+{
+	std::string_view name;
+	std::string_view labels;
+	std::string_view help;
+	bool seconds;	// Recorded in microseconds, exported in seconds
+};
+
+static const std::array<histogram_desc, num_histograms> histogram_descs{{
+	{"shadyurl_request_duration_seconds", "route=\"file\"", "Time spent handling requests", true},
+	{"shadyurl_request_duration_seconds", "route=\"post\"", "Time spent handling requests", true},
+	{"shadyurl_request_duration_seconds", "route=\"template\"", "Time spent handling requests", true},
+	{"shadyurl_request_duration_seconds", "route=\"url\"", "Time spent handling requests", true},
+	{"shadyurl_request_duration_seconds", "route=\"bulk\"", "Time spent handling requests", true},
+	{"shadyurl_request_duration_seconds", "route=\"resolve\"", "Time spent handling requests", true},
+	{"shadyurl_sqlite_duration_seconds", "", "Time spent in SQLite", true},
+	{"shadyurl_render_duration_seconds", "", "Time spent rendering templates", true},
+	{"shadyurl_tls_handshake_duration_seconds", "", "Time taken by TLS handshakes", true},
+	{"shadyurl_queue_depth", "", "Responses already queued when a response is queued", false},
+}};
+
+// Bucket bounds for export, in microseconds for time histograms.
+// These don't line up with our buckets, so each count is accurate to within their precision.
+static const std::uint64_t time_bounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+static const std::uint64_t depth_bounds[] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+
+static void
+append_header(std::string& out, std::string_view name, std::string_view type, std::string_view help)
+{
+	out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+	out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+static void
+append_sample(std::string& out, std::string_view name, std::string_view suffix,
+	std::string_view labels, std::string_view extra_label, std::string_view value)
+{
+	out.append(name).append(suffix);
+	if(!labels.empty() || !extra_label.empty())
+	{
+		out.push_back('{');
+		out.append(labels);
+		if(!labels.empty() && !extra_label.empty())
+			out.push_back(',');
+		out.append(extra_label);
+		out.push_back('}');
+	}
+	out.push_back(' ');
+	out.append(value).append("\n");
+}
+
+static std::string
+format_bound(std::uint64_t bound, bool seconds)
+{
+	char buf[32];
+	if(seconds)
+		std::snprintf(buf, sizeof(buf), "%g", static_cast<double>(bound) / 1e6);
+	else
+		std::snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(bound));
+	return buf;
+}
+
+std::string
+render()
+{
+	std::array<std::int64_t, num_counters> counters{};
+	std::vector<std::array<std::uint64_t, num_buckets>> buckets(num_histograms);
+	std::array<std::uint64_t, num_histograms> sums{};
+
+	{
+		std::lock_guard lock{shards_lock};
+		for(auto& s : shards)
+		{
+			for(std::size_t i = 0; i < num_counters; i++)
+				counters[i] += s->counters[i].load(std::memory_order_relaxed);
+
+			for(std::size_t h = 0; h < num_histograms; h++)
+			{
+				auto& hist = s->histograms[h];
+				for(std::size_t b = 0; b < num_buckets; b++)
+					buckets[h][b] += hist.buckets[b].load(std::memory_order_relaxed);
+				sums[h] += hist.sum.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	std::string out;
+	out.reserve(16384);
+
+	std::string_view last_family;
+	for(std::size_t i = 0; i < num_counters; i++)
+	{
+		auto& desc = counter_descs[i];
+		if(desc.name != last_family)
+		{
+			append_header(out, desc.name, desc.type, desc.help);
+			last_family = desc.name;
+		}
+
+		append_sample(out, desc.name, "", desc.labels, "", std::to_string(counters[i]));
+	}
+
+	last_family = {};
+	for(std::size_t h = 0; h < num_histograms; h++)
+	{
+		auto& desc = histogram_descs[h];
+		if(desc.name != last_family)
+		{
+			append_header(out, desc.name, "histogram", desc.help);
+			last_family = desc.name;
+		}
+
+		const std::uint64_t* bounds = desc.seconds ? std::begin(time_bounds) : std::begin(depth_bounds);
+		const std::uint64_t* bounds_end = desc.seconds ? std::end(time_bounds) : std::end(depth_bounds);
+
+		// Buckets are cumulative
+		std::uint64_t cumulative = 0;
+		std::size_t b = 0;
+		for(auto bound = bounds; bound != bounds_end; ++bound)
+		{
+			for(; b < num_buckets && bucket_max(b) <= *bound; b++)
+				cumulative += buckets[h][b];
+
+			append_sample(out, desc.name, "_bucket", desc.labels,
+				"le=\"" + format_bound(*bound, desc.seconds) + "\"", std::to_string(cumulative));
+		}
+
+		for(; b < num_buckets; b++)
+			cumulative += buckets[h][b];
+
+		append_sample(out, desc.name, "_bucket", desc.labels, "le=\"+Inf\"", std::to_string(cumulative));
+
+		char sum[32];
+		if(desc.seconds)
+			std::snprintf(sum, sizeof(sum), "%.6f", static_cast<double>(sums[h]) / 1e6);
+		else
+			std::snprintf(sum, sizeof(sum), "%llu", static_cast<unsigned long long>(sums[h]));
+
+		append_sample(out, desc.name, "_sum", desc.labels, "", sum);
+		append_sample(out, desc.name, "_count", desc.labels, "", std::to_string(cumulative));
+	}
+
+	return out;
+}
+
+} // namespace metrics
@@ -1,10 +1,12 @@
+#include <algorithm>
 #include <cerrno>
 #include <string>
 #include <string_view>
 #include <fstream>
 #include <sstream>
 #include <iostream>
-#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <system_error>
 
 #include "mime.hpp"
@@ -12,27 +14,38 @@
 namespace mime_type
 {
 
-std::string_view MimeTypeMap::find_extension(std::string extension_) const
+const std::string* MimeTypeMap::lookup(std::string_view extension) const
 {
-	std::string extension{extension_};
+	auto it = std::lower_bound(mimetypes.begin(), mimetypes.end(), extension,
+		[](const auto& entry, std::string_view ext)
+		{
+			return std::string_view{entry.first} < ext;
+		});
 
+	if(it == mimetypes.end() || it->first != extension)
+		return nullptr;
+
+	return &it->second;
+}
+
+std::string_view MimeTypeMap::find_extension(std::string_view extension) const
+{
 	size_t pos;
-	while((pos = extension.find(".")) != std::string::npos)
+	while((pos = extension.find(".")) != std::string_view::npos)
 	{
-		extension.erase(0, pos + 1);
-		auto mime_search = mimetypes.find(extension);
-		if(mime_search != mimetypes.end())
-			return mime_search->second;
+		extension.remove_prefix(pos + 1);
+		if(auto type = lookup(extension))
+			return *type;
 	}
 
 	return default_mimetype_;
 }
 
-std::string_view MimeTypeMap::find_filename(std::string filename) const
+std::string_view MimeTypeMap::find_filename(std::string_view filename) const
 {
 	// We assume everything after the first dot is an extension
 	size_t pos = filename.find(".");
-	if(pos == std::string::npos)
+	if(pos == std::string_view::npos)
 		return default_mimetype_;
 
 	return find_extension(filename.substr(pos));
@@ -54,11 +67,29 @@ MimeTypeMap::MimeTypeMap(std::string_view mimetypes_file, std::string_view defau
 		std::istringstream ss{line};
 
 		ss >> ext >> type;
-		mimetypes[ext] = type;
+		if(ext.empty())
+			continue;
+
+		mimetypes.emplace_back(std::move(ext), std::move(type));
 	}
 
 	if(ifs.bad())
 		throw std::system_error(errno, std::generic_category());
+
+	// Sort for lookups; for duplicates, the last one in the file wins
+	std::stable_sort(mimetypes.begin(), mimetypes.end(),
+		[](const auto& a, const auto& b)
+		{
+			return a.first < b.first;
+		});
+
+	auto last = std::unique(mimetypes.rbegin(), mimetypes.rend(),
+		[](const auto& a, const auto& b)
+		{
+			return a.first == b.first;
+		});
+	mimetypes.erase(mimetypes.begin(), last.base());
+	mimetypes.shrink_to_fit();
 }
 
 } // namespace mime_type
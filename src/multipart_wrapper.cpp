@@ -2,131 +2,352 @@
 
 #include <boost/algorithm/string.hpp>
 
-#include <iostream>
-#include <iomanip>
+#include <algorithm>
 #include <cstring>
+#include <functional>
+#include <optional>
 #include <string>
 #include <string_view>
-#include <tuple>
-#include <map>
 #include <vector>
-#include <variant>
 
 namespace multipart_wrapper
 {
 
 typedef MultiPartData::MultiPartSection MultiPartSection;
 
-MultiPartSection::header_type
-MultiPartSection::parse_header_value(std::string_view header)
+static inline bool
+is_ows(char c)
 {
-	std::vector<std::string> tokens;
-	MultiPartSection::header_params_type data;
+	return c == ' ' || c == '\t';
+}
 
-	boost::split(tokens, header, boost::is_any_of(";"));
+static inline std::string_view
+trim(std::string_view str)
+{
+	while(!str.empty() && is_ows(str.front()))
+		str.remove_prefix(1);
+	while(!str.empty() && is_ows(str.back()))
+		str.remove_suffix(1);
+	return str;
+}
 
-	for(auto& token : tokens)
+bool
+HeaderParams::next(HeaderParam& param)
+{
+	std::size_t i = 0;
+	std::size_t const n = rest_.size();
+
+	// Skip separators and whitespace between parameters
+	while(i < n && (rest_[i] == ';' || is_ows(rest_[i])))
+		i++;
+
+	if(i == n)
 	{
-		boost::trim_left(token);
+		rest_ = {};
+		return false;
+	}
 
-		size_t pos;
-		if((pos = token.find("=")) != std::string::npos)
-		{
-			std::string k = token.substr(0, pos);
-			std::string v = token.substr(++pos);
+	std::size_t const name_begin = i;
+	while(i < n && rest_[i] != '=' && rest_[i] != ';')
+		i++;
+
+	param.name = trim(rest_.substr(name_begin, i - name_begin));
+	param.value = {};
+	param.has_value = false;
+
+	if(i < n && rest_[i] == '=')
+	{
+		param.has_value = true;
+		i++;
+
+		while(i < n && is_ows(rest_[i]))
+			i++;
 
-			if(v[0] == '"')
+		if(i < n && rest_[i] == '"')
+		{
+			std::size_t const value_begin = ++i;
+			while(i < n && rest_[i] != '"')
 			{
-				std::stringstream ss;
-				ss << v;
-				ss >> std::quoted(v);
+				// Skip over quoted-pairs
+				if(rest_[i] == '\\' && i + 1 < n)
+					i++;
+				i++;
 			}
-			data[k] = v;
+
+			param.value = rest_.substr(value_begin, i - value_begin);
+
+			// Anything between the closing quote and the next ; is ignored
+			while(i < n && rest_[i] != ';')
+				i++;
 		}
 		else
-			data[token] = std::monostate{};
+		{
+			std::size_t const value_begin = i;
+			while(i < n && rest_[i] != ';')
+				i++;
+
+			param.value = trim(rest_.substr(value_begin, i - value_begin));
+		}
 	}
 
-	if(data.empty())
-		return std::string{};
-	else
-		return data;
+	rest_ = rest_.substr(i);
+	return true;
 }
 
-MultiPartSection::MultiPartSection(const MultiPartSection::header_map_type& headers, std::string_view data)
-	: headers_(headers)
-	, data_(data)
+std::optional<std::string_view>
+HeaderParams::find(std::string_view header, std::string_view name)
 {
+	HeaderParams params{header};
+	HeaderParam param;
+	while(params.next(param))
+	{
+		if(param.has_value && boost::iequals(param.name, name))
+			return param.value;
+	}
+
+	return std::nullopt;
 }
 
-MultiPartSection::header_map_type
+const MultiPartSection::header_list_type&
 MultiPartSection::get_headers() const
 {
 	return headers_;
 }
 
-std::string
+std::optional<std::string_view>
+MultiPartSection::get_header(std::string_view name) const
+{
+	for(auto& h : headers_)
+	{
+		if(boost::iequals(h.name, name))
+			return h.value;
+	}
+
+	return std::nullopt;
+}
+
+std::string_view
 MultiPartSection::get_data() const
 {
 	return data_;
 }
 
 MultiPartData::MultiPartData(std::string_view boundary)
+	: delimiter_("\r\n--")
+{
+	delimiter_.append(boundary);
+}
+
+bool
+MultiPartData::ingest(std::string_view body)
+{
+	std::string_view const dash_boundary{delimiter_.data() + 2, delimiter_.size() - 2};
+	std::boyer_moore_horspool_searcher search{delimiter_.begin(), delimiter_.end()};
+
+	// Find the first boundary, skipping any preamble
+	std::size_t pos;
+	if(body.starts_with(dash_boundary))
+	{
+		pos = 0;
+	}
+	else
+	{
+		auto it = std::search(body.begin(), body.end(), search);
+		if(it == body.end())
+			return false;
+
+		pos = (it - body.begin()) + 2;
+	}
+
+	for(;;)
+	{
+		// pos is at the start of "--boundary"
+		pos += dash_boundary.size();
+
+		// The close delimiter has a trailing "--"
+		if(body.substr(pos, 2) == "--")
+			return true;
+
+		// Skip any transport padding to the end of the line
+		auto const eol = body.find("\r\n", pos);
+		if(eol == std::string_view::npos)
+			return false;
+
+		pos = eol + 2;
+
+		MultiPartSection section;
+
+		// Read headers until the empty line
+		while(!body.substr(pos).starts_with("\r\n"))
+		{
+			auto const end = body.find("\r\n", pos);
+			if(end == std::string_view::npos)
+				return false;
+
+			std::string_view line = body.substr(pos, end - pos);
+			auto const colon = line.find(':');
+			if(colon != std::string_view::npos)
+				section.headers_.push_back({trim(line.substr(0, colon)), trim(line.substr(colon + 1))});
+
+			pos = end + 2;
+		}
+
+		pos += 2;
+
+		auto it = std::search(body.begin() + pos, body.end(), search);
+		if(it == body.end())
+			return false;
+
+		std::size_t const next = it - body.begin();
+		section.data_ = body.substr(pos, next - pos);
+		data_.push_back(std::move(section));
+
+		// Move past the CRLF to the next "--boundary"
+		pos = next + 2;
+	}
+}
+
+const std::vector<MultiPartSection>&
+MultiPartData::get_data() const
+{
+	return data_;
+}
+
+const MultiPartSection*
+MultiPartData::find_field(std::string_view name) const
+{
+	for(auto& section : data_)
+	{
+		auto cd = section.get_header("Content-Disposition");
+		if(!cd)
+			continue;
+
+		auto field = HeaderParams::find(*cd, "name");
+		if(field && *field == name)
+			return &section;
+	}
+
+	return nullptr;
+}
+
+FieldExtractor::FieldExtractor(std::string_view boundary, std::string_view name)
 	: boundary_(boundary)
+	, name_(name)
 {
 	memset(&callbacks_, 0, sizeof(multipart_parser_settings));
 
 	callbacks_.on_header_field = read_header_name;
 	callbacks_.on_header_value = read_header_value;
+	callbacks_.on_headers_complete = read_headers_complete;
 	callbacks_.on_part_data = read_body;
+	callbacks_.on_part_data_begin = read_part_begin;
+	callbacks_.on_part_data_end = read_part_end;
 
-	parser_ = multipart_parser_init(boundary_.data(), &callbacks_);
+	parser_ = multipart_parser_init(boundary_.c_str(), &callbacks_);
 	multipart_parser_set_data(parser_, this);
 }
 
-
-MultiPartData::~MultiPartData()
+FieldExtractor::~FieldExtractor()
 {
 	multipart_parser_free(parser_);
 }
 
+bool
+FieldExtractor::ingest(std::string_view chunk)
+{
+	if(!done_)
+		multipart_parser_execute(parser_, chunk.data(), chunk.size());
+
+	return done_;
+}
+
+bool
+FieldExtractor::done() const
+{
+	return done_;
+}
+
+const std::string&
+FieldExtractor::value() const
+{
+	return value_;
+}
+
 void
-MultiPartData::ingest(std::string_view body)
+FieldExtractor::finish_header()
 {
-	multipart_parser_execute(parser_, body.data(), body.size());
+	if(boost::iequals(cur_header_name_, "Content-Disposition"))
+	{
+		auto name = HeaderParams::find(cur_header_value_, "name");
+		matched_ = (name && *name == name_);
+	}
+
+	cur_header_name_.clear();
+	cur_header_value_.clear();
+	in_header_value_ = false;
 }
 
-std::vector<MultiPartSection>
-MultiPartData::get_data()
+int
+FieldExtractor::read_header_name(multipart_parser* p, const char* at, size_t length)
 {
-	return data_;
+	FieldExtractor* fe = static_cast<FieldExtractor*>(multipart_parser_get_data(p));
+	if(fe->in_header_value_)
+		fe->finish_header();
+
+	fe->cur_header_name_.append(at, length);
+	return 0;
 }
 
 int
-MultiPartData::read_header_name(multipart_parser* p, const char* at, size_t length)
+FieldExtractor::read_header_value(multipart_parser* p, const char* at, size_t length)
 {
-	MultiPartData* mp = static_cast<MultiPartData*>(multipart_parser_get_data(p));
-	mp->cur_header_name_.clear();
-	mp->cur_header_name_.assign(at, length);
+	FieldExtractor* fe = static_cast<FieldExtractor*>(multipart_parser_get_data(p));
+	fe->in_header_value_ = true;
+	fe->cur_header_value_.append(at, length);
 	return 0;
 }
 
 int
-MultiPartData::read_header_value(multipart_parser* p, const char* at, size_t length)
+FieldExtractor::read_headers_complete(multipart_parser* p)
 {
-	MultiPartData* mp = static_cast<MultiPartData*>(multipart_parser_get_data(p));
-	std::string v{at, length};
-	mp->cur_header_vals_[mp->cur_header_name_] = MultiPartSection::parse_header_value(v);
+	FieldExtractor* fe = static_cast<FieldExtractor*>(multipart_parser_get_data(p));
+	if(fe->in_header_value_)
+		fe->finish_header();
+
+	return 0;
+}
+
+int
+FieldExtractor::read_body(multipart_parser* p, const char* at, size_t length)
+{
+	FieldExtractor* fe = static_cast<FieldExtractor*>(multipart_parser_get_data(p));
+	if(fe->matched_)
+		fe->value_.append(at, length);
+
 	return 0;
 }
 
 int
-MultiPartData::read_body(multipart_parser* p, const char* at, size_t length)
+FieldExtractor::read_part_begin(multipart_parser* p)
 {
-	MultiPartData* mp = static_cast<MultiPartData*>(multipart_parser_get_data(p));
-	mp->data_.push_back(MultiPartSection{mp->cur_header_vals_, std::string(at, length)});
-	mp->cur_header_vals_.clear();
+	FieldExtractor* fe = static_cast<FieldExtractor*>(multipart_parser_get_data(p));
+	fe->matched_ = false;
+	fe->cur_header_name_.clear();
+	fe->cur_header_value_.clear();
+	fe->in_header_value_ = false;
 	return 0;
 }
 
+int
+FieldExtractor::read_part_end(multipart_parser* p)
+{
+	FieldExtractor* fe = static_cast<FieldExtractor*>(multipart_parser_get_data(p));
+	if(!fe->matched_)
+		return 0;
+
+	// We have what we came for, stop parsing
+	fe->done_ = true;
+	return 1;
+}
+
 } // namespace multipart_wrapper
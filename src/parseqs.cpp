@@ -1,6 +1,11 @@
 #include <boost/algorithm/string.hpp>
 
-#include <sstream>
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
+
+#include <cstring>
+#include <optional>
 #include <stdexcept>
 #include <algorithm>
 #include <iostream>
@@ -57,37 +62,9 @@ split_by_eq(std::string_view str)
 std::string
 unquote(std::string_view str)
 {
-	std::ostringstream unquoted;
-	for(auto i = str.begin(), j = str.end(); i != j; i++)
-	{
-		std::string::value_type c = *i;
-
-		switch(c)
-		{
-		case '%':
-			if(i[1] && i[2])
-			{
-				// If this is hex, we convert it into a char
-				// Otherwise, we silently discard it
-				if(is_hex(i[1]) && is_hex(i[2]))
-				{
-					char h = from_hex(i[1]) << 4 | from_hex(i[2]);
-					unquoted << h;
-				}
-
-				i += 2;
-			}
-			break;
-		case '+':
-			unquoted << ' ';
-			break;
-		default:
-			unquoted << c;
-			break;
-		}
-	}
-
-	return unquoted.str();
+	std::string unquoted(str.size(), '\0');
+	unquoted.resize(unquote_into(str, unquoted.data()));
+	return unquoted;
 }
 
 std::map<std::string, std::string>
@@ -119,4 +96,205 @@ parse_qsl(std::string_view qs, std::size_t maxparams)
 	return qsm;
 }
 
+// Find the first occurrence of either character, 16 bytes at a time where we can
+static inline const char*
+find_either(const char* p, const char* end, char a, char b)
+{
+#if defined(__SSE2__)
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	while(end - p >= 16)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+		if(mask)
+			return p + __builtin_ctz(mask);
+
+		p += 16;
+	}
+#endif // __SSE2__
+
+	for(; p < end; p++)
+	{
+		if(*p == a || *p == b)
+			return p;
+	}
+
+	return end;
+}
+
+query_iterator::query_iterator(std::string_view qs)
+	: rest_(qs)
+	, end_(false)
+{
+	next();
+}
+
+void
+query_iterator::next()
+{
+	while(!rest_.empty())
+	{
+		const char* begin = rest_.data();
+		const char* end = begin + rest_.size();
+
+		// One scan finds the end of the key, and we only look for the
+		// end of the value if there is one.
+		const char* stop = find_either(begin, end, '&', '=');
+		const char* amp = stop;
+		if(stop != end && *stop == '=')
+		{
+			amp = find_either(stop + 1, end, '&', '&');
+			cur_.key = std::string_view(begin, stop - begin);
+			cur_.value = std::string_view(stop + 1, amp - stop - 1);
+		}
+		else
+		{
+			// Only a key was found
+			cur_.key = std::string_view(begin, stop - begin);
+			cur_.value = std::string_view{};
+		}
+
+		if(amp == end)
+			rest_ = std::string_view{};
+		else
+			rest_ = std::string_view(amp + 1, end - amp - 1);
+
+		// Ignore empty pairs
+		if(amp != begin)
+			return;
+	}
+
+	end_ = true;
+}
+
+query_iterator&
+query_iterator::operator++()
+{
+	next();
+	return *this;
+}
+
+query_iterator
+query_iterator::operator++(int)
+{
+	query_iterator it{*this};
+	next();
+	return it;
+}
+
+bool
+query_iterator::operator==(const query_iterator& other) const
+{
+	if(end_ || other.end_)
+		return end_ == other.end_;
+
+	return cur_.key.data() == other.cur_.key.data();
+}
+
+bool
+needs_unquote(std::string_view str)
+{
+	const char* end = str.data() + str.size();
+	return find_either(str.data(), end, '%', '+') != end;
+}
+
+std::size_t
+unquote_into(std::string_view str, char* out)
+{
+	const char* p = str.data();
+	const char* end = p + str.size();
+	char* o = out;
+
+	while(p < end)
+	{
+		// Copy everything up to the next escape in one go
+		const char* special = find_either(p, end, '%', '+');
+		std::memcpy(o, p, special - p);
+		o += special - p;
+		p = special;
+
+		if(p == end)
+			break;
+
+		if(*p == '+')
+		{
+			*o++ = ' ';
+			p++;
+		}
+		else if(end - p >= 3)
+		{
+			// If this is hex, we convert it into a char
+			// Otherwise, we silently discard it
+			if(is_hex(p[1]) && is_hex(p[2]))
+				*o++ = from_hex(p[1]) << 4 | from_hex(p[2]);
+
+			p += 3;
+		}
+		else
+		{
+			// A truncated escape, drop the %
+			p++;
+		}
+	}
+
+	return o - out;
+}
+
+bool
+unquoted_equals(std::string_view encoded, std::string_view plain)
+{
+	const char* p = encoded.data();
+	const char* end = p + encoded.size();
+	std::size_t i = 0;
+
+	while(p < end)
+	{
+		char c;
+		if(*p == '+')
+		{
+			c = ' ';
+			p++;
+		}
+		else if(*p == '%')
+		{
+			if(end - p < 3)
+			{
+				p++;
+				continue;
+			}
+
+			bool valid = is_hex(p[1]) && is_hex(p[2]);
+			c = from_hex(p[1]) << 4 | from_hex(p[2]);
+			p += 3;
+			if(!valid)
+				continue;
+		}
+		else
+		{
+			c = *p++;
+		}
+
+		if(i >= plain.size() || plain[i] != c)
+			return false;
+
+		i++;
+	}
+
+	return i == plain.size();
+}
+
+std::optional<std::string_view>
+find_param(std::string_view qs, std::string_view key)
+{
+	std::optional<std::string_view> found;
+	for(const param& kv : query_string{qs})
+	{
+		if(kv.key.size() >= key.size() && unquoted_equals(kv.key, key))
+			found = kv.value;
+	}
+
+	return found;
+}
+
 } // namespace parseqs
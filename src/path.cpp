@@ -22,7 +22,7 @@ get_mime_type(std::string_view path, const mime_type::MimeTypeMap& mtm)
 		return path.substr(pos);
 	}();
 
-	return mtm.find_filename(filename.data());
+	return mtm.find_filename(filename);
 }
 
 // Append an HTTP rel-path to a local filesystem path.
@@ -0,0 +1,264 @@
+#ifndef BOOST_BEAST_USE_STD_STRING_VIEW
+#	define BOOST_BEAST_USE_STD_STRING_VIEW
+#endif // BOOST_BEAST_USE_STD_STRING_VIEW
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include "range_body.hpp"
+
+namespace range_body
+{
+
+static inline std::string_view
+trim(std::string_view str)
+{
+	while(!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+		str.remove_prefix(1);
+	while(!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+		str.remove_suffix(1);
+	return str;
+}
+
+static std::optional<std::uint64_t>
+parse_number(std::string_view str)
+{
+	if(str.empty())
+		return std::nullopt;
+
+	std::uint64_t n = 0;
+	for(char c : str)
+	{
+		if(c < '0' || c > '9')
+			return std::nullopt;
+		if(n > (std::numeric_limits<std::uint64_t>::max() - 9) / 10)
+			return std::nullopt;
+		n = n * 10 + static_cast<std::uint64_t>(c - '0');
+	}
+
+	return n;
+}
+
+range_result
+parse_range(std::string_view header, std::uint64_t size, std::vector<byte_range>& ranges, std::size_t max_ranges)
+{
+	ranges.clear();
+
+	header = trim(header);
+	if(header.size() < 6 || !boost::iequals(header.substr(0, 6), "bytes="))
+		return range_result::none;
+	header.remove_prefix(6);
+
+	std::size_t count = 0;
+	while(!header.empty())
+	{
+		auto const pos = header.find(',');
+		std::string_view spec = trim(header.substr(0, pos));
+		header = (pos == std::string_view::npos) ? std::string_view{} : header.substr(pos + 1);
+
+		if(spec.empty())
+			continue;
+
+		if(++count > max_ranges)
+			// Don't let anyone make us do silly amounts of work
+			return range_result::none;
+
+		auto const dash = spec.find('-');
+		if(dash == std::string_view::npos)
+			return range_result::none;
+
+		std::string_view first_str = trim(spec.substr(0, dash));
+		std::string_view last_str = trim(spec.substr(dash + 1));
+
+		if(first_str.empty())
+		{
+			// Suffix range, the last n bytes
+			auto n = parse_number(last_str);
+			if(!n)
+				return range_result::none;
+			if(*n == 0 || size == 0)
+				continue;
+
+			ranges.push_back({size - std::min(*n, size), size - 1});
+			continue;
+		}
+
+		auto first = parse_number(first_str);
+		if(!first)
+			return range_result::none;
+
+		std::uint64_t last = size - 1;
+		if(!last_str.empty())
+		{
+			auto l = parse_number(last_str);
+			if(!l || *l < *first)
+				return range_result::none;
+			last = std::min(*l, size - 1);
+		}
+
+		if(*first >= size)
+			continue;
+
+		ranges.push_back({*first, last});
+	}
+
+	if(count == 0)
+		return range_result::none;
+
+	if(ranges.empty())
+		return range_result::unsatisfiable;
+
+	// Coalesce overlapping and adjacent ranges
+	std::sort(ranges.begin(), ranges.end(), [](const byte_range& a, const byte_range& b)
+	{
+		return a.first < b.first;
+	});
+
+	std::size_t out = 0;
+	for(std::size_t i = 1; i < ranges.size(); i++)
+	{
+		if(ranges[i].first <= ranges[out].last + 1)
+			ranges[out].last = std::max(ranges[out].last, ranges[i].last);
+		else
+			ranges[++out] = ranges[i];
+	}
+	ranges.resize(out + 1);
+
+	return range_result::satisfiable;
+}
+
+std::string
+make_boundary()
+{
+	static thread_local std::mt19937_64 mt{std::random_device{}()};
+	static const char hex[] = "0123456789abcdef";
+
+	std::uint64_t n = mt();
+	std::string boundary(16, '0');
+	for(auto& c : boundary)
+	{
+		c = hex[n & 0xf];
+		n >>= 4;
+	}
+
+	return boundary;
+}
+
+void
+file_range_body::value_type::assign(beast::file&& file, byte_range range)
+{
+	file_ = std::move(file);
+	parts_.clear();
+	parts_.push_back({std::string{}, range.first, range.length()});
+	trailer_.clear();
+}
+
+void
+file_range_body::value_type::assign(
+	beast::file&& file,
+	const std::vector<byte_range>& ranges,
+	std::string_view content_type,
+	std::uint64_t total_size,
+	std::string_view boundary)
+{
+	file_ = std::move(file);
+	parts_.clear();
+	parts_.reserve(ranges.size());
+
+	for(auto& range : ranges)
+	{
+		std::string header;
+		header.append("\r\n--").append(boundary);
+		header.append("\r\nContent-Type: ").append(content_type);
+		header.append("\r\nContent-Range: bytes ")
+			.append(std::to_string(range.first)).append("-")
+			.append(std::to_string(range.last)).append("/")
+			.append(std::to_string(total_size));
+		header.append("\r\n\r\n");
+
+		parts_.push_back({std::move(header), range.first, range.length()});
+	}
+
+	trailer_.assign("\r\n--").append(boundary).append("--\r\n");
+}
+
+std::uint64_t
+file_range_body::value_type::size() const
+{
+	std::uint64_t size = trailer_.size();
+	for(auto& p : parts_)
+		size += p.header.size() + p.length;
+
+	return size;
+}
+
+boost::optional<std::pair<file_range_body::writer::const_buffers_type, bool>>
+file_range_body::writer::get(beast::error_code& ec)
+{
+	ec = {};
+
+	while(index_ < body_.parts_.size())
+	{
+		auto& p = body_.parts_[index_];
+
+		if(!header_done_)
+		{
+			header_done_ = true;
+			if(!p.header.empty())
+				return {{const_buffers_type{p.header.data(), p.header.size()}, true}};
+		}
+
+		if(!seeked_)
+		{
+			// Skip straight to the range rather than reading up to it
+			seeked_ = true;
+			remain_ = p.length;
+			body_.file_.seek(p.offset, ec);
+			if(ec)
+				return boost::none;
+		}
+
+		if(remain_ > 0)
+		{
+			auto const amount = static_cast<std::size_t>(
+				std::min<std::uint64_t>(remain_, sizeof(buf_)));
+			auto const nread = body_.file_.read(buf_, amount, ec);
+			if(ec)
+				return boost::none;
+
+			if(nread == 0)
+			{
+				// The file shrank underneath us
+				ec = http::error::short_read;
+				return boost::none;
+			}
+
+			remain_ -= nread;
+			return {{const_buffers_type{buf_, nread}, true}};
+		}
+
+		index_++;
+		header_done_ = false;
+		seeked_ = false;
+	}
+
+	if(!trailer_done_ && !body_.trailer_.empty())
+	{
+		trailer_done_ = true;
+		return {{const_buffers_type{body_.trailer_.data(), body_.trailer_.size()}, false}};
+	}
+
+	return boost::none;
+}
+
+} // namespace range_body
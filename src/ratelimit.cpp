@@ -0,0 +1,411 @@
+#include <syslog.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include <boost/asio/ip/address.hpp>
+
+#include "log.hpp"
+#include "metrics.hpp"
+#include "ratelimit.hpp"
+
+namespace ratelimit
+{
+
+constexpr std::size_t num_shards = 64;
+constexpr std::size_t ways = 8;
+
+struct entry
+{
+	key k{};
+	std::int64_t last = 0;		// When the buckets were last topped up, in ms; 0 if unused
+	float conn_tokens = 0;
+	float req_tokens = 0;
+	std::uint32_t conns = 0;	// Open connections
+};
+
+struct alignas(64) shard
+{
+	std::mutex lock;
+	std::vector<entry> entries;	// sets_per_shard sets of `ways` entries
+};
+
+static std::array<shard, num_shards> shards;
+static std::size_t sets_per_shard = 0;
+
+// Keeps anyone from picking addresses that all land in the same set
+static std::uint64_t seed = 0;
+
+// The limits; a rate of 0 turns that limiter off
+static std::atomic<std::uint32_t> conn_rate{0};
+static std::atomic<std::uint32_t> conn_burst{0};
+static std::atomic<std::uint32_t> max_per_client{0};
+static std::atomic<std::uint32_t> req_rate{0};
+static std::atomic<std::uint32_t> req_burst{0};
+static std::atomic<std::uint32_t> post_cost{1};
+static std::atomic<std::uint32_t> bulk_items{1};
+
+static std::atomic<std::size_t> budget{std::numeric_limits<std::size_t>::max()};
+static std::atomic<std::size_t> max_connections{std::numeric_limits<std::size_t>::max()};
+static std::atomic<std::size_t> open_connections{0};
+
+static thread_local const admission* current_admission = nullptr;
+
+static std::int64_t
+now_ms()
+{
+	// Never 0, which marks an unused entry
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count() + 1;
+}
+
+static std::uint64_t
+mix(std::uint64_t x)
+{
+	// splitmix64's finaliser
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static std::uint64_t
+hash(const key& k)
+{
+	std::uint64_t a, b;
+	std::memcpy(&a, k.data(), 8);
+	std::memcpy(&b, k.data() + 8, 8);
+	return mix(a ^ seed) ^ mix(b + seed);
+}
+
+static key
+make_key(const boost::asio::ip::address& addr)
+{
+	if(addr.is_v4())
+		return boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, addr.to_v4()).to_bytes();
+
+	auto const v6 = addr.to_v6();
+	key k = v6.to_bytes();
+
+	// Anyone with IPv6 has at least a /64 to pick addresses from
+	if(!v6.is_v4_mapped())
+		std::fill(k.begin() + 8, k.end(), 0);
+
+	return k;
+}
+
+static bool
+per_client_limits()
+{
+	return sets_per_shard != 0 && (conn_rate.load(std::memory_order_relaxed) != 0 ||
+		max_per_client.load(std::memory_order_relaxed) != 0 ||
+		req_rate.load(std::memory_order_relaxed) != 0);
+}
+
+static std::uint32_t
+burst_of(std::uint32_t rate, std::uint32_t burst)
+{
+	// A second's worth by default
+	return burst ? burst : rate;
+}
+
+// The set a key belongs in; the shard's lock must be held to use it
+static std::pair<shard&, entry*>
+locate(const key& k)
+{
+	auto const h = hash(k);
+	auto& s = shards[h % num_shards];
+	auto const set = (h / num_shards) % sets_per_shard;
+	return {s, s.entries.data() + set * ways};
+}
+
+static entry*
+find(entry* set, const key& k)
+{
+	for(std::size_t i = 0; i < ways; i++)
+	{
+		if(set[i].last != 0 && set[i].k == k)
+			return &set[i];
+	}
+
+	return nullptr;
+}
+
+// Find a client's entry, making one if needed
+static entry&
+find_or_insert(entry* set, const key& k, std::int64_t now)
+{
+	if(auto e = find(set, k))
+		return *e;
+
+	// Prefer an unused entry, then one with no open connections, then the stalest
+	entry* victim = &set[0];
+	for(std::size_t i = 0; i < ways; i++)
+	{
+		auto& e = set[i];
+		if(e.last == 0)
+		{
+			victim = &e;
+			break;
+		}
+
+		bool const idle = e.conns == 0;
+		bool const victim_idle = victim->conns == 0;
+		if((idle && !victim_idle) || (idle == victim_idle && e.last < victim->last))
+			victim = &e;
+	}
+
+	if(victim->last != 0)
+		metrics::add(metrics::counter::ratelimit_evictions);
+
+	*victim = entry{};
+	victim->k = k;
+	victim->last = now;
+	victim->conn_tokens = static_cast<float>(burst_of(conn_rate, conn_burst));
+	victim->req_tokens = static_cast<float>(burst_of(req_rate, req_burst));
+	return *victim;
+}
+
+static void
+refill(entry& e, std::int64_t now)
+{
+	auto const elapsed = static_cast<float>(now - e.last) / 1000.0f;
+	if(elapsed <= 0)
+		return;
+
+	auto const crate = conn_rate.load(std::memory_order_relaxed);
+	auto const rrate = req_rate.load(std::memory_order_relaxed);
+	e.conn_tokens = std::min(e.conn_tokens + elapsed * static_cast<float>(crate),
+		static_cast<float>(burst_of(crate, conn_burst.load(std::memory_order_relaxed))));
+	e.req_tokens = std::min(e.req_tokens + elapsed * static_cast<float>(rrate),
+		static_cast<float>(burst_of(rrate, req_burst.load(std::memory_order_relaxed))));
+	e.last = now;
+}
+
+void
+init(std::size_t entries)
+{
+	std::random_device rd;
+	seed = (static_cast<std::uint64_t>(rd()) << 32) | rd();
+
+	sets_per_shard = std::max<std::size_t>(1, entries / (num_shards * ways));
+	for(auto& s : shards)
+		s.entries.assign(sets_per_shard * ways, entry{});
+}
+
+void
+set_connection_budget(std::size_t n)
+{
+	budget.store(n, std::memory_order_relaxed);
+}
+
+void
+configure(const server_state::Config& config)
+{
+	auto const limit = budget.load(std::memory_order_relaxed);
+	std::size_t max = limit;
+	if(config.max_connections != 0)
+	{
+		if(config.max_connections > limit)
+			logging::log(LOG_WARNING, "config.maxconnections is more than the file descriptor limit allows; "
+				"using %zu", limit);
+		else
+			max = config.max_connections;
+	}
+	max_connections.store(max, std::memory_order_relaxed);
+
+	auto rburst = burst_of(config.request_rate, config.request_burst);
+	if(config.request_rate != 0 && rburst < config.post_cost)
+	{
+		logging::log(LOG_WARNING, "ratelimit.reqburst is less than ratelimit.postcost, "
+			"so no POST would ever be allowed; using %u", config.post_cost);
+		rburst = config.post_cost;
+	}
+
+	conn_rate.store(config.connection_rate, std::memory_order_relaxed);
+	conn_burst.store(config.connection_burst, std::memory_order_relaxed);
+	max_per_client.store(config.max_connections_per_client, std::memory_order_relaxed);
+	req_rate.store(config.request_rate, std::memory_order_relaxed);
+	req_burst.store(rburst, std::memory_order_relaxed);
+	post_cost.store(std::max<std::uint32_t>(config.post_cost, 1), std::memory_order_relaxed);
+	bulk_items.store(std::max<std::uint32_t>(config.bulk_items, 1), std::memory_order_relaxed);
+}
+
+double
+load()
+{
+	auto const max = max_connections.load(std::memory_order_relaxed);
+	if(max == 0 || max == std::numeric_limits<std::size_t>::max())
+		return 0;
+
+	return std::min(1.0, static_cast<double>(open_connections.load(std::memory_order_relaxed)) /
+		static_cast<double>(max));
+}
+
+std::optional<admission>
+admit(const boost::asio::ip::address& addr)
+{
+	// The global limit keeps us clear of running out of file descriptors
+	if(open_connections.fetch_add(1, std::memory_order_relaxed) >= max_connections.load(std::memory_order_relaxed))
+	{
+		open_connections.fetch_sub(1, std::memory_order_relaxed);
+		metrics::add(metrics::counter::ratelimited_global);
+		return std::nullopt;
+	}
+
+	admission a;
+	a.active_ = true;
+	a.key_ = make_key(addr);
+
+	if(!per_client_limits())
+		return a;
+
+	auto [s, set] = locate(a.key_);
+	auto const now = now_ms();
+
+	std::lock_guard lock{s.lock};
+	auto& e = find_or_insert(set, a.key_, now);
+	refill(e, now);
+
+	if(conn_rate.load(std::memory_order_relaxed) != 0)
+	{
+		if(e.conn_tokens < 1)
+		{
+			metrics::add(metrics::counter::ratelimited_connection_rate);
+			return std::nullopt;
+		}
+		e.conn_tokens -= 1;
+	}
+
+	auto const per_client = max_per_client.load(std::memory_order_relaxed);
+	if(per_client != 0 && e.conns >= per_client)
+	{
+		metrics::add(metrics::counter::ratelimited_client_connections);
+		return std::nullopt;
+	}
+
+	e.conns++;
+	a.tracked_ = true;
+	return a;
+}
+
+admission::admission(admission&& other) noexcept
+	: key_(other.key_)
+	, active_(std::exchange(other.active_, false))
+	, tracked_(std::exchange(other.tracked_, false))
+{
+}
+
+admission&
+admission::operator=(admission&& other) noexcept
+{
+	if(this != &other)
+	{
+		release();
+		key_ = other.key_;
+		active_ = std::exchange(other.active_, false);
+		tracked_ = std::exchange(other.tracked_, false);
+	}
+
+	return *this;
+}
+
+admission::~admission()
+{
+	release();
+}
+
+void
+admission::release()
+{
+	if(active_)
+		open_connections.fetch_sub(1, std::memory_order_relaxed);
+
+	if(tracked_)
+	{
+		auto [s, set] = locate(key_);
+		std::lock_guard lock{s.lock};
+
+		// It may have been evicted, in which case the count went with it
+		if(auto e = find(set, key_); e && e->conns > 0)
+			e->conns--;
+	}
+
+	active_ = false;
+	tracked_ = false;
+}
+
+bool
+admission::allow_request(unsigned cost) const
+{
+	if(!active_ || sets_per_shard == 0 || req_rate.load(std::memory_order_relaxed) == 0)
+		return true;
+
+	auto [s, set] = locate(key_);
+	auto const now = now_ms();
+
+	std::lock_guard lock{s.lock};
+	auto& e = find_or_insert(set, key_, now);
+	refill(e, now);
+
+	if(e.req_tokens < static_cast<float>(cost))
+	{
+		metrics::add(metrics::counter::ratelimited_requests);
+		return false;
+	}
+
+	e.req_tokens -= static_cast<float>(cost);
+	return true;
+}
+
+scope::scope(const admission* a)
+	: prev_(current_admission)
+{
+	current_admission = a;
+}
+
+scope::~scope()
+{
+	current_admission = prev_;
+}
+
+bool
+allow_request(bool is_post)
+{
+	if(!current_admission)
+		return true;
+
+	return current_admission->allow_request(is_post ? post_cost.load(std::memory_order_relaxed) : 1);
+}
+
+bool
+allow_bulk(std::size_t items)
+{
+	if(!current_admission)
+		return true;
+
+	// The first lot was paid for by the request's own POST
+	std::size_t const per_post = bulk_items.load(std::memory_order_relaxed);
+	std::size_t const posts = (items + per_post - 1) / per_post;
+	if(posts <= 1)
+		return true;
+
+	// However long the list, it has to be possible with a full bucket
+	std::size_t const cost = post_cost.load(std::memory_order_relaxed);
+	std::size_t const burst = burst_of(req_rate.load(std::memory_order_relaxed),
+		req_burst.load(std::memory_order_relaxed));
+	std::size_t const room = burst > cost ? burst - cost : 0;
+	return current_admission->allow_request(static_cast<unsigned>(std::min((posts - 1) * cost, room)));
+}
+
+} // namespace ratelimit
@@ -1,156 +1,357 @@
+#include <syslog.h>
+#include <atomic>
+#include <exception>
+#include <filesystem>
+#include <memory>
 #include <optional>
 #include <cstdint>
+#include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ssl/context.hpp>
 
 #include <toml++/toml.h>
 
+#include "certificate.hpp"
+#include "log.hpp"
 #include "server_state.hpp"
 #include "mime.hpp"
+#include "static_cache.hpp"
 
 namespace server_state
 {
 
-// This is a state class passed around to servers to keep the number of parameters low.
-ServerState::ServerState(const toml::table& tbl, const mime_type::MimeTypeMap& mtm)
-	: tbl_(tbl)
-	, mtm_(mtm)
-{
-}
-
-const toml::table& ServerState::get_config_table() const
+// Read a value into out if it's present, leaving the default alone if not.
+// V is the type toml++ converts to, which also does the range checking.
+template<class V, class T>
+static bool
+read_value(const toml::table& tbl, std::string_view section, std::string_view key, T& out)
 {
-	return tbl_;
-}
+	auto node = tbl[section][key];
+	if(!node)
+		return true;
+
+	std::optional<V> value = node.template value<V>();
+	if(!value)
+	{
+		logging::log(LOG_ALERT, "Invalid value for %.*s.%.*s in config file",
+			static_cast<int>(section.size()), section.data(),
+			static_cast<int>(key.size()), key.data());
+		return false;
+	}
 
-const mime_type::MimeTypeMap& ServerState::get_mime_type_map() const
-{
-	return mtm_;
+	out = T(*value);
+	return true;
 }
 
-std::uint32_t ServerState::get_config_threads() const
+// The same, for a key in one of the [[listen]] tables
+template<class V, class T>
+static bool
+read_listen_value(const toml::table& tbl, std::size_t index, std::string_view key, T& out)
 {
-	std::optional<std::uint32_t> cfg_threads = tbl_["config"]["threads"].value<std::uint32_t>();
-	if(!cfg_threads)
-		return 2;
+	auto node = tbl[key];
+	if(!node)
+		return true;
+
+	std::optional<V> value = node.template value<V>();
+	if(!value)
+	{
+		logging::log(LOG_ALERT, "Invalid value for listen[%zu].%.*s in config file",
+			index, static_cast<int>(key.size()), key.data());
+		return false;
+	}
 
-	return *cfg_threads;
+	out = T(*value);
+	return true;
 }
 
-std::string_view ServerState::get_config_address() const
+static std::optional<listen_mode>
+parse_listen_mode(std::string_view mode)
 {
-	std::optional<std::string_view> cfg_address = tbl_["listen"]["ip"].value<std::string_view>();
-	if(!cfg_address)
-		return "0.0.0.0";
-
-	return *cfg_address;
+	if(mode == "auto")
+		return listen_mode::detect;
+	else if(mode == "tls")
+		return listen_mode::tls;
+	else if(mode == "plain")
+		return listen_mode::plain;
+
+	return std::nullopt;
 }
 
-std::uint16_t ServerState::get_config_port() const
+static std::optional<Listen>
+parse_listen(const toml::node& node, std::size_t index)
 {
-	std::optional<std::uint16_t> cfg_port = tbl_["listen"]["port"].value<std::uint16_t>();
-	if(!cfg_port)
-		return 8080;
-
-	return *cfg_port;
+	auto tbl = node.as_table();
+	if(!tbl)
+	{
+		logging::log(LOG_ALERT, "listen[%zu] must be a table", index);
+		return std::nullopt;
+	}
+
+	Listen l;
+	std::string mode = "auto";
+	bool ok = read_listen_value<std::string_view>(*tbl, index, "ip", l.address) &&
+		read_listen_value<std::uint16_t>(*tbl, index, "port", l.port) &&
+		read_listen_value<std::string_view>(*tbl, index, "mode", mode) &&
+		read_listen_value<std::uint32_t>(*tbl, index, "backlog", l.backlog) &&
+		read_listen_value<std::uint32_t>(*tbl, index, "rcvbuf", l.rcvbuf) &&
+		read_listen_value<std::uint32_t>(*tbl, index, "sndbuf", l.sndbuf) &&
+		read_listen_value<bool>(*tbl, index, "nodelay", l.nodelay) &&
+		read_listen_value<bool>(*tbl, index, "keepalive", l.keepalive) &&
+		read_listen_value<bool>(*tbl, index, "reuseport", l.reuseport);
+	if(!ok)
+		return std::nullopt;
+
+	auto m = parse_listen_mode(mode);
+	if(!m)
+	{
+		logging::log(LOG_ALERT, "listen[%zu].mode must be \"auto\", \"tls\" or \"plain\"", index);
+		return std::nullopt;
+	}
+	l.mode = *m;
+
+	return l;
 }
 
-std::uint16_t ServerState::get_config_port2() const
+// Read the listeners from [[listen]], or from the older [listen] table
+static bool
+read_listeners(const toml::table& tbl, Config& config)
 {
-	std::optional<std::uint16_t> cfg_port2 = tbl_["listen"]["port2"].value<std::uint16_t>();
-	if(!cfg_port2)
-		return 0;
+	if(auto arr = tbl["listen"].as_array())
+	{
+		std::size_t index = 0;
+		for(auto& node : *arr)
+		{
+			auto l = parse_listen(node, index++);
+			if(!l)
+				return false;
+
+			config.listeners.push_back(std::move(*l));
+		}
+
+		return true;
+	}
+
+	Listen l;
+	l.port = 8080;
+	std::uint16_t port2 = 0;
+	bool ok = read_value<std::string_view>(tbl, "listen", "ip", l.address) &&
+		read_value<std::uint16_t>(tbl, "listen", "port", l.port) &&
+		read_value<std::uint16_t>(tbl, "listen", "port2", port2) &&
+		read_value<std::uint16_t>(tbl, "listen", "metricsport", config.metrics_port);
+	if(!ok)
+		return false;
+
+	config.listeners.push_back(l);
+	if(port2)
+	{
+		l.port = port2;
+		config.listeners.push_back(l);
+	}
 
-	return *cfg_port2;
+	return true;
 }
 
-std::string_view ServerState::get_config_doc_root() const
+std::optional<Config>
+parse_config(const toml::table& tbl, const std::filesystem::path& base_dir)
 {
-	std::optional<std::string_view> cfg_docroot = tbl_["config"]["docroot"].value<std::string_view>();
-	if(!cfg_docroot)
-		return ".";
-
-	return *cfg_docroot;
+	Config config;
+
+	bool ok = read_listeners(tbl, config) &&
+		read_value<std::uint16_t>(tbl, "config", "metricsport", config.metrics_port) &&
+		read_value<std::uint32_t>(tbl, "config", "threads", config.threads) &&
+		read_value<std::string_view>(tbl, "config", "docroot", config.doc_root) &&
+		read_value<std::string_view>(tbl, "config", "hostname", config.hostname) &&
+		read_value<std::string_view>(tbl, "config", "loglevel", config.log_level) &&
+		read_value<bool>(tbl, "config", "daemon", config.daemon) &&
+		read_value<std::string_view>(tbl, "config", "certfile", config.cert_file) &&
+		read_value<std::string_view>(tbl, "config", "keyfile", config.key_file) &&
+		read_value<std::string_view>(tbl, "config", "dhfile", config.dh_file) &&
+		read_value<std::string_view>(tbl, "config", "user", config.user) &&
+		read_value<std::string_view>(tbl, "config", "group", config.group) &&
+		read_value<std::string_view>(tbl, "config", "dbpath", config.db_path) &&
+		read_value<std::uint32_t>(tbl, "config", "draintimeout", config.drain_timeout) &&
+		read_value<std::uint32_t>(tbl, "config", "slowrequestms", config.slow_request_ms) &&
+		read_value<std::string_view>(tbl, "config", "accesslog", config.access_log) &&
+		read_value<std::uint32_t>(tbl, "config", "logratelimit", config.log_rate_limit) &&
+		read_value<bool>(tbl, "config", "http2", config.http2) &&
+		read_value<std::uint32_t>(tbl, "config", "maxconnections", config.max_connections) &&
+		read_value<std::uint32_t>(tbl, "ratelimit", "connrate", config.connection_rate) &&
+		read_value<std::uint32_t>(tbl, "ratelimit", "connburst", config.connection_burst) &&
+		read_value<std::uint32_t>(tbl, "ratelimit", "maxconnsperclient", config.max_connections_per_client) &&
+		read_value<std::uint32_t>(tbl, "ratelimit", "reqrate", config.request_rate) &&
+		read_value<std::uint32_t>(tbl, "ratelimit", "reqburst", config.request_burst) &&
+		read_value<std::uint32_t>(tbl, "ratelimit", "postcost", config.post_cost) &&
+		read_value<std::uint32_t>(tbl, "ratelimit", "bulkitems", config.bulk_items) &&
+		read_value<std::uint32_t>(tbl, "ratelimit", "entries", config.ratelimit_entries) &&
+		read_value<std::uint32_t>(tbl, "timeouts", "handshake", config.handshake_timeout) &&
+		read_value<std::uint32_t>(tbl, "timeouts", "header", config.header_timeout) &&
+		read_value<std::uint32_t>(tbl, "timeouts", "body", config.body_timeout) &&
+		read_value<std::uint32_t>(tbl, "timeouts", "idle", config.idle_timeout) &&
+		read_value<std::uint32_t>(tbl, "timeouts", "write", config.write_timeout) &&
+		read_value<std::uint32_t>(tbl, "timeouts", "overloadpercent", config.overload_percent) &&
+		read_value<std::uint32_t>(tbl, "bulk", "maxbody", config.bulk_max_body) &&
+		read_value<std::uint32_t>(tbl, "bulk", "maxurls", config.bulk_max_urls) &&
+		read_value<std::uint32_t>(tbl, "filter", "tokens", config.filter_tokens) &&
+		read_value<std::uint32_t>(tbl, "filter", "bitspertoken", config.filter_bits_per_token);
+	if(!ok)
+		return std::nullopt;
+
+	if(config.listeners.empty())
+	{
+		logging::log(LOG_ALERT, "There must be at least one [[listen]] entry");
+		return std::nullopt;
+	}
+
+	for(std::size_t i = 0; i < config.listeners.size(); i++)
+	{
+		auto const& l = config.listeners[i];
+		if(l.port == 0)
+		{
+			logging::log(LOG_ALERT, "listen[%zu].port can't be 0", i);
+			return std::nullopt;
+		}
+
+		boost::system::error_code ec;
+		(void)boost::asio::ip::make_address(l.address, ec);
+		if(ec)
+		{
+			logging::log(LOG_ALERT, "listen[%zu].ip isn't an IP address: %s", i, l.address.c_str());
+			return std::nullopt;
+		}
+	}
+
+	if(config.threads == 0)
+	{
+		logging::log(LOG_ALERT, "config.threads must be at least 1");
+		return std::nullopt;
+	}
+
+	if(config.doc_root.empty())
+	{
+		logging::log(LOG_ALERT, "config.docroot can't be empty");
+		return std::nullopt;
+	}
+
+	if(config.handshake_timeout == 0 || config.header_timeout == 0 || config.body_timeout == 0 ||
+		config.idle_timeout == 0 || config.write_timeout == 0)
+	{
+		logging::log(LOG_ALERT, "Timeouts must be at least 1 second");
+		return std::nullopt;
+	}
+
+	if(config.overload_percent > 100)
+	{
+		logging::log(LOG_ALERT, "timeouts.overloadpercent can't be more than 100");
+		return std::nullopt;
+	}
+
+	if(config.bulk_max_urls == 0)
+	{
+		logging::log(LOG_ALERT, "bulk.maxurls must be at least 1");
+		return std::nullopt;
+	}
+
+	if(config.filter_bits_per_token == 0 || config.filter_bits_per_token > 64)
+	{
+		logging::log(LOG_ALERT, "filter.bitspertoken must be from 1 to 64");
+		return std::nullopt;
+	}
+
+	for(auto* file : {&config.cert_file, &config.key_file, &config.dh_file})
+	{
+		if(!file->empty())
+			*file = (base_dir / *file).lexically_normal().string();
+	}
+
+	return config;
 }
 
-std::string_view ServerState::get_config_hostname() const
+ServerState::ServerState(Config config, mime_type::MimeTypeMap mtm, boost::asio::ssl::context&& ctx)
+	: config_(std::move(config))
+	, mtm_(std::move(mtm))
+	, ssl_ctx_(std::move(ctx))
 {
-	std::optional<std::string_view> cfg_hostname = tbl_["config"]["hostname"].value<std::string_view>();
-	if(!cfg_hostname)
-		return "z6a.info";
-
-	return *cfg_hostname;
 }
 
-std::string_view ServerState::get_config_log_level() const
+const Config& ServerState::config() const
 {
-	std::optional<std::string_view> cfg_loglevel = tbl_["config"]["loglevel"].value<std::string_view>();
-	if(!cfg_loglevel)
-		return "info";
-
-	return *cfg_loglevel;
+	return config_;
 }
 
-bool ServerState::get_config_daemon() const
+const mime_type::MimeTypeMap& ServerState::get_mime_type_map() const
 {
-	std::optional<bool> cfg_daemon = tbl_["config"]["daemon"].value<bool>();
-	if(!cfg_daemon)
-		return false;
-
-	return *cfg_daemon;
+	return mtm_;
 }
 
-std::string_view ServerState::get_config_cert_file() const
+static_cache::StaticCache& ServerState::get_static_cache() const
 {
-	std::optional<std::string_view> cfg_certfile = tbl_["config"]["certfile"].value<std::string_view>();
-	if(!cfg_certfile)
-		return "cert.pem";
-
-	return *cfg_certfile;
+	return static_cache_;
 }
 
-std::string_view ServerState::get_config_key_file() const
+boost::asio::ssl::context& ServerState::get_ssl_context() const
 {
-	std::optional<std::string_view> cfg_keyfile = tbl_["config"]["keyfile"].value<std::string_view>();
-	if(!cfg_keyfile)
-		return "key.pem";
-
-	return *cfg_keyfile;
+	return ssl_ctx_;
 }
 
-std::string_view ServerState::get_config_dh_file() const
+std::shared_ptr<const ServerState>
+load_state(const std::string& config_file, const std::string& mimetypes_file)
 {
-	std::optional<std::string_view> cfg_dhfile = tbl_["config"]["dhfile"].value<std::string_view>();
-	if(!cfg_dhfile)
-		return "dh.pem";
-
-	return *cfg_dhfile;
+	namespace ssl = boost::asio::ssl;
+
+	toml::table tbl;
+	try
+	{
+		tbl = toml::parse_file(config_file);
+	}
+	catch(const toml::parse_error& err)
+	{
+		logging::log(LOG_ALERT, "Parsing of config file failed: %s", err.what());
+		return nullptr;
+	}
+
+	// config_file was made absolute at startup, so this is the directory we started in
+	auto config = parse_config(tbl, std::filesystem::path{config_file}.parent_path());
+	if(!config)
+		return nullptr;
+
+	std::optional<mime_type::MimeTypeMap> mtm;
+	try
+	{
+		mtm.emplace(mimetypes_file);
+	}
+	catch(const std::exception& e)
+	{
+		logging::log(LOG_ALERT, "Could not load MIME types from %s: %s", mimetypes_file.c_str(), e.what());
+		return nullptr;
+	}
+
+	// The SSL context holds the certificates
+	ssl::context ctx{ssl::context::tlsv12};
+	if(!certificate::load_server_certificate(*config, ctx))
+		return nullptr;
+
+	return std::make_shared<const ServerState>(std::move(*config), std::move(*mtm), std::move(ctx));
 }
 
-std::string_view ServerState::get_config_user() const
+StateHolder::StateHolder(std::shared_ptr<const ServerState> state)
+	: state_(std::move(state))
 {
-	std::optional<std::string_view> cfg_user = tbl_["config"]["user"].value<std::string_view>();
-	if(!cfg_user)
-		return "";
-
-	return *cfg_user;
 }
 
-std::string_view ServerState::get_config_group() const
+// The free function overloads are used rather than std::atomic<std::shared_ptr>,
+// which not every standard library has yet
+std::shared_ptr<const ServerState> StateHolder::get() const
 {
-	std::optional<std::string_view> cfg_group = tbl_["config"]["group"].value<std::string_view>();
-	if(!cfg_group)
-		return "";
-
-	return *cfg_group;
+	return std::atomic_load_explicit(&state_, std::memory_order_acquire);
 }
 
-std::string_view ServerState::get_config_db_path() const
+void StateHolder::set(std::shared_ptr<const ServerState> state)
 {
-	std::optional<std::string_view> cfg_dbpath = tbl_["config"]["dbpath"].value<std::string_view>();
-	if(!cfg_dbpath)
-		return "urls.db";
-
-	return *cfg_dbpath;
+	std::atomic_store_explicit(&state_, std::move(state), std::memory_order_release);
 }
 
 } // namespace server_state
@@ -17,11 +17,16 @@
 #	define BOOST_BEAST_USE_STD_STRING_VIEW
 #endif // BOOST_BEAST_USE_STD_STRING_VIEW
 
+#include <sys/socket.h>
+#include <syslog.h>
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -32,9 +37,11 @@
 #include <boost/beast/version.hpp>
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 
+#include "h2_session.hpp"
 #include "log.hpp"
 #include "session.hpp"
 #include "path.hpp"
@@ -50,9 +57,106 @@ using tcp = boost::asio::ip::tcp;	// from <boost/asio/ip/tcp.hpp>
 namespace session
 {
 
+connection_tracker::handle
+connection_tracker::add(std::weak_ptr<connection> conn)
+{
+	std::lock_guard lock{lock_};
+	return connections_.insert(connections_.end(), std::move(conn));
+}
+
+void
+connection_tracker::remove(handle h)
+{
+	std::function<void()> on_empty;
+
+	{
+		std::lock_guard lock{lock_};
+		connections_.erase(h);
+
+		if(!draining())
+			return;
+
+		auto const left = connections_.size();
+		auto const now = std::chrono::steady_clock::now();
+
+		// Don't flood the log when there are lots of connections
+		if(left == 0 || now - last_report_ >= std::chrono::seconds(1))
+		{
+			logging::log(LOG_INFO, "Draining, %zu connections left", left);
+			last_report_ = now;
+		}
+
+		if(left == 0)
+			on_empty = std::move(on_empty_);
+	}
+
+	if(on_empty)
+		on_empty();
+}
+
+std::size_t
+connection_tracker::count() const
+{
+	std::lock_guard lock{lock_};
+	return connections_.size();
+}
+
+void
+connection_tracker::drain(std::function<void()> on_empty)
+{
+	std::vector<std::shared_ptr<connection>> open;
+
+	{
+		std::lock_guard lock{lock_};
+		draining_.store(true, std::memory_order_relaxed);
+
+		logging::log(LOG_INFO, "Draining, %zu connections open", connections_.size());
+		last_report_ = std::chrono::steady_clock::now();
+
+		if(!connections_.empty())
+		{
+			on_empty_ = std::move(on_empty);
+			on_empty = nullptr;
+		}
+
+		open.reserve(connections_.size());
+		for(auto& weak : connections_)
+		{
+			if(auto conn = weak.lock())
+				open.push_back(std::move(conn));
+		}
+	}
+
+	// Nothing was open
+	if(on_empty)
+		return on_empty();
+
+	// Outside the lock, as dropping the last reference removes the connection
+	for(auto& conn : open)
+		conn->drain();
+}
+
+connection_tracker&
+connections()
+{
+	static connection_tracker tracker;
+	return tracker;
+}
+
 // Start the session
 void plain_http_session::run()
 {
+	// Dedicated listeners start us straight from the acceptor's strand
+	net::dispatch(
+		stream_.get_executor(),
+		beast::bind_front_handler(
+			&plain_http_session::on_run,
+			shared_from_this()));
+}
+
+void plain_http_session::on_run()
+{
+	this->track();
 	this->do_read();
 }
 
@@ -83,8 +187,23 @@ void plain_http_session::do_eof()
 // Start the session
 void ssl_http_session::run()
 {
+	// Dedicated listeners start us straight from the acceptor's strand
+	net::dispatch(
+		stream_.get_executor(),
+		beast::bind_front_handler(
+			&ssl_http_session::on_run,
+			shared_from_this()));
+}
+
+void ssl_http_session::on_run()
+{
+	this->track();
+
 	// Set the timeout.
-	beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+	beast::get_lowest_layer(stream_).expires_after(
+		timeouts::deadline(config(), timeouts::stage::handshake));
+
+	handshake_start_ = std::chrono::steady_clock::now();
 
 	// Perform the SSL handshake
 	// Note, this is the buffered version of the handshake.
@@ -112,7 +231,8 @@ beast::ssl_stream<beast::tcp_stream> ssl_http_session::release_stream()
 void ssl_http_session::do_eof()
 {
 	// Set the timeout.
-	beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+	beast::get_lowest_layer(stream_).expires_after(
+		timeouts::deadline(config(), timeouts::stage::handshake));
 
 	// Perform the SSL shutdown
 	stream_.async_shutdown(
@@ -124,11 +244,30 @@ void ssl_http_session::do_eof()
 void ssl_http_session::on_handshake(beast::error_code ec, std::size_t bytes_used)
 {
 	if(ec)
+	{
+		metrics::add(metrics::counter::tls_handshake_failures);
+		timeouts::note(ec, timeouts::stage::handshake);
 		return logging::fail(ec, "handshake");
+	}
+
+	metrics::add(metrics::counter::tls_handshakes);
+	mark(trace::phase::handshaken);
+	metrics::record(metrics::histogram::tls_handshake,
+		static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - handshake_start_).count()));
 
 	// Consume the portion of the buffer used by the handshake
 	buffer_.consume(bytes_used);
 
+#ifdef SHADYURL_HAVE_NGHTTP2
+	// Clients that picked h2 are handed over to an HTTP/2 session
+	if(negotiated_h2(stream_))
+	{
+		std::make_shared<h2_session>(std::move(stream_), std::move(buffer_), state(), release_admission())->run();
+		return;
+	}
+#endif // SHADYURL_HAVE_NGHTTP2
+
 	do_read();
 }
 
@@ -157,12 +296,42 @@ detect_session::run()
 			this->shared_from_this()));
 }
 
+detect_session::~detect_session()
+{
+	if(tracked_)
+		connections().remove(*tracked_);
+}
+
+void
+detect_session::drain()
+{
+	net::dispatch(
+		executor_,
+		[self = shared_from_this()]
+		{
+			// Nothing's been asked of us yet, so don't wait for it
+			if(self->detecting_)
+				self->stream_.cancel();
+		});
+}
+
 void
 detect_session::on_run()
 {
+	tracked_ = connections().add(weak_from_this());
+
+	// A shutdown started before we could be asked to stop
+	if(connections().draining())
+		return;
+
+	trace_ = trace::start();
+	if(trace_)
+		trace_->mark(trace::phase::accepted);
+
 	// Set the timeout.
-	stream_.expires_after(std::chrono::seconds(30));
+	stream_.expires_after(timeouts::deadline(state_->config(), timeouts::stage::handshake));
 
+	detecting_ = true;
 	beast::async_detect_ssl(
 		stream_,
 		buffer_,
@@ -174,17 +343,33 @@ detect_session::on_run()
 void
 detect_session::on_detect(beast::error_code ec, bool result)
 {
+	detecting_ = false;
+
+	// We were cancelled by a shutdown
+	if(ec == net::error::operation_aborted && connections().draining())
+		return;
+
 	if(ec)
+	{
+		timeouts::note(ec, timeouts::stage::handshake);
 		return logging::fail(ec, "detect");
+	}
 
+	if(trace_)
+		trace_->mark(trace::phase::detected);
+
+	// The session we launch tracks itself straight away, as we're already on its strand,
+	// so the tracker never sees the connection go missing
 	if(result)
 	{
-		// Launch SSL session
+		// Launch SSL session, with the certificates this session's state was loaded with
 		std::make_shared<ssl_http_session>(
 			std::move(stream_),
-			ctx_,
+			state_->get_ssl_context(),
 			std::move(buffer_),
-			state_)->run();
+			std::move(state_),
+			std::move(admission_),
+			std::move(trace_))->run();
 		return;
 	}
 
@@ -192,21 +377,176 @@ detect_session::on_detect(beast::error_code ec, bool result)
 	std::make_shared<plain_http_session>(
 		std::move(stream_),
 		std::move(buffer_),
-		state_)->run();
+		std::move(state_),
+		std::move(admission_),
+		std::move(trace_))->run();
+}
+
+void
+metrics_session::run()
+{
+	stream_.expires_after(std::chrono::seconds(30));
+
+	http::async_read(
+		stream_,
+		buffer_,
+		req_,
+		beast::bind_front_handler(
+			&metrics_session::on_read,
+			shared_from_this()));
+}
+
+void
+metrics_session::on_read(beast::error_code ec, std::size_t bytes_transferred)
+{
+	boost::ignore_unused(bytes_transferred);
+
+	if(ec)
+		return logging::fail(ec, "metrics read");
+
+	if(req_.method() == http::verb::get && req_.target() == "/metrics")
+	{
+		res_.result(http::status::ok);
+		res_.set(http::field::content_type, "text/plain; version=0.0.4");
+		res_.body() = metrics::render();
+	}
+	else if(req_.method() == http::verb::get && req_.target() == "/trace")
+	{
+		// Slow requests, for chrome://tracing or Perfetto
+		res_.result(http::status::ok);
+		res_.set(http::field::content_type, "application/json");
+		res_.body() = trace::chrome_json();
+	}
+	else
+	{
+		res_.result(http::status::not_found);
+		res_.set(http::field::content_type, "text/plain");
+		res_.body() = "Not found\n";
+	}
+
+	// One scrape per connection keeps this simple
+	res_.version(req_.version());
+	res_.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+	res_.keep_alive(false);
+	res_.prepare_payload();
+
+	http::async_write(
+		stream_,
+		res_,
+		beast::bind_front_handler(
+			&metrics_session::on_write,
+			shared_from_this()));
+}
+
+void
+metrics_session::on_write(beast::error_code ec, std::size_t bytes_transferred)
+{
+	boost::ignore_unused(bytes_transferred);
+
+	if(ec)
+		return logging::fail(ec, "metrics write");
+
+	stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+}
+
+metrics_listener::metrics_listener(net::io_context& ioc, tcp::endpoint endpoint)
+	: ioc_(ioc)
+	, acceptor_(net::make_strand(ioc))
+{
+	beast::error_code ec;
+
+	acceptor_.open(endpoint.protocol(), ec);
+	if(!ec)
+		acceptor_.set_option(net::socket_base::reuse_address(true), ec);
+	if(!ec)
+		acceptor_.bind(endpoint, ec);
+	if(!ec)
+		acceptor_.listen(net::socket_base::max_listen_connections, ec);
+	if(ec)
+		logging::fail(ec, "metrics listen");
+}
+
+metrics_listener::metrics_listener(
+	net::io_context& ioc,
+	tcp::endpoint endpoint,
+	tcp::acceptor::native_handle_type fd)
+	: ioc_(ioc)
+	, acceptor_(net::make_strand(ioc))
+{
+	beast::error_code ec;
+
+	acceptor_.assign(endpoint.protocol(), fd, ec);
+	if(ec)
+		logging::fail(ec, "metrics assign");
+}
+
+void
+metrics_listener::run()
+{
+	do_accept();
+}
+
+void
+metrics_listener::stop()
+{
+	net::post(
+		acceptor_.get_executor(),
+		[self = shared_from_this()]
+		{
+			beast::error_code ec;
+			self->acceptor_.close(ec);
+		});
+}
+
+tcp::acceptor::native_handle_type
+metrics_listener::native_handle()
+{
+	return acceptor_.native_handle();
+}
+
+void
+metrics_listener::do_accept()
+{
+	acceptor_.async_accept(
+		net::make_strand(ioc_),
+		beast::bind_front_handler(
+			&metrics_listener::on_accept,
+			shared_from_this()));
+}
+
+void
+metrics_listener::on_accept(beast::error_code ec, tcp::socket socket)
+{
+	if(!acceptor_.is_open())
+		return;
+
+	if(ec)
+		logging::fail(ec, "metrics accept");
+	else
+		std::make_shared<metrics_session>(std::move(socket))->run();
+
+	do_accept();
+}
+
+tcp::endpoint
+listen_endpoint(const server_state::Listen& l)
+{
+	return {net::ip::make_address(l.address), l.port};
 }
 
 // Accepts incoming connections and launches the sessions
 listener::listener(
 	net::io_context& ioc,
-	ssl::context& ctx,
-	tcp::endpoint endpoint,
-	const server_state::ServerState& state)
+	const server_state::Listen& options,
+	const server_state::StateHolder& state)
 	: ioc_(ioc)
-	, ctx_(ctx)
 	, acceptor_(net::make_strand(ioc))
+	, options_(options)
 	, state_(state)
+	, backoff_(acceptor_.get_executor())
 {
 	beast::error_code ec;
+	auto const endpoint = listen_endpoint(options_);
 
 	// Open the acceptor
 	acceptor_.open(endpoint.protocol(), ec);
@@ -224,6 +564,20 @@ listener::listener(
 		return;
 	}
 
+	// Let several processes share the port, with the kernel spreading connections between them
+	if(options_.reuseport)
+	{
+		int one = 1;
+		if(setsockopt(acceptor_.native_handle(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+		{
+			logging::fail(beast::error_code(errno, boost::system::system_category()), "setsockopt");
+			return;
+		}
+	}
+
+	// Before listen(), so the window scale offered to clients allows for them
+	set_buffer_sizes();
+
 	// Bind to the server address
 	acceptor_.bind(endpoint, ec);
 	if(ec)
@@ -234,7 +588,7 @@ listener::listener(
 
 	// Start listening for connections
 	acceptor_.listen(
-		net::socket_base::max_listen_connections, ec);
+		options_.backlog ? static_cast<int>(options_.backlog) : net::socket_base::max_listen_connections, ec);
 	if(ec)
 	{
 		logging::fail(ec, "listen");
@@ -242,6 +596,50 @@ listener::listener(
 	}
 }
 
+listener::listener(
+	net::io_context& ioc,
+	const server_state::Listen& options,
+	tcp::acceptor::native_handle_type fd,
+	const server_state::StateHolder& state)
+	: ioc_(ioc)
+	, acceptor_(net::make_strand(ioc))
+	, options_(options)
+	, state_(state)
+	, backoff_(acceptor_.get_executor())
+{
+	beast::error_code ec;
+
+	acceptor_.assign(listen_endpoint(options_).protocol(), fd, ec);
+	if(ec)
+	{
+		logging::fail(ec, "assign");
+		return;
+	}
+
+	set_buffer_sizes();
+}
+
+// Accepted sockets inherit these from the listening socket
+void
+listener::set_buffer_sizes()
+{
+	beast::error_code ec;
+
+	if(options_.rcvbuf)
+	{
+		acceptor_.set_option(net::socket_base::receive_buffer_size(static_cast<int>(options_.rcvbuf)), ec);
+		if(ec)
+			logging::fail(ec, "set_option");
+	}
+
+	if(options_.sndbuf)
+	{
+		acceptor_.set_option(net::socket_base::send_buffer_size(static_cast<int>(options_.sndbuf)), ec);
+		if(ec)
+			logging::fail(ec, "set_option");
+	}
+}
+
 // Start accepting incoming connections
 void
 listener::run()
@@ -249,6 +647,25 @@ listener::run()
 	do_accept();
 }
 
+void
+listener::stop()
+{
+	net::post(
+		acceptor_.get_executor(),
+		[self = shared_from_this()]
+		{
+			beast::error_code ec;
+			self->acceptor_.close(ec);
+			self->backoff_.cancel();
+		});
+}
+
+tcp::acceptor::native_handle_type
+listener::native_handle()
+{
+	return acceptor_.native_handle();
+}
+
 void
 listener::do_accept()
 {
@@ -263,20 +680,97 @@ listener::do_accept()
 void
 listener::on_accept(beast::error_code ec, tcp::socket socket)
 {
+	// We've been stopped
+	if(!acceptor_.is_open())
+		return;
+
+	if(ec == net::error::no_descriptors || ec == boost::system::errc::too_many_files_open_in_system)
+	{
+		// Accepting again straight away would just spin; give connections a chance to close
+		logging::fail(ec, "accept");
+		backoff_.expires_after(std::chrono::milliseconds(50));
+		backoff_.async_wait(
+			beast::bind_front_handler(
+				&listener::on_backoff,
+				shared_from_this()));
+		return;
+	}
+
 	if(ec)
 	{
 		logging::fail(ec, "accept");
 	}
 	else
 	{
-		// Create the detector http_session and run it
+		beast::error_code remote_ec;
+		auto const remote = socket.remote_endpoint(remote_ec);
+
+		// Connections over the limits are closed straight away, which is as cheap as it gets
+		std::optional<ratelimit::admission> admission;
+		if(!remote_ec)
+			admission = ratelimit::admit(remote.address());
+
+		if(admission)
+			launch(std::move(socket), std::move(*admission));
+	}
+
+	// Accept another connection
+	do_accept();
+}
+
+// Start a session on a new connection.
+// It takes whatever state is current now and keeps it.
+void
+listener::launch(tcp::socket&& socket, ratelimit::admission admission)
+{
+	beast::error_code ec;
+	if(options_.nodelay)
+		socket.set_option(tcp::no_delay(true), ec);
+	if(options_.keepalive)
+		socket.set_option(net::socket_base::keep_alive(true), ec);
+
+	if(options_.mode == server_state::listen_mode::detect)
+	{
 		std::make_shared<detect_session>(
 			std::move(socket),
-			ctx_,
-			state_)->run();
+			state_.get(),
+			std::move(admission))->run();
+		return;
 	}
 
-	// Accept another connection
+	// Dedicated ports know what's coming, so there's no need to sniff for it
+	auto trace = trace::start();
+	if(trace)
+		trace->mark(trace::phase::accepted);
+
+	auto state = state_.get();
+	if(options_.mode == server_state::listen_mode::tls)
+	{
+		auto& ctx = state->get_ssl_context();
+		std::make_shared<ssl_http_session>(
+			beast::tcp_stream(std::move(socket)),
+			ctx,
+			buffer_pool::flat_buffer{},
+			std::move(state),
+			std::move(admission),
+			std::move(trace))->run();
+		return;
+	}
+
+	std::make_shared<plain_http_session>(
+		beast::tcp_stream(std::move(socket)),
+		buffer_pool::flat_buffer{},
+		std::move(state),
+		std::move(admission),
+		std::move(trace))->run();
+}
+
+void
+listener::on_backoff(beast::error_code ec)
+{
+	if(ec || !acceptor_.is_open())
+		return;
+
 	do_accept();
 }
 
@@ -0,0 +1,237 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "compress.hpp"
+#include "log.hpp"
+#include "mime.hpp"
+#include "path.hpp"
+#include "static_cache.hpp"
+
+namespace static_cache
+{
+
+std::shared_ptr<const std::string>
+Variants::get(compression::encoding enc) const
+{
+	switch(enc)
+	{
+	case compression::encoding::gzip:
+		return gzip;
+	case compression::encoding::brotli:
+		return brotli;
+	default:
+		return identity;
+	}
+}
+
+bool
+FileEntry::has(compression::encoding enc) const
+{
+	return is_sibling(enc) || variants.get(enc);
+}
+
+bool
+FileEntry::is_sibling(compression::encoding enc) const
+{
+	switch(enc)
+	{
+	case compression::encoding::gzip:
+		return gzip_sibling;
+	case compression::encoding::brotli:
+		return brotli_sibling;
+	default:
+		return false;
+	}
+}
+
+bool
+FileEntry::is_negotiable() const
+{
+	return has(compression::encoding::gzip) || has(compression::encoding::brotli);
+}
+
+// Returns true if a usable precompressed sibling exists for the file
+static std::int64_t
+mtime_of(const struct stat& st)
+{
+	return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+static bool
+has_sibling(const std::string& path, compression::encoding enc, std::int64_t mtime)
+{
+	std::string sibling{path};
+	sibling.append(compression::encoding_suffix(enc));
+
+	struct stat st;
+	if(stat(sibling.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	// A sibling older than the original is stale
+	return mtime_of(st) >= mtime;
+}
+
+// Read a whole file without disturbing its offset
+static bool
+read_fd(int fd, std::string& out, std::uint64_t size)
+{
+	out.resize(size);
+
+	std::uint64_t done = 0;
+	while(done < size)
+	{
+		ssize_t n = pread(fd, out.data() + done, size - done, static_cast<off_t>(done));
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+
+		done += static_cast<std::uint64_t>(n);
+	}
+
+	return true;
+}
+
+// Keep a compressed copy only if it actually saves something
+static std::shared_ptr<const std::string>
+keep_if_smaller(std::optional<std::string>&& compressed, std::size_t size)
+{
+	if(!compressed || compressed->size() >= size)
+		return nullptr;
+
+	return std::make_shared<const std::string>(std::move(*compressed));
+}
+
+std::shared_ptr<const FileEntry>
+StaticCache::make_file(const std::string& path, int fd, std::int64_t mtime, std::uint64_t size,
+	const mime_type::MimeTypeMap& mtm)
+{
+	auto entry = std::make_shared<FileEntry>();
+	entry->mtime = mtime;
+	entry->size = size;
+	entry->mime_type = pathutil::get_mime_type(path, mtm);
+	entry->gzip_sibling = has_sibling(path, compression::encoding::gzip, mtime);
+	entry->brotli_sibling = has_sibling(path, compression::encoding::brotli, mtime);
+
+	bool want_gzip = !entry->gzip_sibling;
+	bool want_brotli = !entry->brotli_sibling;
+	if((want_gzip || want_brotli) && size > 0 && size <= max_compress_size && compression::is_compressible(entry->mime_type))
+	{
+		std::string data;
+		if(read_fd(fd, data, size))
+		{
+			if(want_gzip)
+				entry->variants.gzip = keep_if_smaller(compression::gzip(data), data.size());
+			if(want_brotli)
+				entry->variants.brotli = keep_if_smaller(compression::brotli(data), data.size());
+		}
+		else
+		{
+			logging::log(LOG_WARNING, "Could not read %s for compression: %s", path.c_str(), strerror(errno));
+		}
+	}
+
+	return entry;
+}
+
+std::shared_ptr<const FileEntry>
+StaticCache::get_file(const std::string& path, int fd, const mime_type::MimeTypeMap& mtm)
+{
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+		return nullptr;
+
+	auto const mtime = mtime_of(st);
+	auto const size = static_cast<std::uint64_t>(st.st_size);
+	auto const current = [&](const auto& e) { return e.mtime == mtime && e.size == size; };
+
+	{
+		std::shared_lock lock{lock_};
+		auto it = files_.find(path);
+		if(it != files_.end() && current(*it->second))
+			return it->second;
+	}
+
+	// Only one request builds an entry; any others for the same file wait for it
+	std::promise<std::shared_ptr<const FileEntry>> promise;
+	{
+		std::unique_lock lock{lock_};
+		auto it = files_.find(path);
+		if(it != files_.end() && current(*it->second))
+			return it->second;
+
+		auto b = building_.find(path);
+		if(b != building_.end() && current(b->second))
+		{
+			auto entry = b->second.entry;
+			lock.unlock();
+			return entry.get();
+		}
+
+		building_.insert_or_assign(path, Building{mtime, size, promise.get_future().share()});
+	}
+
+	// A newer version of the file may have started building meanwhile; leave that one be
+	auto finish = [&](const std::shared_ptr<const FileEntry>& entry)
+	{
+		std::unique_lock lock{lock_};
+		auto b = building_.find(path);
+		if(b != building_.end() && current(b->second))
+			building_.erase(b);
+		if(entry)
+			files_[path] = entry;
+	};
+
+	std::shared_ptr<const FileEntry> entry;
+	try
+	{
+		entry = make_file(path, fd, mtime, size, mtm);
+	}
+	catch(...)
+	{
+		promise.set_exception(std::current_exception());
+		finish(nullptr);
+		throw;
+	}
+
+	promise.set_value(entry);
+	finish(entry);
+	return entry;
+}
+
+std::shared_ptr<const Variants>
+StaticCache::make_page(std::string&& rendered)
+{
+	auto page = std::make_shared<Variants>();
+	std::size_t const size = rendered.size();
+
+	page->gzip = keep_if_smaller(compression::gzip(rendered), size);
+	page->brotli = keep_if_smaller(compression::brotli(rendered), size);
+	page->identity = std::make_shared<const std::string>(std::move(rendered));
+	return page;
+}
+
+void
+StaticCache::clear()
+{
+	std::unique_lock lock{lock_};
+	files_.clear();
+	pages_.clear();
+}
+
+} // namespace static_cache
@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <chrono>
+
+#include <boost/beast/core/error.hpp>
+
+#include "metrics.hpp"
+#include "ratelimit.hpp"
+#include "timeouts.hpp"
+
+namespace timeouts
+{
+
+// Overload never cuts a deadline shorter than this
+constexpr std::chrono::steady_clock::duration min_deadline = std::chrono::seconds(1);
+
+static std::chrono::steady_clock::duration
+configured(const server_state::Config& config, stage s)
+{
+	switch(s)
+	{
+	case stage::handshake:
+		return std::chrono::seconds(config.handshake_timeout);
+	case stage::header:
+		return std::chrono::seconds(config.header_timeout);
+	case stage::body:
+		return std::chrono::seconds(config.body_timeout);
+	case stage::idle:
+		return std::chrono::seconds(config.idle_timeout);
+	case stage::write:
+	case stage::count_:
+		break;
+	}
+
+	return std::chrono::seconds(config.write_timeout);
+}
+
+std::chrono::steady_clock::duration
+deadline(const server_state::Config& config, stage s)
+{
+	auto const full = configured(config, s);
+
+	// Only connections that aren't doing anything useful yet are squeezed
+	if(s != stage::idle && s != stage::handshake)
+		return full;
+
+	auto const threshold = static_cast<double>(config.overload_percent) / 100.0;
+	if(threshold <= 0 || threshold >= 1)
+		return full;
+
+	auto const load = ratelimit::load();
+	if(load <= threshold)
+		return full;
+
+	// Shrink linearly, down to the floor at the limit
+	auto const left = std::max(0.0, 1.0 - (load - threshold) / (1.0 - threshold));
+	auto const scaled = std::chrono::duration_cast<std::chrono::steady_clock::duration>(full * left);
+	return std::clamp(scaled, std::min(full, min_deadline), full);
+}
+
+void
+note(const boost::system::error_code& ec, stage s)
+{
+	static constexpr metrics::counter counters[] = {
+		metrics::counter::timeouts_handshake,
+		metrics::counter::timeouts_header,
+		metrics::counter::timeouts_body,
+		metrics::counter::timeouts_idle,
+		metrics::counter::timeouts_write,
+	};
+	static_assert(std::size(counters) == static_cast<std::size_t>(stage::count_));
+
+	if(ec == boost::beast::error::timeout)
+		metrics::add(counters[static_cast<std::size_t>(s)]);
+}
+
+} // namespace timeouts
@@ -0,0 +1,303 @@
+#include <syslog.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <sqlite3.h>
+
+#include "generate.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "sqlite_helper.hpp"
+#include "token_filter.hpp"
+
+namespace token_filter
+{
+
+struct filter
+{
+	std::unique_ptr<std::atomic<std::uint64_t>[]> words;
+	std::uint64_t bits = 0;
+	unsigned probes = 0;
+	std::string db_path;
+
+	// Off if the database has tokens in it that we didn't make
+	std::atomic<bool> check_shape{true};
+
+	// Catching up on tokens stored by other connections, ours or another process's.
+	// data_version changes whenever another connection commits. Rowids only go up,
+	// unless the newest row is deleted: then its rowid is free to be given out again.
+	std::mutex sync_lock;
+	sqlite_helper::sqlite3_handle db;
+	sqlite3_stmt* version = nullptr;
+	sqlite3_stmt* newer = nullptr;
+	sqlite3_stmt* newest = nullptr;
+	sqlite3_int64 data_version = -1;
+	sqlite3_int64 last_rowid = 0;
+	std::string last_token;
+};
+
+// Set up before any connections are accepted, and never torn down
+static filter the_filter;
+static bool enabled = false;
+
+// Each thread watches data_version on a connection of its own, so a miss only
+// takes sync_lock when someone else has committed since that thread last caught up
+struct watcher
+{
+	sqlite_helper::sqlite3_handle db;
+	sqlite3_stmt* version = nullptr;
+	sqlite3_int64 seen = -1;
+
+	~watcher()
+	{
+		sqlite3_finalize(version);
+	}
+};
+
+static thread_local watcher this_thread;
+
+// PRAGMA data_version, or -1 if it couldn't be read
+static sqlite3_int64
+data_version(sqlite3_stmt* version)
+{
+	int const rc = sqlite3_step(version);
+	sqlite3_int64 const v = rc == SQLITE_ROW ? sqlite3_column_int64(version, 0) : -1;
+	sqlite3_reset(version);
+	return v;
+}
+
+static std::uint64_t
+mix(std::uint64_t h)
+{
+	// MurmurHash3's finaliser
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Each probe is h1 + i * h2, mapped onto the bits without a division
+template<class F>
+static bool
+for_each_bit(std::string_view token, F&& f)
+{
+	std::uint64_t h = 0xcbf29ce484222325ULL;	// FNV-1a
+	for(unsigned char c : token)
+	{
+		h ^= c;
+		h *= 0x100000001b3ULL;
+	}
+
+	std::uint64_t const h1 = mix(h);
+	std::uint64_t const h2 = mix(h1 ^ 0x9e3779b97f4a7c15ULL) | 1;
+	for(unsigned i = 0; i < the_filter.probes; i++)
+	{
+		auto const bit = static_cast<std::uint64_t>(
+			(static_cast<unsigned __int128>(h1 + i * h2) * the_filter.bits) >> 64);
+		if(!f(the_filter.words[bit >> 6], std::uint64_t{1} << (bit & 63)))
+			return false;
+	}
+
+	return true;
+}
+
+static void
+insert(std::string_view token)
+{
+	for_each_bit(token, [](std::atomic<std::uint64_t>& word, std::uint64_t mask)
+	{
+		word.fetch_or(mask, std::memory_order_release);
+		return true;
+	});
+
+	if(!generate::looks_generated(token))
+		the_filter.check_shape.store(false, std::memory_order_relaxed);
+}
+
+static bool
+test(std::string_view token)
+{
+	return for_each_bit(token, [](const std::atomic<std::uint64_t>& word, std::uint64_t mask)
+	{
+		return (word.load(std::memory_order_acquire) & mask) != 0;
+	});
+}
+
+// Add anything stored since we last looked; call with sync_lock held.
+// Returns false if the database couldn't be read, e.g. it's locked by a writer.
+static bool
+catch_up(std::size_t* loaded = nullptr)
+{
+	// Read before the new rows, so anything committed in between is caught next time
+	sqlite3_int64 const version = data_version(the_filter.version);
+	if(version < 0)
+		return false;
+
+	if(version == the_filter.data_version)
+		return true;
+
+	int rc;
+
+	// If the newest row we've seen has gone, max(rowid) went down and the rows after it may
+	// reuse rowids we've been past. Bits can't be taken out, so load every row again.
+	if(the_filter.last_rowid > 0)
+	{
+		sqlite3_bind_int64(the_filter.newest, 1, the_filter.last_rowid);
+		rc = sqlite3_step(the_filter.newest);
+		bool const same = rc == SQLITE_ROW &&
+			std::string_view{reinterpret_cast<const char*>(sqlite3_column_text(the_filter.newest, 0)),
+				static_cast<std::size_t>(sqlite3_column_bytes(the_filter.newest, 0))} == the_filter.last_token;
+		sqlite3_reset(the_filter.newest);
+		if(rc != SQLITE_ROW && rc != SQLITE_DONE)
+			return false;
+
+		if(!same)
+		{
+			logging::log(LOG_INFO, "Tokens were deleted from the database; reloading the token filter");
+			the_filter.last_rowid = 0;
+			the_filter.last_token.clear();
+		}
+	}
+
+	sqlite3_bind_int64(the_filter.newer, 1, the_filter.last_rowid);
+	while((rc = sqlite3_step(the_filter.newer)) == SQLITE_ROW)
+	{
+		auto const rowid = sqlite3_column_int64(the_filter.newer, 0);
+		std::string_view token{reinterpret_cast<const char*>(sqlite3_column_text(the_filter.newer, 1)),
+			static_cast<std::size_t>(sqlite3_column_bytes(the_filter.newer, 1))};
+
+		insert(token);
+		if(rowid > the_filter.last_rowid)
+		{
+			the_filter.last_rowid = rowid;
+			the_filter.last_token = token;
+		}
+		if(loaded)
+			++*loaded;
+	}
+	sqlite3_reset(the_filter.newer);
+
+	if(rc != SQLITE_DONE)
+		return false;
+
+	the_filter.data_version = version;
+	return true;
+}
+
+bool
+init(const std::string& db_path, std::size_t tokens, unsigned bits_per_token)
+{
+	if(tokens == 0)
+		return true;
+
+	the_filter.db = sqlite_helper::make_sqlite3_handle(db_path.c_str());
+	auto* db = the_filter.db.get();
+	if(!db ||
+		sqlite3_prepare_v2(db, "PRAGMA data_version;", -1, &the_filter.version, nullptr) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "SELECT rowid, token FROM urls WHERE rowid > ?;",
+			-1, &the_filter.newer, nullptr) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "SELECT token FROM urls WHERE rowid = ?;",
+			-1, &the_filter.newest, nullptr) != SQLITE_OK)
+	{
+		logging::log(LOG_ALERT, "Could not set up the token filter: %s",
+			db ? sqlite3_errmsg(db) : "could not open the database");
+		return false;
+	}
+
+	// About 1% false positives at 10 bits a token
+	bits_per_token = std::max(bits_per_token, 1u);
+	std::uint64_t const words = (static_cast<std::uint64_t>(tokens) * bits_per_token + 63) / 64;
+	the_filter.words = std::make_unique<std::atomic<std::uint64_t>[]>(words);
+	the_filter.bits = words * 64;
+	the_filter.probes = std::clamp(static_cast<unsigned>(std::lround(bits_per_token * std::log(2.0))), 1u, 16u);
+	the_filter.db_path = db_path;
+
+	std::size_t loaded = 0;
+	std::lock_guard lock{the_filter.sync_lock};
+	if(!catch_up(&loaded))
+	{
+		logging::log(LOG_ALERT, "Could not load tokens into the token filter: %s", sqlite3_errmsg(db));
+		return false;
+	}
+
+	if(loaded > tokens)
+	{
+		logging::log(LOG_WARNING, "The database has %zu tokens but filter.tokens is %zu; "
+			"raise it to keep false positives down", loaded, tokens);
+	}
+
+	if(!the_filter.check_shape.load(std::memory_order_relaxed))
+	{
+		logging::log(LOG_NOTICE, "Some tokens in the database don't look like ours, "
+			"so tokens of any shape will be looked up");
+	}
+
+	enabled = true;
+	return true;
+}
+
+void
+add(std::string_view token)
+{
+	if(enabled)
+		insert(token);
+}
+
+bool
+may_contain(const std::string& db_path, std::string_view token)
+{
+	// A reload may have pointed us at another database
+	if(!enabled || db_path != the_filter.db_path)
+		return true;
+
+	if(the_filter.check_shape.load(std::memory_order_relaxed) && !generate::looks_generated(token))
+	{
+		metrics::add(metrics::counter::lookups_skipped_shape);
+		return false;
+	}
+
+	if(test(token))
+		return true;
+
+	// Before turning it away, make sure it wasn't just stored by someone else.
+	// If we can't tell, let the database answer.
+	auto& w = this_thread;
+	if(!w.version)
+	{
+		w.db = sqlite_helper::make_sqlite3_handle(the_filter.db_path.c_str());
+		if(!w.db || sqlite3_prepare_v2(w.db.get(), "PRAGMA data_version;", -1, &w.version, nullptr) != SQLITE_OK)
+		{
+			w.db.reset();
+			return true;
+		}
+	}
+
+	auto const version = data_version(w.version);
+	if(version < 0)
+		return true;
+
+	// Nothing's been committed since this thread last caught up
+	if(version != w.seen)
+	{
+		std::lock_guard lock{the_filter.sync_lock};
+		if(!catch_up())
+			return true;
+
+		w.seen = version;
+		if(test(token))
+			return true;
+	}
+
+	metrics::add(metrics::counter::lookups_skipped_filter);
+	return false;
+}
+
+} // namespace token_filter
@@ -0,0 +1,248 @@
+#include <syslog.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "log.hpp"
+#include "trace.hpp"
+
+namespace trace
+{
+
+// 0 means tracing is off
+static std::atomic<std::uint64_t> slow_ns{0};
+
+static thread_local request_trace* current_trace = nullptr;
+
+// The most recent slow requests
+static std::mutex ring_lock;
+static std::array<request_trace, 128> ring;
+static std::size_t ring_next = 0;
+static std::size_t ring_count = 0;
+
+// Slow request logging is limited to this many lines a second
+static constexpr unsigned max_logged_per_second = 10;
+static std::atomic<std::int64_t> log_second{0};
+static std::atomic<unsigned> logged_this_second{0};
+
+void
+configure(std::uint32_t slow_ms)
+{
+	slow_ns.store(static_cast<std::uint64_t>(slow_ms) * 1000000, std::memory_order_relaxed);
+}
+
+bool
+enabled()
+{
+	return slow_ns.load(std::memory_order_relaxed) != 0;
+}
+
+std::unique_ptr<request_trace>
+start()
+{
+	if(!enabled())
+		return nullptr;
+
+	return std::make_unique<request_trace>();
+}
+
+request_trace*
+current()
+{
+	return current_trace;
+}
+
+scope::scope(request_trace* t)
+	: prev_(current_trace)
+{
+	current_trace = t;
+}
+
+scope::~scope()
+{
+	current_trace = prev_;
+}
+
+// Milliseconds between two phases, or -1 if either didn't happen
+static double
+span(const request_trace& t, phase from, phase to)
+{
+	auto const a = t.get(from);
+	auto const b = t.get(to);
+	if(a == 0 || b == 0 || b < a)
+		return -1;
+
+	return static_cast<double>(b - a) / 1e6;
+}
+
+// Where the request's own time starts: the accept for the first one on a connection,
+// otherwise when its first byte arrived
+static phase
+first_phase(const request_trace& t)
+{
+	if(t.get(phase::accepted))
+		return phase::accepted;
+	if(t.get(phase::arrived))
+		return phase::arrived;
+	return phase::header_read;
+}
+
+static std::uint64_t
+start_of(const request_trace& t)
+{
+	return t.get(first_phase(t));
+}
+
+// The last phase before the header started arriving
+static phase
+connection_phase(const request_trace& t)
+{
+	if(t.get(phase::arrived))
+		return phase::arrived;
+	if(t.get(phase::handshaken))
+		return phase::handshaken;
+	if(t.get(phase::detected))
+		return phase::detected;
+	return phase::accepted;
+}
+
+static bool
+should_log()
+{
+	auto const now = std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+
+	auto second = log_second.load(std::memory_order_relaxed);
+	if(second != now && log_second.compare_exchange_strong(second, now, std::memory_order_relaxed))
+	{
+		auto const suppressed = logged_this_second.exchange(0, std::memory_order_relaxed);
+		if(suppressed > max_logged_per_second)
+			logging::log(LOG_NOTICE, "%u slow requests not logged", suppressed - max_logged_per_second);
+	}
+
+	return logged_this_second.fetch_add(1, std::memory_order_relaxed) < max_logged_per_second;
+}
+
+void
+finish(std::unique_ptr<request_trace> t)
+{
+	if(!t)
+		return;
+
+	auto const threshold = slow_ns.load(std::memory_order_relaxed);
+	auto const begin = start_of(*t);
+	auto const end = t->get(phase::written);
+	if(threshold == 0 || begin == 0 || end < begin || end - begin < threshold)
+		return;
+
+	if(should_log())
+	{
+		logging::log(LOG_NOTICE, "Slow request %s %s: %.3f ms; "
+			"detect %.3f, handshake %.3f, header %.3f, body %.3f, route %.3f, "
+			"sqlite %.3f, render %.3f, handler %.3f, write %.3f",
+			t->method.c_str(), t->target.c_str(),
+			static_cast<double>(end - begin) / 1e6,
+			span(*t, phase::accepted, phase::detected),
+			span(*t, phase::detected, phase::handshaken),
+			span(*t, connection_phase(*t), phase::header_read),
+			span(*t, phase::header_read, phase::body_read),
+			span(*t, phase::body_read, phase::routed),
+			span(*t, phase::sqlite_begin, phase::sqlite_end),
+			span(*t, phase::render_begin, phase::render_end),
+			span(*t, phase::body_read, phase::queued),
+			span(*t, phase::queued, phase::written));
+	}
+
+	std::lock_guard lock{ring_lock};
+	ring[ring_next] = std::move(*t);
+	ring_next = (ring_next + 1) % ring.size();
+	if(ring_count < ring.size())
+		ring_count++;
+}
+
+static void
+append_escaped(std::string& out, std::string_view str)
+{
+	for(char c : str)
+	{
+		if(c == '"' || c == '\\')
+		{
+			out.push_back('\\');
+			out.push_back(c);
+		}
+		else if(static_cast<unsigned char>(c) < 0x20)
+		{
+			char buf[8];
+			std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+			out.append(buf);
+		}
+		else
+		{
+			out.push_back(c);
+		}
+	}
+}
+
+static void
+append_event(std::string& out, bool& first, const request_trace& t, std::size_t tid,
+	std::string_view name, phase from, phase to)
+{
+	auto const a = t.get(from);
+	auto const b = t.get(to);
+	if(a == 0 || b == 0 || b < a)
+		return;
+
+	if(!first)
+		out.push_back(',');
+	first = false;
+
+	char buf[160];
+	std::snprintf(buf, sizeof(buf),
+		"{\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"",
+		tid, static_cast<double>(a) / 1e3, static_cast<double>(b - a) / 1e3);
+	out.append(buf);
+	out.append(name);
+	out.append("\",\"args\":{\"request\":\"");
+	append_escaped(out, t.method);
+	out.push_back(' ');
+	append_escaped(out, t.target);
+	out.append("\"}}");
+}
+
+std::string
+chrome_json()
+{
+	std::string out{"{\"traceEvents\":["};
+	bool first = true;
+
+	std::lock_guard lock{ring_lock};
+
+	// Oldest first, one row per request
+	for(std::size_t i = 0; i < ring_count; i++)
+	{
+		auto const& t = ring[(ring_next + ring.size() - ring_count + i) % ring.size()];
+
+		append_event(out, first, t, i, "request", first_phase(t), phase::written);
+		append_event(out, first, t, i, "detect", phase::accepted, phase::detected);
+		append_event(out, first, t, i, "handshake", phase::detected, phase::handshaken);
+		append_event(out, first, t, i, "read header", connection_phase(t), phase::header_read);
+		append_event(out, first, t, i, "read body", phase::header_read, phase::body_read);
+		append_event(out, first, t, i, "route", phase::body_read, phase::routed);
+		append_event(out, first, t, i, "sqlite", phase::sqlite_begin, phase::sqlite_end);
+		append_event(out, first, t, i, "render", phase::render_begin, phase::render_end);
+		append_event(out, first, t, i, "handler", phase::body_read, phase::queued);
+		append_event(out, first, t, i, "write", phase::queued, phase::written);
+	}
+
+	out.append("]}");
+	return out;
+}
+
+} // namespace trace
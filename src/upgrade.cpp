@@ -0,0 +1,330 @@
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#	define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+#include "log.hpp"
+#include "upgrade.hpp"
+
+extern char** environ;
+
+namespace upgrade
+{
+
+using tcp = boost::asio::ip::tcp;	// from <boost/asio/ip/tcp.hpp>
+
+static const char listen_fds_var[] = "SHADYURL_LISTEN_FDS";
+static const char upgrade_from_var[] = "SHADYURL_UPGRADE_FROM";
+
+// What we need to start ourselves again
+static std::vector<std::string> saved_argv;
+static std::string saved_cwd;
+static std::string saved_exe;	// The installed binary, which an upgrade replaces
+
+// Handed to us by the process we're replacing
+static std::vector<int> inherited;
+static pid_t upgrade_from = 0;
+
+// The new binary we started, until it exits
+static pid_t spawned = 0;
+
+// Where argv[0] was run from, as an absolute path, found the way the shell found it.
+// This is the path, not the file: once a new build is installed there, it's what we run.
+static std::string
+find_executable(const std::string& name)
+{
+	if(name.find('/') != std::string::npos)
+	{
+		if(name.front() == '/' || saved_cwd.empty())
+			return name;
+		return (std::filesystem::path{saved_cwd} / name).lexically_normal().string();
+	}
+
+	const char* path = std::getenv("PATH");
+	std::string_view dirs{path ? path : ""};
+	while(!dirs.empty())
+	{
+		auto const colon = dirs.find(':');
+		std::string dir{dirs.substr(0, colon)};
+		dirs = (colon == std::string_view::npos) ? std::string_view{} : dirs.substr(colon + 1);
+
+		// An empty entry means the current directory
+		std::filesystem::path candidate = std::filesystem::path{dir.empty() ? saved_cwd : dir} / name;
+		if(candidate.is_relative())
+			candidate = std::filesystem::path{saved_cwd} / candidate;
+		if(access(candidate.c_str(), X_OK) == 0)
+			return candidate.lexically_normal().string();
+	}
+
+	return {};
+}
+
+static void
+set_cloexec(int fd, bool on)
+{
+	int flags = fcntl(fd, F_GETFD);
+	if(flags == -1)
+		return;
+
+	(void)fcntl(fd, F_SETFD, on ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
+}
+
+// Mark every fd from lowest up close-on-exec. Called between fork and exec,
+// so only system calls: no allocation, no stdio, no readdir.
+static void
+cloexec_from(int lowest, long fallback_max)
+{
+#ifdef SYS_close_range
+	// Linux 5.11 and later do it in one go, however many fds there are
+	if(syscall(SYS_close_range, static_cast<unsigned>(lowest), ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+		return;
+#endif // SYS_close_range
+
+	// Otherwise visit only the fds that are open
+	int dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dir != -1)
+	{
+		struct linux_dirent64
+		{
+			ino64_t d_ino;
+			off64_t d_off;
+			unsigned short d_reclen;
+			unsigned char d_type;
+			char d_name[];
+		};
+
+		alignas(linux_dirent64) char buf[4096];
+		long n;
+		while((n = syscall(SYS_getdents64, dir, buf, sizeof(buf))) > 0)
+		{
+			for(long off = 0; off < n;)
+			{
+				auto const* d = reinterpret_cast<const linux_dirent64*>(buf + off);
+				off += d->d_reclen;
+
+				int fd = 0;
+				const char* c = d->d_name;
+				if(*c < '0' || *c > '9')
+					continue;
+				for(; *c >= '0' && *c <= '9'; c++)
+					fd = fd * 10 + (*c - '0');
+
+				if(fd >= lowest && fd != dir)
+					set_cloexec(fd, true);
+			}
+		}
+
+		close(dir);
+		if(n == 0)
+			return;
+	}
+
+	// No /proc either, so try every fd we could have
+	for(long fd = lowest; fd < fallback_max; fd++)
+		set_cloexec(static_cast<int>(fd), true);
+}
+
+void
+init(char* argv[])
+{
+	for(; *argv; argv++)
+		saved_argv.emplace_back(*argv);
+
+	std::error_code ec;
+	saved_cwd = std::filesystem::current_path(ec).string();
+	if(!saved_argv.empty())
+		saved_exe = find_executable(saved_argv.front());
+
+	const char* from = std::getenv(upgrade_from_var);
+	const char* fds = std::getenv(listen_fds_var);
+	if(!from || !fds)
+		return;
+
+	upgrade_from = static_cast<pid_t>(std::atoi(from));
+
+	std::string_view list{fds};
+	while(!list.empty())
+	{
+		auto const comma = list.find(',');
+		std::string fd_str{list.substr(0, comma)};
+		list = (comma == std::string_view::npos) ? std::string_view{} : list.substr(comma + 1);
+
+		int fd = std::atoi(fd_str.c_str());
+		if(fd < 3 || fcntl(fd, F_GETFD) == -1)
+			continue;
+
+		// Don't leak them into anything we start later
+		set_cloexec(fd, true);
+		inherited.push_back(fd);
+	}
+
+	// These aren't meant for any later upgrade
+	unsetenv(listen_fds_var);
+	unsetenv(upgrade_from_var);
+}
+
+bool
+is_upgrade()
+{
+	return upgrade_from != 0;
+}
+
+int
+take_listener(const tcp::endpoint& endpoint)
+{
+	for(auto it = inherited.begin(); it != inherited.end(); ++it)
+	{
+		tcp::endpoint local;
+		socklen_t len = static_cast<socklen_t>(local.capacity());
+		if(getsockname(*it, local.data(), &len) == -1)
+			continue;
+		local.resize(len);
+
+		if(local == endpoint)
+		{
+			int fd = *it;
+			inherited.erase(it);
+			return fd;
+		}
+	}
+
+	return -1;
+}
+
+void
+close_unused()
+{
+	for(int fd : inherited)
+	{
+		logging::log(LOG_NOTICE, "Closing inherited socket %d, nothing is configured to listen on it", fd);
+		(void)close(fd);
+	}
+
+	inherited.clear();
+}
+
+void
+notify_ready()
+{
+	if(upgrade_from == 0)
+		return;
+
+	if(kill(upgrade_from, SIGQUIT) == -1)
+		logging::log(LOG_WARNING, "Could not tell old process %d to stop: %s",
+			static_cast<int>(upgrade_from), strerror(errno));
+	else
+		logging::log(LOG_INFO, "Took over from process %d", static_cast<int>(upgrade_from));
+
+	upgrade_from = 0;
+}
+
+bool
+spawn(const std::vector<int>& fds)
+{
+	if(saved_argv.empty())
+	{
+		logging::log(LOG_ERR, "Can't upgrade, upgrade::init() wasn't called");
+		return false;
+	}
+
+	// Everything the child needs is built up front, since only
+	// async-signal-safe calls are allowed between fork and exec.
+	std::string fd_list;
+	for(int fd : fds)
+	{
+		if(!fd_list.empty())
+			fd_list.push_back(',');
+		fd_list.append(std::to_string(fd));
+	}
+
+	std::vector<std::string> env_strings;
+	for(char** e = environ; *e; e++)
+	{
+		std::string_view var{*e};
+		if(var.starts_with(listen_fds_var) || var.starts_with(upgrade_from_var))
+			continue;
+		env_strings.emplace_back(var);
+	}
+	env_strings.push_back(std::string(listen_fds_var) + "=" + fd_list);
+	env_strings.push_back(std::string(upgrade_from_var) + "=" + std::to_string(getpid()));
+
+	std::vector<char*> argv;
+	for(auto& arg : saved_argv)
+		argv.push_back(arg.data());
+	argv.push_back(nullptr);
+
+	std::vector<char*> envp;
+	for(auto& var : env_strings)
+		envp.push_back(var.data());
+	envp.push_back(nullptr);
+
+	// Only used if neither close_range() nor /proc is there; the soft limit has
+	// been raised as far as it goes, so this can be large
+	struct rlimit rl;
+	long maxfd = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) ?
+		static_cast<long>(rl.rlim_cur) : sysconf(_SC_OPEN_MAX);
+	if(maxfd == -1)
+		maxfd = 65536;
+
+	pid_t pid = fork();
+	if(pid == -1)
+	{
+		logging::log(LOG_ERR, "Could not fork(): %s", strerror(errno));
+		return false;
+	}
+
+	if(pid == 0)
+	{
+		// Only the listening sockets are passed on; client connections must stay ours
+		// alone, or closing them here wouldn't close them.
+		cloexec_from(3, maxfd);
+		for(int fd : fds)
+			set_cloexec(fd, false);
+
+		if(!saved_cwd.empty() && chdir(saved_cwd.c_str()) == -1)
+			_exit(127);
+
+		// Run whatever's installed now. /proc/self/exe is the file we were started from,
+		// which is the old build if a new one was installed over it, so it's a last resort.
+		if(!saved_exe.empty())
+			execve(saved_exe.c_str(), argv.data(), envp.data());
+		execve("/proc/self/exe", argv.data(), envp.data());
+		_exit(127);
+	}
+
+	logging::log(LOG_INFO, "Started new binary as process %d", static_cast<int>(pid));
+	spawned = pid;
+	return true;
+}
+
+void
+child_exited(pid_t pid)
+{
+	if(pid == spawned)
+		spawned = 0;
+}
+
+pid_t
+successor()
+{
+	return spawned;
+}
+
+} // namespace upgrade
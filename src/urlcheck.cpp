@@ -0,0 +1,408 @@
+#if defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#	define URLCHECK_X86
+#endif
+
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "urlcheck.hpp"
+
+namespace urlcheck
+{
+
+// The scanning kernels find the next byte the decoder has to look at:
+// '%', '+', or a control character.
+using scan_fn = const char* (*)(const char*, const char*);
+
+static inline bool
+is_special(unsigned char c)
+{
+	return c == '%' || c == '+' || c < 0x20 || c == 0x7f;
+}
+
+static inline bool
+is_control(unsigned char c)
+{
+	return c < 0x20 || c == 0x7f;
+}
+
+static const char*
+scan_scalar(const char* p, const char* end)
+{
+	for(; p < end; p++)
+	{
+		if(is_special(static_cast<unsigned char>(*p)))
+			return p;
+	}
+
+	return end;
+}
+
+#ifdef URLCHECK_X86
+// One PCMPESTRI per 16 bytes, matching against four byte ranges at once
+__attribute__((target("sse4.2")))
+static const char*
+scan_sse42(const char* p, const char* end)
+{
+	alignas(16) static const char ranges[16] = {'\x00', '\x1f', '\x7f', '\x7f', '%', '%', '+', '+'};
+	const __m128i set = _mm_load_si128(reinterpret_cast<const __m128i*>(ranges));
+
+	while(end - p >= 16)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		int idx = _mm_cmpestri(set, 8, chunk, 16,
+			_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+		if(idx < 16)
+			return p + idx;
+
+		p += 16;
+	}
+
+	return scan_scalar(p, end);
+}
+
+// Compare 32 bytes at a time against each special
+__attribute__((target("avx2")))
+static const char*
+scan_avx2(const char* p, const char* end)
+{
+	const __m256i percent = _mm256_set1_epi8('%');
+	const __m256i plus = _mm256_set1_epi8('+');
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	const __m256i ctl = _mm256_set1_epi8(0x1f);
+
+	while(end - p >= 32)
+	{
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+
+		// c <= 0x1f (unsigned) iff min(c, 0x1f) == c
+		__m256i is_ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, ctl), chunk);
+		__m256i mask = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(chunk, percent), _mm256_cmpeq_epi8(chunk, plus)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(chunk, del), is_ctl));
+
+		unsigned bits = static_cast<unsigned>(_mm256_movemask_epi8(mask));
+		if(bits)
+			return p + __builtin_ctz(bits);
+
+		p += 32;
+	}
+
+	return scan_scalar(p, end);
+}
+#endif // URLCHECK_X86
+
+struct kernel
+{
+	scan_fn scan;
+	std::string_view name;
+	bool (*usable)();
+};
+
+// Every kernel built in, best first
+static const kernel all_kernels[] = {
+#ifdef URLCHECK_X86
+	{scan_avx2, "avx2", [] { __builtin_cpu_init(); return __builtin_cpu_supports("avx2") != 0; }},
+	{scan_sse42, "sse4.2", [] { __builtin_cpu_init(); return __builtin_cpu_supports("sse4.2") != 0; }},
+#endif // URLCHECK_X86
+	{scan_scalar, "scalar", [] { return true; }},
+};
+
+static kernel
+pick_kernel()
+{
+	for(auto const& k : all_kernels)
+	{
+		if(k.usable())
+			return k;
+	}
+
+	return all_kernels[std::size(all_kernels) - 1];
+}
+
+// Picked once, at startup, unless a benchmark or test picks another
+static kernel selected = pick_kernel();
+
+static inline bool
+is_hex(char c)
+{
+	return (c >= '0' && c <= '9') ||
+		(c >= 'a' && c <= 'f') ||
+		(c >= 'A' && c <= 'F');
+}
+
+static inline char
+from_hex(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+
+	return (c | 0x20) - 'a' + 10;
+}
+
+static inline char
+to_lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static inline bool
+is_alnum(char c)
+{
+	return (c >= '0' && c <= '9') ||
+		(c >= 'a' && c <= 'z') ||
+		(c >= 'A' && c <= 'Z');
+}
+
+// Check the structure of a URL, normalising the scheme and host to lower case
+static url_error
+normalise(std::string& url)
+{
+	auto const colon = url.find(':');
+	if(colon == std::string::npos)
+		return url_error::bad_scheme;
+
+	for(std::size_t i = 0; i < colon; i++)
+		url[i] = to_lower(url[i]);
+
+	std::string_view scheme(url.data(), colon);
+	if(scheme != "http" && scheme != "https")
+		return url_error::bad_scheme;
+
+	if(url.compare(colon + 1, 2, "//") != 0)
+		return url_error::bad_scheme;
+
+	auto const auth_begin = colon + 3;
+	auto auth_end = url.find_first_of("/?#", auth_begin);
+	if(auth_end == std::string::npos)
+		auth_end = url.size();
+
+	std::string_view authority(url.data() + auth_begin, auth_end - auth_begin);
+
+	// user:pass@ is only ever used to disguise where a link goes
+	if(authority.find('@') != std::string_view::npos)
+		return url_error::userinfo;
+
+	std::size_t host_end;
+	if(!authority.empty() && authority[0] == '[')
+	{
+		// IPv6 literal
+		host_end = authority.find(']');
+		if(host_end == std::string_view::npos || host_end == 1)
+			return url_error::bad_host;
+
+		for(std::size_t i = 1; i < host_end; i++)
+		{
+			if(!is_hex(authority[i]) && authority[i] != ':' && authority[i] != '.')
+				return url_error::bad_host;
+		}
+
+		host_end++;
+	}
+	else
+	{
+		host_end = authority.find(':');
+		if(host_end == std::string_view::npos)
+			host_end = authority.size();
+
+		std::string_view host = authority.substr(0, host_end);
+		if(host.empty() || host.size() > 253)
+			return url_error::bad_host;
+
+		// Labels must be non-empty and at most 63 bytes; a trailing dot is fine.
+		// Bytes above 0x7f are let through for internationalised names.
+		std::size_t label = 0;
+		for(char c : host)
+		{
+			if(c == '.')
+			{
+				if(label == 0)
+					return url_error::bad_host;
+				label = 0;
+			}
+			else if(is_alnum(c) || c == '-' || c == '_' || static_cast<unsigned char>(c) >= 0x80)
+			{
+				if(++label > 63)
+					return url_error::bad_host;
+			}
+			else
+			{
+				return url_error::bad_host;
+			}
+		}
+	}
+
+	std::string_view port = authority.substr(host_end);
+	if(!port.empty())
+	{
+		if(port[0] != ':')
+			return url_error::bad_host;
+
+		port.remove_prefix(1);
+		if(port.empty() || port.size() > 5)
+			return url_error::bad_port;
+
+		unsigned long n = 0;
+		for(char c : port)
+		{
+			if(c < '0' || c > '9')
+				return url_error::bad_port;
+			n = n * 10 + static_cast<unsigned long>(c - '0');
+		}
+
+		if(n == 0 || n > 65535)
+			return url_error::bad_port;
+	}
+
+	for(std::size_t i = auth_begin; i < auth_begin + host_end; i++)
+		url[i] = to_lower(url[i]);
+
+	// Spaces aren't valid in a URL, but people paste them anyway
+	auto space = url.find(' ', auth_end);
+	if(space != std::string::npos)
+	{
+		std::string encoded;
+		encoded.reserve(url.size() + 16);
+		encoded.append(url, 0, space);
+		for(std::size_t i = space; i < url.size(); i++)
+		{
+			if(url[i] == ' ')
+				encoded.append("%20");
+			else
+				encoded.push_back(url[i]);
+		}
+		url = std::move(encoded);
+	}
+
+	return url_error::none;
+}
+
+url_error
+decode_url(std::string_view encoded, std::string& out)
+{
+	out.resize(encoded.size());
+
+	const char* p = encoded.data();
+	const char* end = p + encoded.size();
+	char* o = out.data();
+
+	while(p < end)
+	{
+		// Copy everything up to the next byte of interest in one go
+		const char* special = selected.scan(p, end);
+		std::memcpy(o, p, special - p);
+		o += special - p;
+		p = special;
+
+		if(p == end)
+			break;
+
+		if(*p == '+')
+		{
+			*o++ = ' ';
+			p++;
+		}
+		else if(*p == '%')
+		{
+			if(end - p >= 3 && is_hex(p[1]) && is_hex(p[2]))
+			{
+				char c = from_hex(p[1]) << 4 | from_hex(p[2]);
+				if(is_control(static_cast<unsigned char>(c)))
+					return url_error::control_character;
+
+				*o++ = c;
+				p += 3;
+			}
+			else
+			{
+				// Invalid escapes are dropped, like parseqs::unquote does
+				p += (end - p >= 3) ? 3 : 1;
+			}
+		}
+		else
+		{
+			return url_error::control_character;
+		}
+	}
+
+	out.resize(o - out.data());
+	return normalise(out);
+}
+
+url_error
+check_url(std::string& url)
+{
+	const char* p = url.data();
+	const char* end = p + url.size();
+
+	while((p = selected.scan(p, end)) != end)
+	{
+		if(is_control(static_cast<unsigned char>(*p)))
+			return url_error::control_character;
+		p++;
+	}
+
+	return normalise(url);
+}
+
+std::string_view
+describe(url_error error)
+{
+	switch(error)
+	{
+	case url_error::none:
+		return "OK";
+	case url_error::control_character:
+		return "URL contains control characters";
+	case url_error::bad_scheme:
+		return "Only http:// and https:// URLs are allowed";
+	case url_error::userinfo:
+		return "URLs with a username or password are not allowed";
+	case url_error::bad_host:
+		return "Invalid host name";
+	case url_error::bad_port:
+		return "Invalid port";
+	}
+
+	return "Invalid URL";
+}
+
+std::string_view
+kernel_name()
+{
+	return selected.name;
+}
+
+std::vector<std::string_view>
+kernels()
+{
+	std::vector<std::string_view> names;
+	for(auto const& k : all_kernels)
+	{
+		if(k.usable())
+			names.push_back(k.name);
+	}
+
+	return names;
+}
+
+bool
+use_kernel(std::string_view name)
+{
+	for(auto const& k : all_kernels)
+	{
+		if(k.name == name && k.usable())
+		{
+			selected = k;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+} // namespace urlcheck
@@ -0,0 +1,846 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include <nlohmann/json.hpp>
+
+#include "bulk.hpp"
+#include "generate.hpp"
+#include "sqlite_helper.hpp"
+#include "urlcheck.hpp"
+
+// Offline import and export for urls.db, without going through the server.
+//
+// Usage: urldb import [options] <urls.db> [file]
+//        urldb export [options] <urls.db> [file]
+//   --format csv|ndjson	File format (default: from the extension, else csv)
+//   --threads N		Threads checking URLs and making tokens (default: one per core)
+//
+// Without a file, or with -, import reads stdin and export writes stdout.
+//
+// CSV rows are "token,url", or just "url"; NDJSON lines are {"token": ..., "url": ...}
+// objects, or URL strings. Rows without a token get a new one, and tokens given have
+// to look like ours. Both formats start with an optional header, and export writes
+// what import reads.
+//
+// Import streams the rows into a temporary table, then drops duplicate URLs and URLs
+// already stored with set-wide statements, so no row is inserted only to fail on the
+// url index. Everything is one transaction with synchronous off, so stop the server
+// and keep a backup first. A missing urls table is created, and an empty one has its
+// indexes dropped, so the rows go in first and are indexed in one go; an empty table's
+// indexes are made again from their original definitions.
+
+enum class file_format
+{
+	csv,
+	ndjson,
+};
+
+struct options
+{
+	std::string command;
+	std::string db_path;
+	std::string file = "-";
+	std::optional<file_format> format;
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+// One row of an import
+struct row
+{
+	std::string url;
+	std::string token;
+	std::size_t line = 0;
+	bool generated = false;		// The token is ours, so it can be replaced if it clashes
+	std::string_view error;
+};
+
+// Rows are read, checked and staged this many at a time
+constexpr std::size_t batch_rows = 65536;
+
+// Tokens we made are remade this many times if they clash
+constexpr int token_attempts = 3;
+
+// Enough cache to sort the rows and build the indexes mostly in memory
+constexpr int cache_kib = 256 * 1024;
+
+static std::optional<options>
+parse_args(int argc, char* argv[])
+{
+	options opts;
+	std::vector<std::string> positional;
+
+	for(int i = 1; i < argc; i++)
+	{
+		std::string_view arg{argv[i]};
+		if(arg == "--format" && i + 1 < argc)
+		{
+			std::string_view f{argv[++i]};
+			if(f == "csv")
+				opts.format = file_format::csv;
+			else if(f == "ndjson")
+				opts.format = file_format::ndjson;
+			else
+				return std::nullopt;
+		}
+		else if(arg == "--threads" && i + 1 < argc)
+		{
+			opts.threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+			if(opts.threads == 0)
+				return std::nullopt;
+		}
+		else if(arg.starts_with("--"))
+		{
+			return std::nullopt;
+		}
+		else
+		{
+			positional.emplace_back(arg);
+		}
+	}
+
+	if(positional.size() < 2 || positional.size() > 3)
+		return std::nullopt;
+	if(positional[0] != "import" && positional[0] != "export")
+		return std::nullopt;
+
+	opts.command = positional[0];
+	opts.db_path = positional[1];
+	if(positional.size() == 3)
+		opts.file = positional[2];
+
+	if(!opts.format)
+	{
+		auto const ext = std::string_view{opts.file}.substr(std::min(opts.file.size(), opts.file.rfind('.')));
+		opts.format = ext == ".ndjson" || ext == ".jsonl" ? file_format::ndjson : file_format::csv;
+	}
+
+	return opts;
+}
+
+static bool
+iequals(std::string_view a, std::string_view b)
+{
+	return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y)
+	{
+		return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+	});
+}
+
+// Split a CSV record into fields, RFC 4180 style.
+// Returns false if a quoted field carries on past the end of the record.
+static bool
+split_csv(std::string_view record, std::vector<std::string>& fields)
+{
+	fields.clear();
+	fields.emplace_back();
+
+	bool quoted = false;
+	for(std::size_t i = 0; i < record.size(); i++)
+	{
+		char c = record[i];
+		if(quoted)
+		{
+			if(c != '"')
+				fields.back().push_back(c);
+			else if(i + 1 < record.size() && record[i + 1] == '"')
+				fields.back().push_back(record[++i]);
+			else
+				quoted = false;
+		}
+		else if(c == '"')
+			quoted = true;
+		else if(c == ',')
+			fields.emplace_back();
+		else
+			fields.back().push_back(c);
+	}
+
+	return !quoted;
+}
+
+static void
+append_csv_field(std::string& out, std::string_view s)
+{
+	if(s.find_first_of(",\"\r\n") == std::string_view::npos)
+	{
+		out.append(s);
+		return;
+	}
+
+	out.push_back('"');
+	for(char c : s)
+	{
+		if(c == '"')
+			out.push_back('"');
+		out.push_back(c);
+	}
+	out.push_back('"');
+}
+
+// Reads import rows from a stream, one at a time
+class row_reader
+{
+public:
+	row_reader(std::istream& in, file_format f)
+		: in_(in)
+		, format_(f)
+	{
+	}
+
+	// Returns false at the end of the input
+	bool
+	next(row& r)
+	{
+		std::string record;
+		while(read_record(record))
+		{
+			r = row{};
+			r.line = record_line_;
+
+			bool const first = !seen_first_;
+			seen_first_ = true;
+
+			if(format_ == file_format::csv)
+			{
+				// A record that never ends is an error on its own
+				if(!split_csv(record, fields_))
+				{
+					r.url = std::move(record);
+					r.error = "Unterminated quoted field";
+					return true;
+				}
+
+				if(first && is_header())
+					continue;
+
+				if(fields_.size() == 1)
+				{
+					r.url = std::move(fields_[0]);
+				}
+				else if(fields_.size() == 2)
+				{
+					r.token = std::move(fields_[0]);
+					r.url = std::move(fields_[1]);
+				}
+				else
+				{
+					r.url = std::move(record);
+					r.error = "Expected url or token,url";
+				}
+				return true;
+			}
+
+			auto value = nlohmann::json::parse(record, nullptr, false);
+			if(value.is_string())
+			{
+				r.url = value.get<std::string>();
+				return true;
+			}
+
+			if(value.is_object())
+			{
+				auto url = value.find("url");
+				auto token = value.find("token");
+				if(url != value.end() && url->is_string() &&
+					(token == value.end() || token->is_string()))
+				{
+					r.url = url->get<std::string>();
+					if(token != value.end())
+						r.token = token->get<std::string>();
+					return true;
+				}
+			}
+
+			r.url = std::move(record);
+			r.error = "Not a JSON string or {\"url\": ...} object";
+			return true;
+		}
+
+		return false;
+	}
+
+private:
+	// The next non-blank record, which can span lines if a CSV field is quoted
+	bool
+	read_record(std::string& record)
+	{
+		record.clear();
+
+		std::string line;
+		while(std::getline(in_, line))
+		{
+			line_++;
+			if(!line.empty() && line.back() == '\r')
+				line.pop_back();
+
+			if(record.empty())
+			{
+				if(line.find_first_not_of(" \t") == std::string::npos)
+					continue;
+
+				record_line_ = line_;
+				record = std::move(line);
+			}
+			else
+			{
+				record.push_back('\n');
+				record.append(line);
+			}
+
+			// Only CSV has records that carry on to the next line
+			if(format_ == file_format::ndjson || std::count(record.begin(), record.end(), '"') % 2 == 0)
+				return true;
+		}
+
+		return !record.empty();
+	}
+
+	bool
+	is_header() const
+	{
+		if(fields_.size() == 1)
+			return iequals(fields_[0], "url");
+
+		return fields_.size() == 2 && iequals(fields_[0], "token") && iequals(fields_[1], "url");
+	}
+
+	std::istream& in_;
+	file_format format_;
+	std::vector<std::string> fields_;
+	std::size_t line_ = 0;
+	std::size_t record_line_ = 0;
+	bool seen_first_ = false;
+};
+
+// Check the URLs in a batch and give tokens to the rows without them, split over threads
+static void
+prepare_batch(std::vector<row>& rows, unsigned threads)
+{
+	auto work = [&rows](std::size_t begin, std::size_t end)
+	{
+		std::size_t missing = 0;
+		for(std::size_t i = begin; i < end; i++)
+		{
+			auto& r = rows[i];
+			if(!r.error.empty())
+				continue;
+
+			auto const error = urlcheck::check_url(r.url);
+			if(error != urlcheck::url_error::none)
+				r.error = urlcheck::describe(error);
+			else if(!r.token.empty() && !generate::looks_generated(r.token))
+				r.error = "Not a token the server would make";
+			else if(r.token.empty())
+				missing++;
+		}
+
+		// One generator per thread, seeded once
+		auto tokens = generate::generate_random_filenames(missing);
+		std::size_t next = 0;
+		for(std::size_t i = begin; i < end; i++)
+		{
+			auto& r = rows[i];
+			if(r.error.empty() && r.token.empty())
+			{
+				r.token = std::move(tokens[next++]);
+				r.generated = true;
+			}
+		}
+	};
+
+	std::size_t const per_thread = (rows.size() + threads - 1) / threads;
+	std::vector<std::thread> workers;
+	for(std::size_t begin = per_thread; begin < rows.size(); begin += per_thread)
+		workers.emplace_back(work, begin, std::min(rows.size(), begin + per_thread));
+
+	work(0, std::min(rows.size(), per_thread));
+	for(auto& t : workers)
+		t.join();
+}
+
+// A database connection with the statements import and export need
+class database
+{
+public:
+	explicit database(const std::string& path)
+		: db_(sqlite_helper::make_sqlite3_handle(path.c_str()))
+	{
+	}
+
+	~database()
+	{
+		sqlite3_finalize(stage_);
+	}
+
+	explicit operator bool() const
+	{
+		return static_cast<bool>(db_);
+	}
+
+	sqlite3*
+	get() const
+	{
+		return db_.get();
+	}
+
+	const char*
+	error() const
+	{
+		return sqlite3_errmsg(db_.get());
+	}
+
+	bool
+	exec(const char* sql)
+	{
+		return sqlite3_exec(db_.get(), sql, nullptr, nullptr, nullptr) == SQLITE_OK;
+	}
+
+	// Run a statement and return the number of rows it changed, or -1 on error
+	long long
+	changes(const char* sql)
+	{
+		if(!exec(sql))
+			return -1;
+		return sqlite3_changes(db_.get());
+	}
+
+	// Run a query for a single number
+	std::optional<long long>
+	scalar(const char* sql)
+	{
+		sqlite3_stmt* stmt = nullptr;
+		sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(stmt); }};
+
+		if(sqlite3_prepare_v2(db_.get(), sql, -1, &stmt, nullptr) != SQLITE_OK ||
+			sqlite3_step(stmt) != SQLITE_ROW)
+			return std::nullopt;
+
+		return sqlite3_column_int64(stmt, 0);
+	}
+
+	// Run a query and return the first column of every row, or nothing on error
+	std::optional<std::vector<std::string>>
+	texts(const char* sql)
+	{
+		sqlite3_stmt* stmt = nullptr;
+		sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(stmt); }};
+
+		if(sqlite3_prepare_v2(db_.get(), sql, -1, &stmt, nullptr) != SQLITE_OK)
+			return std::nullopt;
+
+		std::vector<std::string> values;
+		int rc;
+		while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+			values.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+		if(rc != SQLITE_DONE)
+			return std::nullopt;
+
+		return values;
+	}
+
+	bool
+	stage(const std::vector<row>& rows)
+	{
+		if(!stage_ && sqlite3_prepare_v2(db_.get(),
+				"INSERT INTO temp.staging (url, token, generated) VALUES (?, ?, ?);",
+				-1, &stage_, nullptr) != SQLITE_OK)
+			return false;
+
+		for(auto& r : rows)
+		{
+			if(!r.error.empty())
+				continue;
+
+			sqlite3_bind_text(stage_, 1, r.url.data(), static_cast<int>(r.url.size()), SQLITE_STATIC);
+			sqlite3_bind_text(stage_, 2, r.token.data(), static_cast<int>(r.token.size()), SQLITE_STATIC);
+			sqlite3_bind_int(stage_, 3, r.generated);
+			if(sqlite3_step(stage_) != SQLITE_DONE)
+				return false;
+			sqlite3_reset(stage_);
+		}
+
+		return true;
+	}
+
+private:
+	sqlite_helper::sqlite3_handle db_;
+	sqlite3_stmt* stage_ = nullptr;
+};
+
+// Insert the staged rows into a urls table that has its indexes.
+// A token that's taken, by a stored URL or one earlier in the file, is skipped by the
+// index; the rows left over are given new tokens if they were ours, and tried again.
+// Returns false on error.
+static bool
+insert_staged(database& db, long long& imported, long long& clashes)
+{
+	for(int attempt = 0; ; attempt++)
+	{
+		auto const inserted = db.changes("INSERT OR IGNORE INTO main.urls (token, url) "
+			"SELECT token, url FROM temp.staging;");
+		if(inserted < 0)
+			return false;
+		imported += inserted;
+
+		// Whatever's left clashed
+		if(db.changes("DELETE FROM temp.staging WHERE url IN (SELECT url FROM main.urls);") < 0)
+			return false;
+
+		// Tokens given in the file that are taken lose out, as do ours after a few tries
+		auto const dropped = db.changes(attempt + 1 < token_attempts ?
+			"DELETE FROM temp.staging WHERE NOT generated;" : "DELETE FROM temp.staging;");
+		if(dropped < 0)
+			return false;
+		clashes += dropped;
+
+		std::vector<sqlite3_int64> rowids;
+		{
+			sqlite3_stmt* stmt = nullptr;
+			sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(stmt); }};
+			if(sqlite3_prepare_v2(db.get(), "SELECT rowid FROM temp.staging;", -1, &stmt, nullptr) != SQLITE_OK)
+				return false;
+
+			int rc;
+			while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+				rowids.push_back(sqlite3_column_int64(stmt, 0));
+			if(rc != SQLITE_DONE)
+				return false;
+		}
+
+		if(rowids.empty())
+			return true;
+
+		auto tokens = generate::generate_random_filenames(rowids.size());
+		sqlite3_stmt* update = nullptr;
+		sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(update); }};
+		if(sqlite3_prepare_v2(db.get(), "UPDATE temp.staging SET token = ? WHERE rowid = ?;",
+				-1, &update, nullptr) != SQLITE_OK)
+			return false;
+
+		for(std::size_t i = 0; i < rowids.size(); i++)
+		{
+			sqlite3_bind_text(update, 1, tokens[i].data(), static_cast<int>(tokens[i].size()), SQLITE_STATIC);
+			sqlite3_bind_int64(update, 2, rowids[i]);
+			if(sqlite3_step(update) != SQLITE_DONE)
+				return false;
+			sqlite3_reset(update);
+		}
+	}
+}
+
+static int
+fail(database& db, const char* what)
+{
+	std::fprintf(stderr, "%s: %s\n", what, db.error());
+	return EXIT_FAILURE;
+}
+
+static int
+run_import(const options& opts, std::istream& in)
+{
+	using clock = std::chrono::steady_clock;
+	auto const start = clock::now();
+
+	database db{opts.db_path};
+	if(!db)
+	{
+		std::fprintf(stderr, "Could not open %s\n", opts.db_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	// Nothing is synced until the end, and a crash part way through can lose the database
+	if(!db.exec("PRAGMA synchronous = OFF;") ||
+		!db.exec(("PRAGMA cache_size = -" + std::to_string(cache_kib) + ";").c_str()) ||
+		!db.exec("BEGIN IMMEDIATE;"))
+		return fail(db, "Could not start the import");
+
+	// An empty table is loaded without its indexes, which are built in one go at the end
+	auto const tables = db.scalar("SELECT count(*) FROM sqlite_master WHERE type = 'table' AND name = 'urls';");
+	if(!tables)
+		return fail(db, "Could not read the schema");
+
+	bool fresh = *tables == 0;
+	if(!fresh)
+	{
+		auto const stored = db.scalar("SELECT EXISTS (SELECT 1 FROM urls);");
+		if(!stored)
+			return fail(db, "Could not read urls");
+		fresh = *stored == 0;
+	}
+
+	std::vector<std::string> indexes;
+	if(*tables == 0)
+	{
+		if(!db.exec("CREATE TABLE urls (token VARCHAR NOT NULL, url VARCHAR NOT NULL);"))
+			return fail(db, "Could not create urls");
+
+		indexes = {
+			"CREATE UNIQUE INDEX urls_url ON urls (url);",
+			"CREATE UNIQUE INDEX urls_token ON urls (token);",
+		};
+	}
+	else if(fresh)
+	{
+		// Keep the table as it is. Indexes from UNIQUE constraints have no sql and can't
+		// be dropped, so the rows go in through those.
+		constexpr const char* where = " FROM sqlite_master WHERE type = 'index' AND tbl_name = 'urls' "
+			"AND sql IS NOT NULL ORDER BY rowid;";
+		auto const names = db.texts((std::string{"SELECT name"} + where).c_str());
+		auto const sql = db.texts((std::string{"SELECT sql"} + where).c_str());
+		if(!names || !sql || names->size() != sql->size())
+			return fail(db, "Could not read the schema");
+
+		for(auto const& name : *names)
+		{
+			std::string drop = "DROP INDEX \"";
+			for(char c : name)
+				drop.append(c == '"' ? 2 : 1, c);
+			drop += "\";";
+			if(!db.exec(drop.c_str()))
+				return fail(db, "Could not drop indexes");
+		}
+
+		indexes = std::move(*sql);
+	}
+
+	if(!db.exec("CREATE TEMP TABLE staging (url TEXT NOT NULL, token TEXT NOT NULL, generated INTEGER NOT NULL);"))
+		return fail(db, "Could not create the staging table");
+
+	row_reader reader{in, *opts.format};
+	std::size_t read = 0;
+	std::size_t rejected = 0;
+
+	auto read_batch = [&]
+	{
+		std::vector<row> rows;
+		rows.reserve(batch_rows);
+		row r;
+		while(rows.size() < batch_rows && reader.next(r))
+			rows.push_back(std::move(r));
+		read += rows.size();
+		return rows;
+	};
+
+	auto report = [&](const std::vector<row>& rows)
+	{
+		for(auto& r : rows)
+		{
+			if(r.error.empty())
+				continue;
+			rejected++;
+			std::fprintf(stderr, "line %zu: %.*s\n", r.line, static_cast<int>(r.error.size()), r.error.data());
+		}
+	};
+
+	// Rows are checked and given tokens on other threads while the last batch is staged
+	std::vector<row> staged;
+	for(auto rows = read_batch(); !rows.empty(); rows = read_batch())
+	{
+		auto prepared = std::async(std::launch::async, [&rows, threads = opts.threads]
+		{
+			prepare_batch(rows, threads);
+			return std::move(rows);
+		});
+
+		if(!db.stage(staged))
+			return fail(db, "Could not stage rows");
+		report(staged);
+
+		staged = prepared.get();
+	}
+	if(!db.stage(staged))
+		return fail(db, "Could not stage rows");
+	report(staged);
+
+	auto const loaded = clock::now();
+
+	// URLs are deduplicated as a set, so no insert fails on the url index
+	auto const duplicates = db.changes("DELETE FROM temp.staging WHERE rowid NOT IN "
+		"(SELECT min(rowid) FROM temp.staging GROUP BY url);");
+	auto const existing = db.changes("DELETE FROM temp.staging WHERE url IN (SELECT url FROM main.urls);");
+	if(duplicates < 0 || existing < 0)
+		return fail(db, "Could not deduplicate rows");
+
+	long long imported = 0;
+	long long clashes = 0;
+	if(fresh)
+	{
+		// Tokens almost never clash, so the token index finds out if they do.
+		// If the rows or an index can't go in, start again with the indexes in place.
+		std::size_t built = 0;
+		imported = db.changes("INSERT INTO main.urls (token, url) SELECT token, url FROM temp.staging;");
+		if(imported >= 0)
+		{
+			while(built < indexes.size() && db.exec(indexes[built].c_str()))
+				built++;
+		}
+
+		if(imported < 0 || built < indexes.size())
+		{
+			if(sqlite3_errcode(db.get()) != SQLITE_CONSTRAINT)
+				return fail(db, "Could not insert rows");
+
+			imported = 0;
+			if(!db.exec("DELETE FROM urls;"))
+				return fail(db, "Could not insert rows");
+			for(; built < indexes.size(); built++)
+			{
+				if(!db.exec(indexes[built].c_str()))
+					return fail(db, "Could not create indexes");
+			}
+			if(!insert_staged(db, imported, clashes))
+				return fail(db, "Could not insert rows");
+		}
+	}
+	else if(!insert_staged(db, imported, clashes))
+	{
+		return fail(db, "Could not insert rows");
+	}
+
+	if(!db.exec("DROP TABLE temp.staging;") || !db.exec("COMMIT;"))
+		return fail(db, "Could not commit");
+
+	auto const end = clock::now();
+	auto const seconds = std::chrono::duration<double>(end - start).count();
+	std::fprintf(stderr, "%zu rows read, %lld imported, %lld duplicate URLs, %lld already stored, "
+		"%lld token clashes, %zu rejected\n",
+		read, imported, duplicates, existing, clashes, rejected);
+	std::fprintf(stderr, "%.2f s (%.2f s loading, %.2f s deduplicating and inserting): %.0f rows/s\n",
+		seconds, std::chrono::duration<double>(loaded - start).count(),
+		std::chrono::duration<double>(end - loaded).count(), static_cast<double>(read) / seconds);
+
+	return EXIT_SUCCESS;
+}
+
+static int
+run_export(const options& opts, std::FILE* out)
+{
+	using clock = std::chrono::steady_clock;
+	auto const start = clock::now();
+
+	database db{opts.db_path};
+	if(!db)
+	{
+		std::fprintf(stderr, "Could not open %s\n", opts.db_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	sqlite3_stmt* select = nullptr;
+	sqlite_helper::scope_exit cleanup{[&] { sqlite3_finalize(select); }};
+	if(sqlite3_prepare_v2(db.get(), "SELECT token, url FROM urls;", -1, &select, nullptr) != SQLITE_OK)
+		return fail(db, "Could not read urls");
+
+	std::string buf;
+	buf.reserve(1 << 20);
+	if(*opts.format == file_format::csv)
+		buf.append("token,url\n");
+
+	std::size_t rows = 0;
+	int rc;
+	while((rc = sqlite3_step(select)) == SQLITE_ROW)
+	{
+		std::string_view token{reinterpret_cast<const char*>(sqlite3_column_text(select, 0)),
+			static_cast<std::size_t>(sqlite3_column_bytes(select, 0))};
+		std::string_view url{reinterpret_cast<const char*>(sqlite3_column_text(select, 1)),
+			static_cast<std::size_t>(sqlite3_column_bytes(select, 1))};
+
+		if(*opts.format == file_format::csv)
+		{
+			append_csv_field(buf, token);
+			buf.push_back(',');
+			append_csv_field(buf, url);
+			buf.push_back('\n');
+		}
+		else
+		{
+			buf.append("{\"token\":");
+			bulk::append_json_string(buf, token);
+			buf.append(",\"url\":");
+			bulk::append_json_string(buf, url);
+			buf.append("}\n");
+		}
+
+		rows++;
+		if(buf.size() >= (1 << 20))
+		{
+			std::fwrite(buf.data(), 1, buf.size(), out);
+			buf.clear();
+		}
+	}
+	std::fwrite(buf.data(), 1, buf.size(), out);
+
+	if(rc != SQLITE_DONE)
+		return fail(db, "Could not read urls");
+	if(std::fflush(out) != 0 || std::ferror(out))
+	{
+		std::perror("write");
+		return EXIT_FAILURE;
+	}
+
+	auto const seconds = std::chrono::duration<double>(clock::now() - start).count();
+	std::fprintf(stderr, "%zu rows exported in %.2f s: %.0f rows/s\n",
+		rows, seconds, static_cast<double>(rows) / seconds);
+
+	return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char* argv[])
+{
+	std::ios::sync_with_stdio(false);
+
+	auto opts = parse_args(argc, argv);
+	if(!opts)
+	{
+		std::fprintf(stderr,
+			"Usage: %s import|export [--format csv|ndjson] [--threads N] <urls.db> [file]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(opts->command == "import")
+	{
+		if(opts->file == "-")
+			return run_import(*opts, std::cin);
+
+		std::ifstream in{opts->file, std::ios::binary};
+		if(!in)
+		{
+			std::perror(opts->file.c_str());
+			return EXIT_FAILURE;
+		}
+		return run_import(*opts, in);
+	}
+
+	if(opts->file == "-")
+		return run_export(*opts, stdout);
+
+	std::FILE* out = std::fopen(opts->file.c_str(), "wb");
+	if(!out)
+	{
+		std::perror(opts->file.c_str());
+		return EXIT_FAILURE;
+	}
+
+	int status = run_export(*opts, out);
+	if(std::fclose(out) != 0)
+	{
+		std::perror(opts->file.c_str());
+		return EXIT_FAILURE;
+	}
+	return status;
+}
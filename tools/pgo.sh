@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+#
+# Build shadyurl with profile-guided optimisation.
+#
+# This builds an LTO release as a baseline, then an instrumented build, trains it with
+# the load generator (redirects, posts, templates and static files, over plain HTTP and
+# TLS), rebuilds with the profile, and compares requests per second between the two.
+#
+# Usage: tools/pgo.sh [source dir] [work dir]
+# The optimised build ends up in <work dir>/pgo (default: build-pgo/pgo).
+
+set -euo pipefail
+
+SRCDIR="$(cd "${1:-$(dirname "$0")/..}" && pwd)"
+WORKDIR="${2:-$SRCDIR/build-pgo}"
+CONNECTIONS="${PGO_CONNECTIONS:-16}"
+REQUESTS="${PGO_REQUESTS:-2000}"
+
+DOCROOT="$SRCDIR/server"
+MIMETYPES="$SRCDIR/mimetypes.txt"
+
+mkdir -p "$WORKDIR"
+
+# Set up a build directory, or reconfigure it if it's already there
+configure() {
+	local dir="$1"
+	shift
+	if [ -d "$dir/meson-private" ]; then
+		meson configure "$dir" "$@"
+	else
+		meson setup "$dir" "$SRCDIR" "$@"
+	fi
+}
+
+# Run the load generator and print its requests per second
+measure() {
+	local bench="$1"
+	shift
+	"$bench" --connections "$CONNECTIONS" --requests "$REQUESTS" "$@" "$DOCROOT" "$MIMETYPES" \
+		| sed -n 's/.*: \([0-9]*\) requests\/s.*/\1/p'
+}
+
+echo "Building the LTO baseline"
+configure "$WORKDIR/base" -Dbuildtype=release -Db_lto=true -Db_pgo=off -Dbenchmarks=true >/dev/null
+meson compile -C "$WORKDIR/base" >/dev/null
+
+echo "Building the instrumented binary"
+configure "$WORKDIR/pgo" -Dbuildtype=release -Db_lto=true -Db_pgo=generate -Dbenchmarks=true >/dev/null
+meson compile -C "$WORKDIR/pgo" >/dev/null
+
+echo "Training"
+find "$WORKDIR/pgo" -name '*.gcda' -delete
+# Clang writes raw profiles that have to be merged; GCC writes .gcda files next to the objects
+export LLVM_PROFILE_FILE="$WORKDIR/pgo/pgo-%p.profraw"
+for mode in "" "--tls"; do
+	"$WORKDIR/pgo/bench/bench_load" --connections "$CONNECTIONS" --requests "$REQUESTS" $mode \
+		"$DOCROOT" "$MIMETYPES" >/dev/null
+done
+unset LLVM_PROFILE_FILE
+
+if compgen -G "$WORKDIR/pgo/pgo-*.profraw" >/dev/null; then
+	llvm-profdata merge -output="$WORKDIR/pgo/default.profdata" "$WORKDIR"/pgo/pgo-*.profraw
+	rm -f "$WORKDIR"/pgo/pgo-*.profraw
+fi
+
+echo "Rebuilding with the profile"
+configure "$WORKDIR/pgo" -Db_pgo=use >/dev/null
+meson compile -C "$WORKDIR/pgo" >/dev/null
+
+echo
+printf "%-8s %12s %12s %8s\n" "" "LTO" "LTO+PGO" "change"
+for mode in plain tls; do
+	flag=""
+	if [ "$mode" = tls ]; then
+		flag="--tls"
+	fi
+
+	base=$(measure "$WORKDIR/base/bench/bench_load" $flag)
+	pgo=$(measure "$WORKDIR/pgo/bench/bench_load" $flag)
+	change=$(awk -v b="$base" -v p="$pgo" 'BEGIN { if(b > 0) printf "%+.1f%%", (p - b) * 100 / b; else print "n/a" }')
+	printf "%-8s %12s %12s %8s\n" "$mode" "$base req/s" "$pgo req/s" "$change"
+done
+
+echo
+echo "The optimised server is $WORKDIR/pgo/src/http_server"